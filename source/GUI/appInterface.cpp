@@ -125,7 +125,7 @@ void appInterface::createLayout() {
 	outputFullData = new QPushButton("Output all data");
 	ttt = tr("Output egsphant, transformation, dose, input files, and associated logs to a patient folder.\n"
 			 "Additional metrics selected above can also be output.");
-	outputRT->setToolTip(ttt);
+	outputFullData->setToolTip(ttt);
 	
 	mainLayout->addWidget(parent->doseFrame, 0, 0, 4, 2);
 	mainLayout->addWidget(outputRT         , 4, 0, 1, 2);
@@ -149,6 +149,9 @@ void appInterface::createLayout() {
 void appInterface::connectLayout() {
 	connect(outputRT, SIGNAL(pressed()),
 			this, SLOT(outputRTdose()));
+	
+	connect(outputFullData, SIGNAL(pressed()),
+			this, SLOT(outputAllData()));
 			
 	connect(egsphant, SIGNAL(currentIndexChanged(int)),
 			this, SLOT(loadStructs()));
@@ -263,4 +266,173 @@ void appInterface::loadStructs() {
 		saveDVHBox[i]->setDisabled(true);
 		saveDiffBox[i]->setDisabled(true);
 	}
-}
\ No newline at end of file
+}
+
+void appInterface::outputAllData() {
+	int p = egsphant->currentIndex()-1, t = transform->currentIndex()-1, d = dose->currentIndex()-1;
+	if (d < 0) {
+		QMessageBox::warning(0, "Selection error",
+		tr("No dose selected.  Please select the dose to output."));
+		return;
+	}
+	
+	if (d >= parent->data->localDirDoses.size()) {
+		QMessageBox::warning(0, "Index error",
+		tr("Somehow the selected dose index is larger than the local dose count.  Aborting"));		
+		return;
+	}
+	
+	// Get the patient folder
+	QString folder = QFileDialog::getExistingDirectory(this, tr("Select patient output folder"));
+	if (folder.length() < 1) // No folder selected
+		return;
+	folder += "/";
+	
+	// Copy the selected files into the folder, replacing any from a previous
+	// output, along with the phantom log and the egs_brachy input and log
+	QString doseFile = parent->data->localDirDoses[d]+parent->data->localNameDoses[d];
+	QStringList sources, failed;
+	sources << doseFile;
+	
+	if (p >= 0 && p < parent->data->localDirPhants.size()) {
+		QString phantFile = parent->data->localDirPhants[p]+parent->data->localNamePhants[p];
+		sources << phantFile;
+		QString phantLog = QString(phantFile).remove(QRegExp("\\.b?egsphant(\\.gz)?$"))+".log";
+		if (QFile::exists(phantLog))
+			sources << phantLog;
+	}
+	
+	if (t >= 0 && t < parent->data->localDirTransforms.size())
+		sources << parent->data->localDirTransforms[t]+parent->data->localNameTransforms[t];
+	
+	// Simulation files are saved next to the dose as <run>.egsinp and <run>.egslog,
+	// where the dose is <run>.<geometry>.3ddose
+	QDirIterator files (parent->data->localDirDoses[d], {"*.egsinp","*.egslog"});
+	while (files.hasNext()) {
+		files.next();
+		if (parent->data->localNameDoses[d].startsWith(files.fileInfo().completeBaseName()+"."))
+			sources << files.filePath();
+	}
+	
+	QString target;
+	for (int i = 0; i < sources.size(); i++) {
+		target = folder+sources[i].split("/").last();
+		if (QFile::exists(target) && !QFile::remove(target))
+			failed << target;
+		else if (!QFile::copy(sources[i], target))
+			failed << target;
+	}
+	
+	if (failed.size())
+		QMessageBox::warning(0, "Copy error",
+		tr("Could not write the following files:\n   - ")+failed.join("\n   - "));
+	
+	// Find the contours to output
+	QVector <int> contours;
+	for (int i = 0; i < STRUCT_COUNT; i++)
+		if (contourNameLabel[i]->isEnabled())
+			contours << i;
+	
+	if (p < 0 || contours.isEmpty())
+		return; // No contours, so nothing left to output
+	
+	// Load the dose and masks
+	parent->resetProgress("Loading patient data");
+	double increment = 100.0/double(contours.size()+1);
+	results = new Dose();
+	connect(results, SIGNAL(madeProgress(double)),
+			parent, SLOT(updateProgress(double)));
+	
+	if (doseFile.endsWith(".b3ddose"))
+		results->readBIn(doseFile, contours.size()+1);
+	else if (doseFile.endsWith(".3ddose"))
+		results->readIn(doseFile, contours.size()+1);
+	else {
+		QMessageBox::warning(0, "File error",
+		tr("Selected dose file is not of type 3ddose or b3ddose.  Aborting"));
+		delete results;
+		parent->finishedProgress();
+		return;		
+	}
+	
+	for (int i = 0; i < contours.size(); i++) {
+		masks.append(new EGSPhant());
+		masks.last()->loadgzEGSPhantFile(parent->data->gui_location+"/database/mask/"+contourFileName[contours[i]]);
+		parent->updateProgress(increment);
+	}
+	
+	// Get the dose data of every contour in one pass
+	parent->resetProgress("Extracting contour data");
+	QVector <QVector <DV> > data(contours.size());
+	QVector <double> volume(contours.size());
+	results->getDVs(&data, &masks, &volume, false);
+	
+	QString metrics = "", name, text;
+	int m;
+	for (int i = 0; i < contours.size(); i++) {
+		name = contourNameLabel[contours[i]]->text();
+		
+		// Metrics, using the preset selected for the contour (no Dx, Dcc or Vx for custom)
+		m = loadMetricBox[contours[i]]->currentIndex();
+		if (m >= 0 && m < parent->data->metricDp.size())
+			metrics += results->getMetricCSV(&data[i], volume[i], name, parent->data->metricDx[m],
+											 parent->data->metricDcc[m], parent->data->metricVx[m],
+											 parent->data->metricDp[m])+"\n";
+		else
+			metrics += results->getMetricCSV(&data[i], volume[i], name, "", "", "", "0")+"\n";
+		
+		DVHist hist(&data[i], volume[i]);
+		
+		if (saveDVHBox[contours[i]]->isChecked()) {
+			QList <QPointF> line;
+			hist.cumulative(&line, 200);
+			text = "dose / Gy,% of total volume\n";
+			for (int j = 0; j < line.size(); j++)
+				text += QString::number(line[j].x())+","+QString::number(line[j].y())+"\n";
+			
+			QFile file(folder+name+"_DVH.csv");
+			if (file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+				QTextStream out(&file);
+				out << text;
+				file.close();
+			}
+		}
+		
+		if (saveDiffBox[contours[i]]->isChecked()) {
+			QVector <int> counts;
+			int binCount = parent->data->histogramBinCount;
+			double sInc = (hist.maxDose-hist.minDose)/double(binCount);
+			hist.differential(&counts, binCount);
+			text = "dose / Gy,voxel count\n";
+			for (int j = 0; j < binCount; j++)
+				text += QString::number(hist.minDose+sInc*(j+0.5))+","+QString::number(counts[j])+"\n";
+			
+			QFile file(folder+name+"_differential.csv");
+			if (file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+				QTextStream out(&file);
+				out << text;
+				file.close();
+			}
+		}
+	}
+	
+	QFile metricFile(folder+"metrics.csv");
+	if (!metricFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+		QMessageBox::warning(0, "Metric file error",
+		tr("Could not write metrics to ")+folder+"metrics.csv");
+	}
+	else {
+		QTextStream out(&metricFile);
+		out << metrics;
+		metricFile.close();
+	}
+	
+	// Clean up
+	for (int i = 0; i < masks.size(); i++)
+		delete masks[i];
+	masks.clear();
+	delete results;
+	results = 0;
+	
+	parent->finishedProgress();
+}
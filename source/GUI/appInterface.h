@@ -97,6 +97,9 @@ public slots:
 	// Output just RT Dose
 	void outputRTdose();
 	
+	// Output the patient files along with metrics and DVHs of every contour
+	void outputAllData();
+	
 	// Reset structures
 	void loadStructs();
 public:
@@ -71,6 +71,8 @@ allowedPercentArrs(QRegExp(REGEX_PERCENT_ARR)) {
 
 // Destructor
 doseInterface::~doseInterface() {
+	previewWait(); // Let any render finish before deleting what it draws on
+	
 	delete canvasPic;
 	delete blackPic;
 	delete phantPic;
@@ -106,6 +108,17 @@ void doseInterface::createLayout() {
 	canvas          = new QLabel();
 	canvasChart     = new QChartView();
 	canvasPic       = new QImage();
+	previewWatcher  = new QFutureWatcher <void> (this);
+	previewQueued   = 0;
+	previewTimer    = new QTimer(this);
+	previewTimer->setSingleShot(true);
+	previewTimer->setInterval(PREVIEW_DEBOUNCE);
+	previewDebounced = 0;
+	previewPrefetching = false;
+	previewDirection = 0;
+	previewLoading = false;
+	previewRefine = 0;
+	previewPanning = false;
 	saveDataButton  = new QPushButton("Save data");
 	saveDataButton->setDisabled(true);
 	ttt = tr("Save plot data into csv file.");
@@ -116,6 +129,10 @@ void doseInterface::createLayout() {
 	saveImageButton->setToolTip(ttt);
 	
 	canvasArea->setWidget(canvas);
+	canvas->installEventFilter(this);
+	canvas->setCursor(Qt::OpenHandCursor);
+	ttt = tr("Scroll to zoom in or out about the cursor, and drag to pan.");
+	canvas->setToolTip(ttt);
 				    
 	rendering       = new QFrame();
 	renderingLayout = new QGridLayout();
@@ -295,6 +312,12 @@ void doseInterface::createLayout() {
 	phantLayout->addWidget(densityMin   , 3, 0, 1, 3);
 	phantLayout->addWidget(densityMax   , 3, 3, 1, 3);
 	
+	structBox     = new QCheckBox("Show structures");
+	ttt = tr("Outline the loaded DICOM structures on the preview, each in its own colour.\n"
+			 "Structures are only drawn on z slices, as that is the plane they are contoured on.");
+	structBox->setToolTip(ttt);
+	phantLayout->addWidget(structBox    , 4, 0, 1, 6);
+	
 	phantFrame->setLayout(phantLayout);
 	phantFrame->setFrameStyle(QFrame::StyledPanel | QFrame::Sunken);
 	previewLayout->addWidget(phantFrame);
@@ -412,7 +435,6 @@ void doseInterface::createLayout() {
 	
 	isoFrame->setLayout(isoLayout);
 	isoFrame->setFrameStyle(QFrame::StyledPanel | QFrame::Sunken);
-	isoFrame->setDisabled(true); // Fix/reimplement getContour in dose class
 	previewLayout->addWidget(isoFrame);
 	
 	// Histogram ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ //
@@ -581,6 +603,10 @@ void doseInterface::createLayout() {
 	histRawButton    = new QPushButton("Output raw data");
 	ttt = tr("Save the sorted data of all voxels that were not filtered out in csv format.\nFile sizes may become very large.");
 	histRawButton->setToolTip(ttt);
+	histSurfaceButton = new QPushButton("Output isodose surfaces");
+	ttt = tr("Save the isodose surfaces at each Vx (% of prescription) of the unfiltered doses as PLY or STL\n"
+			 " meshes in cm, along with a csv file of the volumes they enclose.");
+	histSurfaceButton->setToolTip(ttt);
 	
 	histOutputFrame  = new QFrame();
 	histOutputLayout = new QGridLayout();
@@ -598,6 +624,7 @@ void doseInterface::createLayout() {
 	histOutputLayout->addWidget(histCalcButton , 3, 0, 1, 2);
 	histOutputLayout->addWidget(histSaveButton , 3, 2, 1, 2);
 	histOutputLayout->addWidget(histRawButton  , 3, 4, 1, 2);
+	histOutputLayout->addWidget(histSurfaceButton, 4, 0, 1, 6);
 	
 	for (int i = 0; i < 6; i++)
 		histOutputLayout->setColumnStretch(i, 5);
@@ -843,6 +870,8 @@ void doseInterface::connectLayout() {
 	// Egsphant
 	connect(phantSelect, SIGNAL(currentIndexChanged(int)),
 			this, SLOT(loadEgsphant()));
+	connect(structBox, SIGNAL(toggled(bool)),
+			this, SLOT(previewRenderLive())); // Only the composite changes
 	connect(mediaButton, SIGNAL(toggled(bool)),
 			this, SLOT(previewPhantRenderLive()));
 	connect(mediaButton, SIGNAL(toggled(bool)),
@@ -856,6 +885,12 @@ void doseInterface::connectLayout() {
 	connect(densityMax, SIGNAL(textEdited(QString)),
 			this, SLOT(previewPhantRenderLive()));
 	
+	// Background layers
+	connect(previewWatcher, SIGNAL(finished()),
+			this, SLOT(previewLayersDone()));
+	connect(previewTimer, SIGNAL(timeout()),
+			this, SLOT(previewDebounceDone()));
+	
 	// Map
 	connect(mapDoseBox, SIGNAL(currentIndexChanged(int)),
 			this, SLOT(loadMapDose()));
@@ -864,7 +899,7 @@ void doseInterface::connectLayout() {
 	connect(mapMaxDose, SIGNAL(textEdited(QString)),
 			this, SLOT(previewMapRenderLive()));
 	connect(mapOpacSlider, SIGNAL(valueChanged(int )),
-			this, SLOT(previewMapRenderLive()));
+			this, SLOT(previewRenderLive())); // Only the composite changes
 	
 	// Isodose
 	QSignalMapper* sigMap = new QSignalMapper(this); // Should get deleted as a child of this
@@ -920,6 +955,8 @@ void doseInterface::connectLayout() {
 			this, SLOT(outputMetrics()));
 	connect(histRawButton, SIGNAL(pressed()),
 			this, SLOT(outputRawData()));
+	connect(histSurfaceButton, SIGNAL(pressed()),
+			this, SLOT(outputSurfaces()));
 	
 	// Profile ~~~~~~~~~~~~~~
 	connect(profPhantSelect, SIGNAL(currentIndexChanged(int)),
@@ -959,6 +996,7 @@ void doseInterface::resetLayout() {
 
 // Delete loaded doses, called when repopulating dose
 void doseInterface::resetDoses() {
+	clearHistCache();
 	for (int i = histDoses.size()-1; i >= 0; i--)
 		delete histDoses[i];
 	histDoses.clear();
@@ -1117,6 +1155,7 @@ void doseInterface::previewChangeAxis() {
 		depthLabel->setText("z depth");
 	}
 	
+	previewDirection = 0;
 	previewCanvasRenderLive();
 }
 
@@ -1200,194 +1239,468 @@ void doseInterface::previewRefresh() {
 	}
 }
 	
-void doseInterface::previewCanvasRenderLive() {if(renderCheckBox->isChecked()) previewCanvasRender();}
+void doseInterface::previewCanvasRenderLive() {if(renderCheckBox->isChecked()) previewSchedule(PREVIEW_ALL);}
 void doseInterface::previewCanvasRender() {
-	int width  = abs(horBoundaryMax->text().toDouble() - horBoundaryMin->text().toDouble())*resolutionScale->text().toInt();
-	int height = abs(vertBoundaryMax->text().toDouble() - vertBoundaryMin->text().toDouble())*resolutionScale->text().toInt();
-	*blackPic = blackPic->scaled(width,height);
-	
 	// Invoke all subrenders to reflect the change to the axes
-	previewPhantRender();
-	previewMapRender();
-	previewIsoRender();
-	
-	previewRender();
+	previewLayers(PREVIEW_ALL);
 }
 
-void doseInterface::previewPhantRenderLive() {if(renderCheckBox->isChecked()) previewPhantRender();}
+void doseInterface::previewPhantRenderLive() {if(renderCheckBox->isChecked()) previewSchedule(PREVIEW_PHANT);}
 void doseInterface::previewPhantRender() {
-	if (phantSelect->currentIndex() < 1) 
+	previewLayers(PREVIEW_PHANT);
+}
+
+void doseInterface::previewMapRenderLive() {if(renderCheckBox->isChecked()) previewSchedule(PREVIEW_MAP);}
+void doseInterface::previewMapRender() {
+	previewLayers(PREVIEW_MAP);
+}
+
+void doseInterface::previewIsoRenderLive() {if(renderCheckBox->isChecked()) previewSchedule(PREVIEW_ISO);}
+void doseInterface::previewIsoRender() {
+	previewLayers(PREVIEW_ISO);
+}
+
+void doseInterface::previewSchedule(int layers) {
+	// Restart the timer on every edit, so a burst of them renders once
+	previewDebounced |= layers;
+	previewTimer->start();
+}
+
+void doseInterface::previewDebounceDone() {
+	int layers = previewDebounced;
+	previewDebounced = 0;
+	previewLayers(layers);
+}
+
+void doseInterface::previewLayers(int layers) {
+	// Anything asked for while a render is running is rendered right after it,
+	// and slices being drawn ahead are dropped as they may no longer be wanted
+	if (previewWatcher->isRunning() || previewLoading) {
+		if (previewPrefetching)
+			previewCancel.storeRelease(1);
+		previewQueued |= layers;
 		return;
-		
-	QString axis = xAxisButton->isChecked()?"x axis":(yAxisButton->isChecked()?"y axis":"z axis");
-	double horMin = horBoundaryMin->text().toDouble(), horMax = horBoundaryMax->text().toDouble();
-	double vertMin = vertBoundaryMin->text().toDouble(), vertMax = vertBoundaryMax->text().toDouble();
-	double depth, res;
-	
-	if (horMin > horMax) {
-		depth  = horMin;
-		horMin = horMax;
-		horMax = depth;
 	}
 	
-	if (vertMin > vertMax) {
-		depth   = vertMin;
-		vertMin = vertMax;
-		vertMax = depth;
+	if (layers & PREVIEW_CANVAS) {
+		int width  = abs(horBoundaryMax->text().toDouble() - horBoundaryMin->text().toDouble())*resolutionScale->text().toInt();
+		int height = abs(vertBoundaryMax->text().toDouble() - vertBoundaryMin->text().toDouble())*resolutionScale->text().toInt();
+		*blackPic = blackPic->scaled(width,height);
 	}
-
-	depth = depthMin->text().toDouble();
-	res   = resolutionScale->text().toDouble();
+	
+	// Each selected layer whose parameters changed is taken from the slice
+	// cache or drawn, each isodose set being its own task
+	previewParams params = previewRead(), coarse = params;
+	bool selected[5] = {(layers & PREVIEW_PHANT) && phantSelect->currentIndex(),
+						(layers & PREVIEW_MAP) && mapDoseBox->currentIndex(),
+						(layers & PREVIEW_ISO) && isoDoseBox[0]->currentIndex(),
+						(layers & PREVIEW_ISO) && isoDoseBox[1]->currentIndex(),
+						(layers & PREVIEW_ISO) && isoDoseBox[2]->currentIndex()};
+	
+	// While navigating, layers not drawn at this resolution yet are first drawn
+	// at a coarse level, and only drawn in full once navigation pauses
+	coarse.res = int(params.res)/PREVIEW_COARSE > 1 ? int(params.res)/PREVIEW_COARSE : 1;
+	bool progressive = (layers & PREVIEW_PROGRESSIVE) && coarse.res < params.res;
+	
+	QString key;
+	for (int n = 0; n < 5; n++) {
+		key = params.key(n);
+		if (!selected[n] || key == previewKeys[n])
+			continue;
+		
+		previewKeys[n] = key;
+		previewRefine &= ~(1 << n);
+		previewCoarseKeys[n].clear();
+		if (previewFind(n, key))
+			continue;
 		
-	if (mediaButton->isChecked()) {
-		*phantPic = phant->getEGSPhantPicMed(axis, horMin, horMax, vertMin, vertMax, depth, res);
+		if (progressive) {
+			previewRefine |= 1 << n;
+			previewCoarseKeys[n] = coarse.key(n);
+			previewCoarseScale[n] = params.res/coarse.res;
+			if (!previewFind(n, previewCoarseKeys[n]))
+				previewTasks.append({n, coarse, {previewCoarseKeys[n], QImage(), QVector <QVector <QPolygonF> > ()}, false});
+		}
+		else
+			previewTasks.append({n, params, {key, QImage(), QVector <QVector <QPolygonF> > ()}, false});
 	}
-	else if (densityButton->isChecked()) {
-		*phantPic = phant->getEGSPhantPicDen(axis, horMin, horMax, vertMin, vertMax, depth, res,
-											 densityMin->text().toDouble(),
-											 densityMax->text().toDouble());
+	
+	// Everything was cached, so only the composite needs redoing
+	if (previewTasks.isEmpty()) {
+		previewApply();
+		previewRender();
+		if (previewRefine)
+			previewRefineLayers();
+		return;
 	}
 	
-	previewRenderLive();
+	previewPrefetching = false;
+	previewStart();
 }
 
-void doseInterface::previewMapRenderLive() {if(renderCheckBox->isChecked()) previewMapRender();}
-void doseInterface::previewMapRender() {
-	if (mapDoseBox->currentIndex() < 1)
-		return;
+previewParams doseInterface::previewRead() {
+	previewParams p;
+	p.axis = xAxisButton->isChecked()?X_AXIS:(yAxisButton->isChecked()?Y_AXIS:Z_AXIS);
+	p.horMin = horBoundaryMin->text().toDouble(), p.horMax = horBoundaryMax->text().toDouble();
+	p.vertMin = vertBoundaryMin->text().toDouble(), p.vertMax = vertBoundaryMax->text().toDouble();
 	
-	QString axis = xAxisButton->isChecked()?"x axis":(yAxisButton->isChecked()?"y axis":"z axis");
-	double horMin = horBoundaryMin->text().toDouble(), horMax = horBoundaryMax->text().toDouble();
-	double vertMin = vertBoundaryMin->text().toDouble(), vertMax = vertBoundaryMax->text().toDouble();
-	double depth, res;
-	
-	if (horMin > horMax) {
-		depth  = horMin;
-		horMin = horMax;
-		horMax = depth;
+	if (p.horMin > p.horMax) {
+		p.depth  = p.horMin;
+		p.horMin = p.horMax;
+		p.horMax = p.depth;
 	}
 	
-	if (vertMin > vertMax) {
-		depth   = vertMin;
-		vertMin = vertMax;
-		vertMax = depth;
+	if (p.vertMin > p.vertMax) {
+		p.depth   = p.vertMin;
+		p.vertMin = p.vertMax;
+		p.vertMax = p.depth;
 	}
 
-	depth = depthMin->text().toDouble();
-	res   = resolutionScale->text().toDouble();
+	p.depth = depthMin->text().toDouble();
+	p.res   = resolutionScale->text().toDouble();
+	
+	// Phantom
+	p.media = mediaButton->isChecked(), p.density = densityButton->isChecked();
+	p.denMin = densityMin->text().toDouble(), p.denMax = densityMax->text().toDouble();
+	
+	// Colour map
+	p.mapMin = mapMinDose->text().toDouble(), p.mapMax = mapMaxDose->text().toDouble();
+	p.minColour = mapMinButton->palette().color(QPalette::Button);
+	p.midColour = mapMidButton->palette().color(QPalette::Button);
+	p.maxColour = mapMaxButton->palette().color(QPalette::Button);
 	
-	*mapPic = mapDose->getColourMap(axis, horMin, horMax, vertMin, vertMax, depth, res,
-									mapMinDose->text().toDouble(), mapMaxDose->text().toDouble(),
-									mapMinButton->palette().color(QPalette::Button),
-									mapMidButton->palette().color(QPalette::Button),
-									mapMaxButton->palette().color(QPalette::Button));
+	// Isodose contours
+	for (int j = 0; j < 5; j++)
+		p.doses.append(isoColourDose[j]->text().toDouble());
 	
-	previewRenderLive();
+	return p;
 }
 
-void doseInterface::previewIsoRenderLive() {if(renderCheckBox->isChecked()) previewIsoRender();}
-void doseInterface::previewIsoRender() {
-	if ((isoDoseBox[0]->currentIndex()+isoDoseBox[1]->currentIndex()+isoDoseBox[2]->currentIndex()) < 1)
-		return;
-	
-	QString axis = xAxisButton->isChecked()?"X":(yAxisButton->isChecked()?"Y":"Z");
-	double horMin = horBoundaryMin->text().toDouble(), horMax = horBoundaryMax->text().toDouble();
-	double vertMin = vertBoundaryMin->text().toDouble(), vertMax = vertBoundaryMax->text().toDouble();
-	double depth, res;
+QString previewParams::key(int layer) const {
+	QString view = QString::number(axis)+" "+QString::number(horMin,'g',17)+" "+QString::number(horMax,'g',17)+" "
+				 + QString::number(vertMin,'g',17)+" "+QString::number(vertMax,'g',17)+" "
+				 + QString::number(depth,'g',17)+" "+QString::number(res,'g',17);
+	
+	if (layer < 0)
+		return view;
+	if (layer == 0)
+		return view+(media?" media":(density?" density "+QString::number(denMin,'g',17)+" "+QString::number(denMax,'g',17):""));
+	if (layer == 1)
+		return view+" "+QString::number(mapMin,'g',17)+" "+QString::number(mapMax,'g',17)+" "
+			 + minColour.name()+" "+midColour.name()+" "+maxColour.name();
+	
+	for (int j = 0; j < doses.size(); j++)
+		view += " "+QString::number(doses[j],'g',17);
+	return view;
+}
+
+// Runs on the thread pool, so it only reads task and the files
+void doseInterface::previewDraw(previewTask* task) {
+	const previewParams &p = task->params;
+	
+	if (task->layer == 0 && p.media)
+		task->slice.pic = phant->getEGSPhantPicMed(p.axis, p.horMin, p.horMax, p.vertMin, p.vertMax, p.depth, p.res);
+	else if (task->layer == 0 && p.density)
+		task->slice.pic = phant->getEGSPhantPicDen(p.axis, p.horMin, p.horMax, p.vertMin, p.vertMax, p.depth, p.res,
+												   p.denMin, p.denMax);
+	else if (task->layer == 1)
+		task->slice.pic = mapDose->getColourMap(p.axis, p.horMin, p.horMax, p.vertMin, p.vertMax, p.depth, p.res,
+												p.mapMin, p.mapMax, p.minColour, p.midColour, p.maxColour);
+	else if (task->layer > 1)
+		isoDoses[task->layer-2]->getContour(&task->slice.lines, p.doses, p.axis, p.depth,
+											p.horMin, p.horMax, p.vertMin, p.vertMax, p.res);
+}
+
+void doseInterface::previewStart() {
+	// Build the lookups here, so that the tasks sharing a file only read them
+	if (phantSelect->currentIndex())
+		phant->prepareLookups();
+	if (mapDoseBox->currentIndex())
+		mapDose->prepareLookups();
+	for (int i = 0; i < 3; i++)
+		if (isoDoseBox[i]->currentIndex())
+			isoDoses[i]->prepareLookups();
+	
+	previewCancel.storeRelease(0);
+	previewWatcher->setFuture(QtConcurrent::map(previewTasks, [this](previewTask &task) {
+		if (previewPrefetching && previewCancel.loadAcquire())
+			return;
+		previewDraw(&task);
+		task.done = true;
+	}));
+}
+
+void doseInterface::previewStore(int layer, const previewSlice &slice) {
+	for (int n = 0; n < previewCache[layer].size(); n++)
+		if (previewCache[layer][n].key == slice.key) {
+			previewCache[layer].removeAt(n);
+			break;
+		}
 	
-	if (horMin > horMax) {
-		depth  = horMin;
-		horMin = horMax;
-		horMax = depth;
+	previewCache[layer].prepend(slice);
+	while (previewCache[layer].size() > PREVIEW_CACHE_SLICES)
+		previewCache[layer].removeLast();
+}
+
+const previewSlice* doseInterface::previewFind(int layer, QString key) {
+	for (int n = 0; n < previewCache[layer].size(); n++)
+		if (previewCache[layer][n].key == key) {
+			previewCache[layer].move(n, 0); // Most recently used
+			return &previewCache[layer].first();
+		}
+	return 0;
+}
+
+void doseInterface::previewApply() {
+	QVector <QVector <QPolygonF> >* lines[3] = {&solid, &dashed, &dotted};
+	const previewSlice* slice;
+	double scale;
+	
+	for (int n = 0; n < 5; n++) {
+		scale = 1;
+		if (previewKeys[n].isEmpty())
+			continue;
+		else if (!(slice = previewFind(n, previewKeys[n]))) {
+			// Stretch the coarse level over the canvas until the full one is drawn
+			if (previewCoarseKeys[n].isEmpty() || !(slice = previewFind(n, previewCoarseKeys[n])))
+				continue;
+			scale = previewCoarseScale[n];
+		}
+		
+		if (n < 2 && scale != 1)
+			*(n == 0 ? phantPic : mapPic) = slice->pic.scaled(slice->pic.size()*scale);
+		else if (n < 2)
+			*(n == 0 ? phantPic : mapPic) = slice->pic;
+		else if (scale != 1) {
+			lines[n-2]->resize(slice->lines.size());
+			for (int j = 0; j < slice->lines.size(); j++) {
+				(*lines[n-2])[j].resize(slice->lines[j].size());
+				for (int k = 0; k < slice->lines[j].size(); k++)
+					(*lines[n-2])[j][k] = QTransform::fromScale(scale, scale).map(slice->lines[j][k]);
+			}
+		}
+		else
+			*lines[n-2] = slice->lines;
 	}
+}
+
+void doseInterface::previewRefineLayers() {
+	// Draw the layers that are still shown at their coarse level in full, if
+	// they weren't changed again since
+	previewParams params = previewRead();
+	QString key;
 	
-	if (vertMin > vertMax) {
-		depth   = vertMin;
-		vertMin = vertMax;
-		vertMax = depth;
+	for (int n = 0; n < 5; n++) {
+		key = params.key(n);
+		if ((previewRefine & (1 << n)) && key == previewKeys[n] && !previewFind(n, key))
+			previewTasks.append({n, params, {key, QImage(), QVector <QVector <QPolygonF> > ()}, false});
 	}
+	previewRefine = 0;
+	
+	if (previewTasks.isEmpty())
+		return;
+	
+	previewPrefetching = false;
+	previewStart();
+}
 
-	depth = depthMin->text().toDouble();
-	res   = resolutionScale->text().toDouble();
+void doseInterface::previewPrefetch() {
+	// Draw the next few slices in the direction of travel that aren't cached,
+	// rounding their depths as depthMin will so that their keys match
+	previewParams params = previewRead();
+	bool selected[5] = {phantSelect->currentIndex() > 0, mapDoseBox->currentIndex() > 0,
+						isoDoseBox[0]->currentIndex() > 0, isoDoseBox[1]->currentIndex() > 0,
+						isoDoseBox[2]->currentIndex() > 0};
+	double next;
+	QString key;
+	
+	for (int s = 0; s < PREVIEW_PREFETCH; s++) {
+		next = QString::number(previewStepDepth(params.depth, previewDirection > 0)).toDouble();
+		if (next == params.depth) // No slices left
+			break;
+		params.depth = next;
+		
+		for (int n = 0; n < 5; n++) {
+			key = params.key(n);
+			if (selected[n] && !previewFind(n, key))
+				previewTasks.append({n, params, {key, QImage(), QVector <QVector <QPolygonF> > ()}, false});
+		}
+	}
 	
-	// Fetch the contours
-	QVector <QVector <QLineF> > contour;
-	QVector <double> doses;
+	if (previewTasks.isEmpty())
+		return;
 	
-	for (int j = 0; j < 5; j++)
-		doses.append(isoColourDose[j]->text().toDouble());
+	previewPrefetching = true;
+	previewStart();
+}
+
+void doseInterface::previewLayersDone() {
+	// Cache every slice that got drawn
+	for (int n = 0; n < previewTasks.size(); n++)
+		if (previewTasks[n].done)
+			previewStore(previewTasks[n].layer, previewTasks[n].slice);
+	previewTasks.clear();
 	
-	if (isoDoseBox[0]->currentIndex())
-		isoDoses[0]->getContour(&solid,  doses, axis, depth, horMin, horMax, vertMin, vertMax, res);
-	if (isoDoseBox[1]->currentIndex())
-		isoDoses[1]->getContour(&dashed, doses, axis, depth, horMin, horMax, vertMin, vertMax, res);
-	if (isoDoseBox[2]->currentIndex())
-		isoDoses[2]->getContour(&dotted, doses, axis, depth, horMin, horMax, vertMin, vertMax, res);
+	// Composite the finished layers, unless they were slices drawn ahead
+	if (!previewPrefetching) {
+		previewApply();
+		previewRender();
+	}
+	previewPrefetching = false;
 	
-	previewRenderLive();
+	if (previewLoading)
+		return;
+	
+	// Start anything queued behind them, or draw ahead if stepping through slices
+	if (previewQueued) {
+		int layers = previewQueued;
+		previewQueued = 0;
+		previewLayers(layers);
+	}
+	else if (previewRefine) {
+		previewRefineLayers();
+	}
+	else if (previewDirection) {
+		previewPrefetch();
+	}
+}
+
+void doseInterface::previewWait() {
+	previewWatcher->waitForFinished();
+}
+
+void doseInterface::previewDiscard(int layer) {
+	if (previewPrefetching)
+		previewCancel.storeRelease(1);
+	previewWait();
+	previewLoading = true;
+	
+	// Keep what the other layers finished, and have any they didn't redrawn
+	for (int n = 0; n < previewTasks.size(); n++)
+		if (previewTasks[n].done && previewTasks[n].layer != layer)
+			previewStore(previewTasks[n].layer, previewTasks[n].slice);
+		else if (!previewPrefetching)
+			previewKeys[previewTasks[n].layer].clear();
+	previewTasks.clear();
+	
+	previewCache[layer].clear();
+	previewKeys[layer].clear();
+	previewCoarseKeys[layer].clear();
+	previewRefine &= ~(1 << layer);
 }
 
 void doseInterface::previewRenderLive() {if(renderCheckBox->isChecked()) previewRender();}
 void doseInterface::previewRender() {
-	*canvasPic = *blackPic;
+	// The layers are still being drawn and previewLayersDone composites them, but
+	// slices drawn ahead leave the shown ones alone so those can be composited now
+	if (previewWatcher->isRunning() && !previewPrefetching)
+		return;
 	
-	// Choose base canvas
-	if (phantSelect->currentIndex()) // Not none
-		*canvasPic = *phantPic;
+	previewParams params = previewRead();
 	
-	QPainter paint (canvasPic); // Now use it as our canvas
+	// Choose base canvas, then add the colour map and the isodose contours
+	QImage noMap;
+	const QVector <QVector <QPolygonF> >* lines[3] = {isoDoseBox[0]->currentIndex()?&solid:0,
+													  isoDoseBox[1]->currentIndex()?&dashed:0,
+													  isoDoseBox[2]->currentIndex()?&dotted:0};
+	QVector <QColor> colours;
+	for (int j = 0; j < 5; j++)
+		colours.append(isoColourButton[j]->palette().color(QPalette::Button));
+	
+	*canvasPic = composeSlice(phantSelect->currentIndex() ? *phantPic : *blackPic,
+							  mapDoseBox->currentIndex() ? *mapPic : noMap,
+							  double(mapOpacSlider->value())/100.0, lines, colours,
+							  parent->data->isodoseLineThickness);
+	
+	// Outline the structures on top
+	if (structBox->isChecked()) {
+		previewStructs(params);
+		QPainter paint (canvasPic);
+		QPen pen;
+		pen.setWidth(parent->data->isodoseLineThickness);
+		for (int i = 0; i < structPaths.size(); i++) {
+			pen.setColor(QColor::fromHsv((structIds[i]*137)%360, 255, 255)); // Golden angle hues stay apart
+			paint.setPen(pen);
+			paint.drawPath(structPaths[i]);
+		}
+		paint.end();
+	}
 	
-	// Add colour map
-	paint.setOpacity(double(mapOpacSlider->value())/100.0);
-	if (mapDoseBox->currentIndex()) // Not none
-		paint.drawImage(0,0,*mapPic);
-	paint.setOpacity(1);
+	// Keep the contours in cm so they can be saved with saveData, but leave the
+	// plot data alone if this finished drawing while on another tab
+	if (optionsTab->currentIndex() == 0) {
+		QTransform toCm = QTransform::fromScale(1/params.res, 1/params.res)*QTransform::fromTranslate(params.vertMin, params.horMin);
 		
-	// Add isodose contours
-    QPen pen;
-    pen.setWidth(parent->data->isodoseLineThickness);
-	
-	for (int i = 0; i < 3; i++)
-		if (isoDoseBox[i]->currentIndex()) {			
-			// Setup correct pen
-			switch (i) {
-				case 0:
-					pen.setStyle(Qt::SolidLine);
-					for (int j = 0; j < 5; j++) {
-						pen.setColor(isoColourButton[j]->palette().color(QPalette::Button));
-						paint.setPen(pen);
-						paint.drawLines(solid[j]);
-					}
-					break;
-				case 1:
-					pen.setStyle(Qt::DotLine);
-					for (int j = 0; j < 5; j++) {
-						pen.setColor(isoColourButton[j]->palette().color(QPalette::Button));
-						paint.setPen(pen);
-						paint.drawLines(dashed[j]);
-					}
-					break;
-				case 2:
-					pen.setStyle(Qt::DashLine);
-					for (int j = 0; j < 5; j++) {
-						pen.setColor(isoColourButton[j]->palette().color(QPalette::Button));
-						paint.setPen(pen);
-						paint.drawLines(dotted[j]);
-					}
-					break;
-				default:
-					// do nothing
-					break;
-			}
-		}
+		savePlotName.clear();
+		savePlotData.clear();
+		savePlotX = vertBoundaryLabel->text().left(1)+" / cm";
+		savePlotY = horBoundaryLabel->text().left(1)+" / cm";
 		
-    paint.end();	
+		for (int i = 0; i < 3; i++)
+			if (lines[i])
+				for (int j = 0; j < lines[i]->size() && j < 5; j++)
+					for (int k = 0; k < (*lines[i])[j].size(); k++) {
+						savePlotName.append(isoDoseBox[i]->currentText()+" "+isoColourDose[j]->text()+" Gy");
+						savePlotData.append(toCm.map((*lines[i])[j][k]).toList());
+					}
+		saveDataButton->setDisabled(savePlotData.isEmpty());
+	}
 		
 	canvas->setPixmap(QPixmap::fromImage(*canvasPic));
     canvas->setFixedSize(canvasPic->width(), canvasPic->height());
     canvas->repaint();
 }
 
+// Fetch the contours on the shown slice from the index in Data and transform
+// them into pixels, which only has to be redone when the view changes
+void doseInterface::previewStructs(const previewParams &p) {
+	Data* data = parent->data;
+	QString key = QString::number(data->structRevision)+" "+QString::number(phantSelect->currentIndex())+" "+p.key(-1);
+	if (key == structKey)
+		return;
+	structKey = key;
+	structPaths.clear();
+	structIds.clear();
+	
+	if (p.axis != Z_AXIS)
+		return;
+	
+	// Take the contours within half a voxel of the phantom, or half the gap
+	// between contour planes if no phantom is shown
+	double tol = data->structSpacing > 0 ? data->structSpacing/2.0 : STRUCT_PLANE_TOL;
+	int k;
+	if (phantSelect->currentIndex() && (k = phant->getIndex(Z_AXIS, p.depth)) >= 0 && k < phant->nz)
+		tol = (phant->z[k+1]-phant->z[k])/2.0;
+	
+	const QVector <QPoint>* contours = data->structsAt(p.depth, tol);
+	if (!contours)
+		return;
+	
+	// Image x runs along the phantom x axis and image y along its y axis
+	QTransform toPixels = QTransform::fromTranslate(-p.vertMin, -p.horMin)*QTransform::fromScale(p.res, p.res);
+	QRectF view (p.vertMin, p.horMin, p.vertMax-p.vertMin, p.horMax-p.horMin);
+	QPolygonF poly;
+	int n;
+	
+	for (int i = 0; i < contours->size(); i++) {
+		const QPolygonF &contour = data->structPos[contours->at(i).x()][contours->at(i).y()];
+		if (contour.isEmpty() || !contour.boundingRect().intersects(view)) // Skip contours off of the canvas
+			continue;
+		
+		n = structIds.indexOf(contours->at(i).x());
+		if (n < 0) {
+			n = structIds.size();
+			structIds << contours->at(i).x();
+			structPaths << QPainterPath();
+		}
+		
+		poly = toPixels.map(contour);
+		if (!poly.isClosed())
+			poly << poly.first();
+		structPaths[n].addPolygon(poly);
+	}
+}
+
 void doseInterface::loadEgsphant() {
 	int i = phantSelect->currentIndex()-1;
 	if (i < 0) {return;} // Exit if none is selected or box is empty in setup
@@ -1404,6 +1717,7 @@ void doseInterface::loadEgsphant() {
 	parent->resetProgress("Loading egsphant file");
 	connect(phant, SIGNAL(madeProgress(double)),
 			parent, SLOT(updateProgress(double)));
+	previewDiscard(0); // Stop drawing the previous file and forget its slices
 		
 	if (file.endsWith(".egsphant.gz"))
 		phant->loadgzEGSPhantFilePlus(file);
@@ -1414,10 +1728,12 @@ void doseInterface::loadEgsphant() {
 	else {
 		QMessageBox::warning(0, "File error",
 		tr("Selected file is not of type egsphant.gz, begsphant, or egsphant.  Aborting"));
+		previewLoading = false;
 		parent->finishedProgress();
 		return;		
 	}
 	
+	previewLoading = false;
 	parent->finishedProgress();
 	previewCanvasRenderLive();
 }
@@ -1438,6 +1754,7 @@ void doseInterface::loadMapDose() {
 	parent->resetProgress("Loading 3ddose file");
 	connect(mapDose, SIGNAL(madeProgress(double)),
 			parent, SLOT(updateProgress(double)));
+	previewDiscard(1); // Stop drawing the previous file and forget its slices
 		
 	if (file.endsWith(".b3ddose"))
 		mapDose->readBIn(file, 1);
@@ -1446,10 +1763,17 @@ void doseInterface::loadMapDose() {
 	else {
 		QMessageBox::warning(0, "File error",
 		tr("Selected file is not of type 3ddose or b3ddose.  Aborting"));
+		previewLoading = false;
 		parent->finishedProgress();
 		return;		
 	}
 	
+	// Default the colour window to the bulk of the voxel doses, read off the
+	// histogram computed at load
+	mapMinDose->setText(QString::number(mapDose->getPercentile(0.01),'g',4));
+	mapMaxDose->setText(QString::number(mapDose->getPercentile(0.99),'g',4));
+	
+	previewLoading = false;
 	parent->finishedProgress();
 	previewCanvasRenderLive();
 }
@@ -1470,6 +1794,7 @@ void doseInterface::loadIsoDose(int i) {
 	parent->resetProgress("Loading 3ddose file");
 	connect(isoDoses[i], SIGNAL(madeProgress(double)),
 			parent, SLOT(updateProgress(double)));
+	previewDiscard(2+i); // Stop drawing the previous file and forget its slices
 		
 	if (file.endsWith(".b3ddose"))
 		isoDoses[i]->readBIn(file, 1);
@@ -1478,10 +1803,12 @@ void doseInterface::loadIsoDose(int i) {
 	else {
 		QMessageBox::warning(0, "File error",
 		tr("Selected file is not of type 3ddose or b3ddose.  Aborting"));
+		previewLoading = false;
 		parent->finishedProgress();
 		return;		
 	}
 	
+	previewLoading = false;
 	parent->finishedProgress();
 	previewCanvasRenderLive();
 }
@@ -1592,115 +1919,27 @@ void doseInterface::previewResetBounds() {
 }
 
 void doseInterface::previewSliceUp() {
-	double depth = depthMin->text().toDouble(), newDepth = depthMin->text().toDouble(), tempDepth = depthMin->text().toDouble();
-	int index;
-	bool isReset = false;
+	depthMin->setText(QString::number(previewStepDepth(depthMin->text().toDouble(), true)));
 	
-	QVector <QVector <double> * > depths;
-	QVector <int> sizes;
-	
-	// Add all possible depth indices to depths and sizes
-	if (xAxisButton->isChecked()) {
-		// Phantom
-		if (0 < phantSelect->currentIndex()) {
-			depths.append(&phant->x);
-			sizes.append(phant->nx);
-		}
-		
-		// Colour map
-		if (0 < mapDoseBox->currentIndex()) {
-			depths.append(&mapDose->cx);
-			sizes.append(mapDose->x);
-		}
-		
-		// Isodoses
-		for (int i = 0; i < 3; i++)
-			if (0 < isoDoseBox[i]->currentIndex()) {
-				depths.append(&isoDoses[i]->cx);
-				sizes.append(isoDoses[i]->x);				
-			}
-	}
-	else if (yAxisButton->isChecked()) {
-		// Phantom
-		if (0 < phantSelect->currentIndex()) {
-			depths.append(&phant->y);
-			sizes.append(phant->ny);
-		}
-		
-		// Colour map
-		if (0 < mapDoseBox->currentIndex()) {
-			depths.append(&mapDose->cy);
-			sizes.append(mapDose->y);
-		}
-		
-		// Isodoses
-		for (int i = 0; i < 3; i++)
-			if (0 < isoDoseBox[i]->currentIndex()) {
-				depths.append(&isoDoses[i]->cy);
-				sizes.append(isoDoses[i]->y);				
-			}
-	}
-	else if (zAxisButton->isChecked()) {
-		// Phantom
-		if (0 < phantSelect->currentIndex()) {
-			depths.append(&phant->z);
-			sizes.append(phant->nz);
-		}
-		
-		// Colour map
-		if (0 < mapDoseBox->currentIndex()) {
-			depths.append(&mapDose->cz);
-			sizes.append(mapDose->z);
-		}
-		
-		// Isodoses
-		for (int i = 0; i < 3; i++)
-			if (0 < isoDoseBox[i]->currentIndex()) {
-				depths.append(&isoDoses[i]->cz);
-				sizes.append(isoDoses[i]->z);				
-			}
+	// Render straight away, the slices ahead are drawn once it is done
+	if (renderCheckBox->isChecked()) {
+		previewDirection = 1;
+		previewLayers(PREVIEW_ALL);
 	}
+}
+
+void doseInterface::previewSliceDown() {
+	depthMin->setText(QString::number(previewStepDepth(depthMin->text().toDouble(), false)));
 	
-	
-	for (int i = 0; i < depths.size(); i++) {
-		if (depth < depths[i]->at(0)) {// If below, go to first slice
-			tempDepth = (depths[i]->at(0)+depths[i]->at(1))/2.0;
-		} // And if we aren't already at the final slice
-		else if ((depth+0.05) < ((depths[i]->at(sizes[i]-1)+depths[i]->at(sizes[i]))/2.0)) { 
-			// Get index
-			index = 0;
-			for (int j = 0; j < sizes[i]; j++) {
-				if (depth > depths[i]->at(j))
-					index = j;
-				else
-					break;
-			}
-			
-			// Get midpoint of current slice
-			tempDepth = (depths[i]->at(index)+depths[i]->at(index+1))/2.0;
-			
-			// If current depth is only 0.5 mm below slice center or above center, get next center
-			if ((depth+0.05) >= tempDepth)
-				tempDepth = (depths[i]->at(index+1)+depths[i]->at(index+2))/2.0;
-		}
-		
-		// Set newDepth, unless we already have a newDepth closer to the current point
-		if (!isReset) {
-			newDepth = tempDepth;
-			isReset = true;
-		}
-		else if (abs(tempDepth-depth) < abs(newDepth-depth)) {
-			newDepth = tempDepth;
-		}
+	if (renderCheckBox->isChecked()) {
+		previewDirection = -1;
+		previewLayers(PREVIEW_ALL);
 	}
-	
-	depthMin->setText(QString::number(newDepth));
-	
-	previewCanvasRenderLive();
 }
 
-void doseInterface::previewSliceDown() {
-	double depth = depthMin->text().toDouble(), newDepth = depthMin->text().toDouble(), tempDepth = depthMin->text().toDouble();
+// Get the nearest slice centre of the selected files above or below depth
+double doseInterface::previewStepDepth(double depth, bool up) {
+	double newDepth = depth, tempDepth = depth;
 	int index;
 	bool isReset = false;
 	
@@ -1770,26 +2009,50 @@ void doseInterface::previewSliceDown() {
 	}
 	
 	for (int i = 0; i < depths.size(); i++) {
-		if (depth > depths[i]->last()) {// If below, go to first slice
-			tempDepth = (depths[i]->at(sizes[i]-1)+depths[i]->at(sizes[i]))/2.0;
-			qDebug() << "Setting to top slice center " << tempDepth;
-		} // And if we aren't already at the final slice
-		else if ((depth-0.05) > ((depths[i]->at(0)+depths[i]->at(1))/2.0)) { 
-			// Get index
-			index = 0;
-			for (int j = 0; j < sizes[i]; j++) {
-				if (depth > depths[i]->at(j))
-					index = j;
-				else
-					break;
+		if (up) {
+			if (depth < depths[i]->at(0)) {// If below, go to first slice
+				tempDepth = (depths[i]->at(0)+depths[i]->at(1))/2.0;
+			} // And if we aren't already at the final slice
+			else if ((depth+0.05) < ((depths[i]->at(sizes[i]-1)+depths[i]->at(sizes[i]))/2.0)) { 
+				// Get index
+				index = 0;
+				for (int j = 0; j < sizes[i]; j++) {
+					if (depth > depths[i]->at(j))
+						index = j;
+					else
+						break;
+				}
+				
+				// Get midpoint of current slice
+				tempDepth = (depths[i]->at(index)+depths[i]->at(index+1))/2.0;
+				
+				// If current depth is only 0.5 mm below slice center or above center, get next center
+				if ((depth+0.05) >= tempDepth)
+					tempDepth = (depths[i]->at(index+1)+depths[i]->at(index+2))/2.0;
+			}
+		}
+		else {
+			if (depth > depths[i]->last()) {// If below, go to first slice
+				tempDepth = (depths[i]->at(sizes[i]-1)+depths[i]->at(sizes[i]))/2.0;
+				qDebug() << "Setting to top slice center " << tempDepth;
+			} // And if we aren't already at the final slice
+			else if ((depth-0.05) > ((depths[i]->at(0)+depths[i]->at(1))/2.0)) { 
+				// Get index
+				index = 0;
+				for (int j = 0; j < sizes[i]; j++) {
+					if (depth > depths[i]->at(j))
+						index = j;
+					else
+						break;
+				}
+				
+				// Get midpoint of current slice
+				tempDepth = (depths[i]->at(index)+depths[i]->at(index+1))/2.0;
+				
+				// If current depth is only 0.5 mm above slice center or below center, get next center
+				if ((depth-0.05) <= tempDepth)
+					tempDepth = (depths[i]->at(index-1)+depths[i]->at(index))/2.0;
 			}
-			
-			// Get midpoint of current slice
-			tempDepth = (depths[i]->at(index)+depths[i]->at(index+1))/2.0;
-			
-			// If current depth is only 0.5 mm above slice center or below center, get next center
-			if ((depth-0.05) <= tempDepth)
-				tempDepth = (depths[i]->at(index-1)+depths[i]->at(index))/2.0;
 		}
 		
 		// Set newDepth, unless we already have a newDepth closer to the current point
@@ -1802,9 +2065,86 @@ void doseInterface::previewSliceDown() {
 		}
 	}
 	
-	depthMin->setText(QString::number(newDepth));
+	return newDepth;
+}
+
+bool doseInterface::eventFilter(QObject *object, QEvent *event) {
+	if (object != canvas)
+		return QWidget::eventFilter(object, event);
+	
+	// Scroll to zoom about the cursor
+	if (event->type() == QEvent::Wheel) {
+		QWheelEvent *wheel = static_cast<QWheelEvent*>(event);
+		if (wheel->angleDelta().y())
+			previewZoom(canvas->mapFromGlobal(QCursor::pos()), wheel->angleDelta().y() > 0);
+		return true; // Don't let canvasArea scroll as well
+	}
+	
+	// Drag to pan, tracking the cursor globally as the canvas moves under it
+	QMouseEvent *mouse = static_cast<QMouseEvent*>(event);
+	if (event->type() == QEvent::MouseButtonPress && mouse->button() == Qt::LeftButton) {
+		previewPanning = true;
+		previewPanStart = mouse->globalPos();
+		canvas->setCursor(Qt::ClosedHandCursor);
+		return true;
+	}
+	else if (event->type() == QEvent::MouseMove && previewPanning) {
+		previewPan(mouse->globalPos()-previewPanStart);
+		previewPanStart = mouse->globalPos();
+		return true;
+	}
+	else if (event->type() == QEvent::MouseButtonRelease && previewPanning) {
+		previewPanning = false;
+		canvas->setCursor(Qt::OpenHandCursor);
+		return true;
+	}
+	
+	return QWidget::eventFilter(object, event);
+}
+
+void doseInterface::previewZoom(QPoint pos, bool in) {
+	// Zoom by changing the resolution, so the canvas keeps its size and only the
+	// visible region is drawn, stepping at least one pixel per cm at a time
+	int res = resolutionScale->text().toInt(), newRes;
+	if (in)
+		newRes = int(res*PREVIEW_ZOOM+0.5) > res ? int(res*PREVIEW_ZOOM+0.5) : res+1;
+	else
+		newRes = int(res/PREVIEW_ZOOM+0.5) < res ? int(res/PREVIEW_ZOOM+0.5) : res-1;
+	if (res < 1 || newRes < 1)
+		return;
+	
+	double horMin = horBoundaryMin->text().toDouble(), horMax = horBoundaryMax->text().toDouble();
+	double vertMin = vertBoundaryMin->text().toDouble(), vertMax = vertBoundaryMax->text().toDouble();
+	double horSpan = abs(horMax-horMin)*double(res)/double(newRes);
+	double vertSpan = abs(vertMax-vertMin)*double(res)/double(newRes);
+	horMin = horMin < horMax ? horMin : horMax;
+	vertMin = vertMin < vertMax ? vertMin : vertMax;
+	
+	// Keep the point under the cursor in place, the canvas x axis spans the
+	// vertical bounds and its y axis the horizontal ones
+	vertMin += pos.x()/double(res) - pos.x()/double(newRes);
+	horMin  += pos.y()/double(res) - pos.y()/double(newRes);
+	
+	vertBoundaryMin->setText(QString::number(vertMin));
+	vertBoundaryMax->setText(QString::number(vertMin+vertSpan));
+	horBoundaryMin->setText(QString::number(horMin));
+	horBoundaryMax->setText(QString::number(horMin+horSpan));
+	resolutionScale->setText(QString::number(newRes));
+	
+	previewLayers(PREVIEW_ALL|PREVIEW_PROGRESSIVE);
+}
+
+void doseInterface::previewPan(QPoint delta) {
+	double res = resolutionScale->text().toDouble();
+	if (res <= 0 || delta.isNull())
+		return;
 	
-	previewCanvasRenderLive();
+	vertBoundaryMin->setText(QString::number(vertBoundaryMin->text().toDouble()-delta.x()/res));
+	vertBoundaryMax->setText(QString::number(vertBoundaryMax->text().toDouble()-delta.x()/res));
+	horBoundaryMin->setText(QString::number(horBoundaryMin->text().toDouble()-delta.y()/res));
+	horBoundaryMax->setText(QString::number(horBoundaryMax->text().toDouble()-delta.y()/res));
+	
+	previewLayers(PREVIEW_PHANT|PREVIEW_MAP|PREVIEW_ISO|PREVIEW_PROGRESSIVE);
 }
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ //
@@ -1836,6 +2176,7 @@ void doseInterface::histoRefresh() {
 }
 
 void doseInterface::loadFilterEgsphant() {
+	clearHistCache();
 	localNameMasks.clear();
 	localDirMasks.clear();
 	histMediumView->clear();
@@ -1903,6 +2244,7 @@ void doseInterface::loadFilterEgsphant() {
 }
 
 void doseInterface::loadMaskEgsphant() {
+	clearHistCache();
 	int i = histMaskSelect->currentIndex()-1;
 	if (i < 0) {return;} // Exit if none is selected or box is empty in setup
 	
@@ -1997,6 +2339,7 @@ void doseInterface::deleteHistoDose() {
 	}
 	
 	int i = histLoadedView->currentRow();
+	clearHistCache(histDoses[i]);
 	delete histDoses[i];
 	histDoses.remove(i);
 	delete histLoadedView->currentItem();
@@ -2010,27 +2353,28 @@ void doseInterface::histoRender() {
 	}
 	
 	// Check what filters we have
-	int filterInfo = 0;
+	DVFilter filter;
 	if (histMaskSelect->currentIndex())
-		filterInfo += 1;
+		filter.mask = histMask;
 	
 	QList <QListWidgetItem*> selectedMedia = histMediumView->selectedItems();
-	QString allowedMedia = "", allMedia = EGSPHANT_CHARS;
+	QString allMedia = EGSPHANT_CHARS;
 	if (selectedMedia.size()) {
-		filterInfo += 2;
+		filter.media = histPhant;
 		for (int i = 0; i < selectedMedia.size(); i++)
-			allowedMedia += allMedia[histMediumView->row(selectedMedia[i])];
+			filter.allowedChars += allMedia[histMediumView->row(selectedMedia[i])];
 	}
 	
 	double minDose = histDoseMinEdit->text().toDouble(), maxDose = histDoseMaxEdit->text().toDouble();
 	if (minDose || maxDose) {
-		filterInfo += 4;
+		filter.window = true;
+		filter.minDose = minDose;
+		filter.maxDose = maxDose;
 	}
 	
-	// Get sorted dose arrays
+	// Get dose arrays
 	parent->resetProgress("Creating DVH");
 			
-	QVector <DV> data;
 	double volume;
 	int count = histDoses.size();
 	QVector <QLineSeries*> series;
@@ -2042,35 +2386,18 @@ void doseInterface::histoRender() {
 	savePlotX = savePlotY = "";
 	savePlotData.clear();
 	QList<QPointF> tempData;
+	double minPlot = 0, maxPlot = 0;
 	
 	for (int i = 0; i < count; i++) {				
 		parent->nameProgress("Filtering data");
-		switch (filterInfo) {
-			case 1: // Mask with no media
-				histDoses[i]->getDV(&data, histMask, &volume, count);
-				break;
-			case 2: // Media with no mask
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, &volume, count);
-				break;
-			case 3: // Media and mask
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, histMask, &volume, count);
-				break;
-			case 4: // Dose ranges
-				histDoses[i]->getDV(&data, &volume, minDose, maxDose, count);
-				break;
-			case 5: // Mask with no media and dose ranges
-				histDoses[i]->getDV(&data, histMask, &volume, minDose, maxDose, count);
-				break;
-			case 6: // Media with no mask and dose ranges
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, &volume, minDose, maxDose, count);
-				break;
-			case 7: // Media and mask and dose ranges
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, histMask, &volume, minDose, maxDose, count);
-				break;
-			default: // #nofilter #nomakeup
-				histDoses[i]->getDV(&data, &volume, count);
-				break;
-		}
+		histCacheEntry* entry = histEntry(i, filter, count, false);
+		QVector <DV> &data = entry->data;
+		volume = entry->volume;
+		
+		// Bin the unsorted data
+		DVHist hist(&data, volume);
+		minPlot = hist.minDose;
+		maxPlot = hist.maxDose;
 		
 		// Generate series data
 		tempData.clear();
@@ -2082,24 +2409,19 @@ void doseInterface::histoRender() {
 			int binCount = parent->data->histogramBinCount;
 			
 			// Bin count, maybe make a configuration file option?
-			double sInc = (data.last().dose-data[0].dose)/double(binCount);
-			double s0 = data[0].dose;
+			double sInc = (hist.maxDose-hist.minDose)/double(binCount);
+			double s0 = hist.minDose;
+			QVector <int> binData;
+			hist.differential(&binData, binCount);
 			
 			double prev = s0, cur = s0;
-			series.last()->append(data[0].dose, 0);
+			series.last()->append(s0, 0);
 			
 			double subIncrement = increment/double(binCount);
-			int dataIndex = 0, dataCount = 0;
+			int dataCount = 0;
 			for (int j = 1; j <= binCount; j++) {
 				cur = s0+sInc*j;
-				
-				dataCount = 0;
-				while (dataIndex < data.size()) {
-					if (data[dataIndex].dose > cur)
-						break;
-					dataCount++;
-					dataIndex++;
-				}
+				dataCount = binData[j-1];
 				
 				series.last()->append(prev, dataCount);
 				series.last()->append(cur, dataCount);
@@ -2118,30 +2440,11 @@ void doseInterface::histoRender() {
 			series.append(new QLineSeries());
 			series.last()->setName(histLoadedView->item(i)->text());
 			savePlotName.append(histLoadedView->item(i)->text());
-						
-			int sInc = 1;
-			
-			// Drop every (n-1)th point, where n is the multiple of full 200s in the data set
-			if (data.size() > 200) {
-				sInc = data.size()/200.0;
-			}
 			
-			double subIncrement = increment/double(data.size());
-			series.last()->append(0, 100.0);
-			tempData.append(QPointF(0, 100.0));
-			
-			for (int j = 0; j < data.size(); j++) {
-				if (!(j%sInc)) {// Only add up to 399 points (start skipping at 400+)
-					series.last()->append(data[j].dose, 100.0*double(data.size()-j)/double(data.size()));
-					tempData.append(QPointF(data[j].dose, 100.0*double(data.size()-j)/double(data.size())));
-				}
-				parent->updateProgress(subIncrement);
-			}
-			
-			if ((data.size()%sInc)) {// Add end point if it would be skipped
-				series.last()->append(data.last().dose, 100.0/double(data.size()));
-				tempData.append(QPointF(data.last().dose, 100.0/double(data.size())));
-			}
+			// Only add up to about 200 points
+			hist.cumulative(&tempData, 200);
+			series.last()->append(tempData);
+			parent->updateProgress(increment);
 			
 			plot->addSeries(series.last());
 		}
@@ -2152,7 +2455,7 @@ void doseInterface::histoRender() {
 	plot->createDefaultAxes();
 	plot->axes()[0]->setTitleText("dose / Gy");
 	savePlotX = "dose / Gy";
-	plot->axes()[0]->setRange(data[0].dose,data.last().dose);
+	plot->axes()[0]->setRange(minPlot,maxPlot);
 	
 	if (histDiffBox->isChecked()) {
 		plot->setTitle("Dose Differential Histogram");
@@ -2175,6 +2478,59 @@ void doseInterface::histoRender() {
 	parent->finishedProgress();
 }
 
+doseInterface::histCacheEntry* doseInterface::histEntry(int i, DVFilter filter, int count, bool sorted) {
+	// Everything the filtered data depends on besides the dose itself
+	QString key = (filter.mask?histMaskSelect->currentText():QString("")) + "|"
+				+ (filter.media?histPhantSelect->currentText()+"|"+filter.allowedChars:QString("|")) + "|"
+				+ (filter.window?QString::number(filter.minDose,'g',17)+"|"+QString::number(filter.maxDose,'g',17):QString("|"));
+	
+	// A different selection makes the whole cache stale
+	if (key != histCacheKey) {
+		histCache.clear();
+		histCacheKey = key;
+	}
+	
+	for (int n = 0; n < histCache.size(); n++)
+		if (histCache[n].dose == histDoses[i]) {
+			if (sorted && !histCache[n].sorted) {
+				parent->nameProgress("Sorting (bar does not update)");
+				sortDV(&histCache[n].data);
+				histCache[n].sorted = true;
+			}
+			parent->updateProgress(95.0/double(count)); // Skip what getDV would have done
+			return &histCache[n];
+		}
+	
+	histCache.append(histCacheEntry());
+	histCacheEntry &entry = histCache.last();
+	entry.dose = histDoses[i];
+	histDoses[i]->getDV(&entry.data, filter, &entry.volume, count, sorted);
+	entry.sorted = sorted;
+	entry.dvhBuilt = false;
+	return &entry;
+}
+
+DVH* doseInterface::histDVH(int i, DVFilter filter, int count) {
+	histCacheEntry* entry = histEntry(i, filter, count, true);
+	if (!entry->dvhBuilt) {
+		entry->dvh.build(&entry->data, entry->volume, true);
+		entry->dvhBuilt = true;
+	}
+	return &entry->dvh;
+}
+
+void doseInterface::clearHistCache(Dose* dose) {
+	if (!dose) {
+		histCache.clear();
+		histCacheKey = "";
+		return;
+	}
+	
+	for (int n = histCache.size()-1; n >= 0; n--)
+		if (histCache[n].dose == dose)
+			histCache.removeAt(n);
+}
+
 void doseInterface::loadMetrics() {
 	int i = histOutputBox->currentIndex();
 	if (i >= 0 && i < parent->data->metricDp.size()) {
@@ -2193,35 +2549,35 @@ void doseInterface::calcMetrics() {
 	}
 	
 	// Check what filters we have
-	int filterInfo = 0;
+	DVFilter filter;
 	if (histMaskSelect->currentIndex())
-		filterInfo += 1;
+		filter.mask = histMask;
 	
 	QList <QListWidgetItem*> selectedMedia = histMediumView->selectedItems();
-	QString allowedMedia = "", allMedia = EGSPHANT_CHARS;
+	QString allMedia = EGSPHANT_CHARS;
 	if (selectedMedia.size()) {
-		filterInfo += 2;
+		filter.media = histPhant;
 		for (int i = 0; i < selectedMedia.size(); i++)
-			allowedMedia += allMedia[histMediumView->row(selectedMedia[i])];
+			filter.allowedChars += allMedia[histMediumView->row(selectedMedia[i])];
 	}
 	
 	double minDose = histDoseMinEdit->text().toDouble(), maxDose = histDoseMaxEdit->text().toDouble();
 	if (minDose || maxDose) {
-		filterInfo += 4;
+		filter.window = true;
+		filter.minDose = minDose;
+		filter.maxDose = maxDose;
 	}
 	
-	// Get sorted dose arrays
+	// Get dose arrays
 	parent->resetProgress("Calculating metrics");
 			
-	QVector <DV> data;
-	double volume;
 	int count = histDoses.size();
 	
 	// Metrics to extract
 	QString names, units, average, uncertainty, voxels, volumes, minimum, maximum;
-	QStringList Dx, Vx, Dcc, temp;
+	QStringList Dx, Vx, Dcc, temp, values, errors, cells;
 	QVector <double> xD, xV, ccD;
-	double pD, minD = 1000000000, maxD = 0, minE = 0, maxE = 0;
+	double pD;
 	
 	if (histDxEdit->text().length()) {
 		temp = histDxEdit->text().replace(' ',',').split(',');
@@ -2255,104 +2611,31 @@ void doseInterface::calcMetrics() {
 	// Get dose values	
 	for (int i = 0; i < count; i++) {
 		parent->nameProgress("Filtering data");
-		data.clear(); volume = 0;
-		switch (filterInfo) {
-			case 1: // Mask with no media
-				histDoses[i]->getDV(&data, histMask, &volume, count);
-				break;
-			case 2: // Media with no mask
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, &volume, count);
-				break;
-			case 3: // Media and mask
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, histMask, &volume, count);
-				break;
-			case 4: // Dose ranges
-				histDoses[i]->getDV(&data, &volume, minDose, maxDose, count);
-				break;
-			case 5: // Mask with no media and dose ranges
-				histDoses[i]->getDV(&data, histMask, &volume, minDose, maxDose, count);
-				break;
-			case 6: // Media with no mask and dose ranges
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, &volume, minDose, maxDose, count);
-				break;
-			case 7: // Media and mask and dose ranges
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, histMask, &volume, minDose, maxDose, count);
-				break;
-			default: // #nofilter #nomakeup
-				histDoses[i]->getDV(&data, &volume, count);
-				break;
-		}
+		DVH* dvh = histDVH(i, filter, count);
 		
 		parent->nameProgress("Extracting metrics");
 		
-		// Generate metric data
-		double volumeTally = 0, doseTally = 0, doseTallyErr = 0, doseTallyErr2 = 0, countTally = 0, absError = 0;
-		int vIndex = 0, dIndex = xD.size()-1, ccIndex = ccD.size()-1;
-		for (int j = 0; j < data.size(); j++) {
-			countTally    += 1.0;
-			volumeTally   += data[j].vol;
-			doseTally     += data[j].dose;
-			absError       = data[j].dose*data[j].err;
-			doseTallyErr  += absError;
-			doseTallyErr2 += absError*absError;
-			maxE = maxD<data[j].dose?absError:maxE;
-			maxD = maxD<data[j].dose?data[j].dose:maxD;
-			minE = minD>data[j].dose?absError:minE;
-			minD = minD>data[j].dose?data[j].dose:minD;
-			
-			// Append Vx values as we go
-			if (vIndex < xV.size()) {
-				if (data[j].dose > (xV[vIndex]*pD/100.0) && j) {
-					Vx[vIndex] += QString::number(volume-volumeTally+data[j].vol).left(11).rightJustified(11,' ')+" "
-							   +  "            |";
-					vIndex++;
-				}
-			}
-			
-			// Append Dx values as we go
-			if (dIndex >= 0) {
-				if ((volume-volumeTally)/volume*100.0 < xD[dIndex] && j) {
-					Dx[dIndex] += QString::number(data[j-1].dose).left(11).rightJustified(11,' ')+" "
-							   +  QString::number(data[j-1].dose*data[j-1].err).left(11).rightJustified(11,' ')+" |";
-					dIndex--;
-				}
-			}
-			
-			// Append Dcc values as we go
-			if (ccIndex >= 0) {
-				if ((volume-volumeTally) < ccD[ccIndex] && j) {
-					Dcc[ccIndex] += QString::number(data[j-1].dose).left(11).rightJustified(11,' ')+" "
-							     +  QString::number(data[j-1].dose*data[j-1].err).left(11).rightJustified(11,' ')+" |";
-					ccIndex--;
-				}
-			}
-		}
-		
-		for (int j = vIndex; j < xV.size(); j++) 
-			Vx[j] += "        n/a         n/a |";
-		
-		for (int j = dIndex; j >= 0; j--) 
-			Dx[j] += "        n/a         n/a |";
-		
-		for (int j = ccIndex; j >= 0; j--) 
-			Dcc[j] += "        n/a         n/a |";
+		// Generate metric data, in the order of the rows below
+		dvh->getMetrics(xD, ccD, xV, pD, &values, &errors);
+		cells.clear();
+		for (int j = 0; j < values.size(); j++)
+			cells << values[j].left(11).rightJustified(11,' ')+" "+errors[j].left(11).rightJustified(11,' ')+" |";
 		
-		// Calculate global metrics
-		doseTally     /= countTally; // Average dose
-		doseTallyErr  /= countTally; // Average uncertainty
-		doseTallyErr2 = sqrt(doseTallyErr2/countTally); // Propagated average dose uncertainty
+		maximum     += cells[0];
+		minimum     += cells[1];
+		average     += cells[2];
+		uncertainty += cells[3];
+		voxels      += cells[4];
+		volumes     += cells[5];
+		for (int j = 0; j < xD.size(); j++)
+			Dx[j]  += cells[6+j];
+		for (int j = 0; j < ccD.size(); j++)
+			Dcc[j] += cells[6+xD.size()+j];
+		for (int j = 0; j < xV.size(); j++)
+			Vx[j]  += cells[6+xD.size()+ccD.size()+j];
 		
 		names       += histLoadedView->item(i)->text().left(23).rightJustified(23,' ')+" |";
 		units       += "   value    uncertainty |";
-		minimum     += QString::number(minD).left(11).rightJustified(11,' ')+" "
-		             + QString::number(minE).left(11).rightJustified(11,' ')+" |";
-		maximum     += QString::number(maxD).left(11).rightJustified(11,' ')+" "
-		             + QString::number(maxE).left(11).rightJustified(11,' ')+" |";
-		average     += QString::number(doseTally).left(11).rightJustified(11,' ')+" "
-		             + QString::number(doseTallyErr2).left(11).rightJustified(11,' ')+" |";
-		uncertainty += QString::number(doseTallyErr).left(11).rightJustified(11,' ')+"             |";
-		voxels      += QString::number(countTally).left(11).rightJustified(11,' ')+"             |";
-		volumes     += QString::number(volume).left(11).rightJustified(11,' ')+"             |";
 	}
 	
 	QString text = QString("Dataset").left(24).rightJustified(24,' ')+"|"+names+"\n";
@@ -2398,19 +2681,19 @@ void doseInterface::outputMetrics() {
 	QString text = "";
 	
 	// Check what filters we have
-	int filterInfo = 0;
+	DVFilter filter;
 	if (histMaskSelect->currentIndex()) {
-		filterInfo += 1;
+		filter.mask = histMask;
 		text += QString("Data filtered to only include doses within contour ")+histMaskSelect->currentText()+"\n";
 	}
 	
 	QList <QListWidgetItem*> selectedMedia = histMediumView->selectedItems();
-	QString allowedMedia = "", allMedia = EGSPHANT_CHARS;
+	QString allMedia = EGSPHANT_CHARS;
 	if (selectedMedia.size()) {
-		filterInfo += 2;
+		filter.media = histPhant;
 		text += QString("Data filtered to only include doses within ")+histPhantSelect->currentText()+" phantom voxels containing:,";
 		for (int i = 0; i < selectedMedia.size(); i++) {
-			allowedMedia += allMedia[histMediumView->row(selectedMedia[i])];
+			filter.allowedChars += allMedia[histMediumView->row(selectedMedia[i])];
 			text += selectedMedia[i]->text()+",";
 		}
 		text += QString("\n");
@@ -2420,24 +2703,24 @@ void doseInterface::outputMetrics() {
 	if (minDose || maxDose) {
 		text += QString("Data filtered to only include doses within range ")+QString::number(minDose)
 		     +  " and "+((minDose < maxDose)?QString::number(maxDose):QString("infinity"))+"\n";
-		filterInfo += 4;
+		filter.window = true;
+		filter.minDose = minDose;
+		filter.maxDose = maxDose;
 	}
 	
-	if (filterInfo)
+	if (filter.mask || filter.media || filter.window)
 		text += QString("\n");
 	
 	// Get sorted dose arrays
 	parent->resetProgress("Calculating metrics");
 			
-	QVector <DV> data;
-	double volume;
 	int count = histDoses.size();
 	
 	// Metrics to extract
 	QString names, units, average, uncertainty, voxels, volumes, minimum, maximum;
-	QStringList Dx, Vx, Dcc, temp;
+	QStringList Dx, Vx, Dcc, temp, values, errors, cells;
 	QVector <double> xD, xV, ccD;
-	double pD, minD = 1000000000, maxD = 0, minE = 0, maxE = 0;
+	double pD;
 	
 	if (histDxEdit->text().length()) {
 		temp = histDxEdit->text().replace(' ',',').split(',');
@@ -2471,98 +2754,31 @@ void doseInterface::outputMetrics() {
 	// Get dose values	
 	for (int i = 0; i < count; i++) {
 		parent->nameProgress("Filtering data");
-		data.clear(); volume = 0;
-		switch (filterInfo) {
-			case 1: // Mask with no media
-				histDoses[i]->getDV(&data, histMask, &volume, count);
-				break;
-			case 2: // Media with no mask
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, &volume, count);
-				break;
-			case 3: // Media and mask
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, histMask, &volume, count);
-				break;
-			case 4: // Dose ranges
-				histDoses[i]->getDV(&data, &volume, minDose, maxDose, count);
-				break;
-			case 5: // Mask with no media and dose ranges
-				histDoses[i]->getDV(&data, histMask, &volume, minDose, maxDose, count);
-				break;
-			case 6: // Media with no mask and dose ranges
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, &volume, minDose, maxDose, count);
-				break;
-			case 7: // Media and mask and dose ranges
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, histMask, &volume, minDose, maxDose, count);
-				break;
-			default: // #nofilter #nomakeup
-				histDoses[i]->getDV(&data, &volume, count);
-				break;
-		}
+		DVH* dvh = histDVH(i, filter, count);
 		
 		parent->nameProgress("Extracting metrics");
 		
-		// Generate metric data
-		double volumeTally = 0, doseTally = 0, doseTallyErr = 0, doseTallyErr2 = 0, countTally = 0, absError = 0;
-		int vIndex = 0, dIndex = xD.size()-1, ccIndex = ccD.size()-1;
-		for (int j = 0; j < data.size(); j++) {
-			countTally    += 1.0;
-			volumeTally   += data[j].vol;
-			doseTally     += data[j].dose;
-			absError       = data[j].dose*data[j].err;
-			doseTallyErr  += absError;
-			doseTallyErr2 += absError*absError;
-			maxE = maxD<data[j].dose?absError:maxE;
-			maxD = maxD<data[j].dose?data[j].dose:maxD;
-			minE = minD>data[j].dose?absError:minE;
-			minD = minD>data[j].dose?data[j].dose:minD;
-			
-			// Append Vx values as we go
-			if (vIndex < xV.size()) {
-				if (data[j].dose > (xV[vIndex]*pD/100.0) && j) {
-					Vx[vIndex] += QString::number(volume-volumeTally+data[j].vol)+",,";
-					vIndex++;
-				}
-			}
-			
-			// Append Dx values as we go
-			if (dIndex >= 0) {
-				if ((volume-volumeTally)/volume*100.0 < xD[dIndex] && j) {
-					Dx[dIndex] += QString::number(data[j-1].dose)+","+QString::number(data[j-1].dose*data[j-1].err)+",";
-					dIndex--;
-				}
-			}
-			
-			// Append Dcc values as we go
-			if (ccIndex >= 0) {
-				if ((volume-volumeTally) < ccD[ccIndex] && j) {
-					Dcc[ccIndex] += QString::number(data[j-1].dose)+","+QString::number(data[j-1].dose*data[j-1].err)+",";
-					ccIndex--;
-				}
-			}
-		}
-		
-		for (int j = vIndex; j < xV.size(); j++) 
-			Vx[j] += "n/a,n/a,";
-		
-		for (int j = dIndex; j >= 0; j--) 
-			Dx[j] += "n/a,n/a,";
+		// Generate metric data, in the order of the rows below
+		dvh->getMetrics(xD, ccD, xV, pD, &values, &errors);
+		cells.clear();
+		for (int j = 0; j < values.size(); j++)
+			cells << values[j]+","+errors[j]+",";
 		
-		for (int j = ccIndex; j >= 0; j--) 
-			Dcc[j] += "n/a,n/a,";
-		
-		// Calculate global metrics
-		doseTally     /= countTally; // Average dose
-		doseTallyErr  /= countTally; // Average uncertainty
-		doseTallyErr2 = sqrt(doseTallyErr2/countTally); // Propagated average dose uncertainty
+		maximum     += cells[0];
+		minimum     += cells[1];
+		average     += cells[2];
+		uncertainty += cells[3];
+		voxels      += cells[4];
+		volumes     += cells[5];
+		for (int j = 0; j < xD.size(); j++)
+			Dx[j]  += cells[6+j];
+		for (int j = 0; j < ccD.size(); j++)
+			Dcc[j] += cells[6+xD.size()+j];
+		for (int j = 0; j < xV.size(); j++)
+			Vx[j]  += cells[6+xD.size()+ccD.size()+j];
 		
 		names       += histLoadedView->item(i)->text()+",,";
 		units       += "value,uncertainty,";
-		minimum     += QString::number(minD)+","+QString::number(minE)+",";
-		maximum     += QString::number(maxD)+","+QString::number(maxE)+",";
-		average     += QString::number(doseTally)+","+QString::number(doseTallyErr2)+",";
-		uncertainty += QString::number(doseTallyErr)+",,";
-		voxels      += QString::number(countTally)+",,";
-		volumes     += QString::number(volume)+",,";
 	}
 	
 	text        += QString("Dataset,")+names+"\n";
@@ -2598,6 +2814,84 @@ void doseInterface::outputMetrics() {
 	parent->finishedProgress();
 }
 
+void doseInterface::outputSurfaces() {
+	// Return
+	if (histDoses.size() == 0) {
+		return;
+	}
+	
+	double pD = histDpEdit->text().toDouble();
+	if (pD <= 0) {
+		QMessageBox::warning(0, "Prescription error",
+		tr("A prescription dose is needed to place the isodose surfaces.  Aborting"));
+		return;
+	}
+	
+	// Surfaces at each Vx, or at the prescription if there are none
+	QVector <double> xV;
+	QStringList temp;
+	if (histVxEdit->text().length()) {
+		temp = histVxEdit->text().replace(' ',',').split(',', QString::SkipEmptyParts);
+		for (int i = 0; i < temp.size(); i++)
+			xV.append(temp[i].toDouble());
+		std::sort(xV.begin(), xV.end());
+	}
+	if (xV.isEmpty())
+		xV.append(100);
+	
+	QString filePath = QFileDialog::getSaveFileName(this, tr("Save File"), ".", tr("Meshes (*.ply *.stl)"));
+	
+	if (filePath.length() < 1) // No name selected
+		return;
+	
+	bool stl = filePath.endsWith(".stl");
+	if (!stl && !filePath.endsWith(".ply")) // Doesn't have the right extension
+		filePath += ".ply";
+	
+	// Each surface goes in its own file named after the dose and Vx
+	QString base = filePath.left(filePath.lastIndexOf('.')), name, meshPath;
+	QString text = "Dataset,Isodose (% of prescription),Isodose / Gy,Enclosed volume / cm^3,Triangles,File\n";
+	isoSurface mesh;
+	
+	parent->resetProgress("Extracting isodose surfaces");
+	
+	for (int i = 0; i < histDoses.size(); i++)
+		for (int j = 0; j < xV.size(); j++) {
+			parent->nameProgress(QString("Extracting V")+QString::number(xV[j])+" of "+histLoadedView->item(i)->text());
+			histDoses[i]->getIsoSurface(&mesh, pD*xV[j]/100.0);
+			
+			name = histLoadedView->item(i)->text();
+			name.replace(QRegExp("[^A-Za-z0-9_.-]"), "_");
+			meshPath = base+"_"+name+"_V"+QString::number(xV[j])+(stl?".stl":".ply");
+			
+			if (stl ? mesh.writeSTL(meshPath) : mesh.writePLY(meshPath)) {
+				QMessageBox::warning(0, "Mesh file error",
+				tr("Failed to open the file for mesh output.  Aborting"));
+				parent->finishedProgress();
+				return;
+			}
+			
+			text += histLoadedView->item(i)->text()+","+QString::number(xV[j])+","+QString::number(mesh.dose)+","
+				  + QString::number(mesh.volume)+","+QString::number(mesh.triangles.size()/3)+","+meshPath+"\n";
+			parent->updateProgress(100.0/double(histDoses.size()*xV.size()));
+		}
+	
+	QFile volumeFile(base+"_volumes.csv");
+	
+	if (!volumeFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+		QMessageBox::warning(0, "Volume file error",
+		tr("Failed to open the file for volume output.  Aborting"));
+		parent->finishedProgress();
+		return;
+	}
+	
+	QTextStream out(&volumeFile);
+	out << text;
+	volumeFile.close();
+	
+	parent->finishedProgress();
+}
+
 void doseInterface::outputRawData() {// Return
 	if (histDoses.size() == 0) {
 		return;
@@ -2614,19 +2908,19 @@ void doseInterface::outputRawData() {// Return
 	QString text = "";
 	
 	// Check what filters we have
-	int filterInfo = 0;
+	DVFilter filter;
 	if (histMaskSelect->currentIndex()) {
-		filterInfo += 1;
+		filter.mask = histMask;
 		text += QString("Data filtered to only include doses within contour ")+histMaskSelect->currentText()+"\n";
 	}
 	
 	QList <QListWidgetItem*> selectedMedia = histMediumView->selectedItems();
-	QString allowedMedia = "", allMedia = EGSPHANT_CHARS;
+	QString allMedia = EGSPHANT_CHARS;
 	if (selectedMedia.size()) {
-		filterInfo += 2;
+		filter.media = histPhant;
 		text += QString("Data filtered to only include doses within ")+histPhantSelect->currentText()+" phantom voxels containing:,";
 		for (int i = 0; i < selectedMedia.size(); i++) {
-			allowedMedia += allMedia[histMediumView->row(selectedMedia[i])];
+			filter.allowedChars += allMedia[histMediumView->row(selectedMedia[i])];
 			text += selectedMedia[i]->text()+",";
 		}
 		text += QString("\n");
@@ -2636,52 +2930,27 @@ void doseInterface::outputRawData() {// Return
 	if (minDose || maxDose) {
 		text += QString("Data filtered to only include doses within range ")+QString::number(minDose)
 		     +  " and "+((minDose < maxDose)?QString::number(maxDose):QString("infinity"))+"\n";
-		filterInfo += 4;
+		filter.window = true;
+		filter.minDose = minDose;
+		filter.maxDose = maxDose;
 	}
 	
-	if (filterInfo)
+	if (filter.mask || filter.media || filter.window)
 		text += QString("\n");
 	
 	// Get sorted dose arrays
 	parent->resetProgress("Outputting raw data");
 	
-	QVector <DV> data;
 	QVector <QStringList> dataColumns;
 	int count = histDoses.size();
-	double volume;
 	dataColumns.resize(count);
 	QString names = "";
 	
 	// Get dose values	
 	for (int i = 0; i < count; i++) {
 		parent->nameProgress("Filtering data");
-		data.clear(); volume = 0;
-		switch (filterInfo) {
-			case 1: // Mask with no media
-				histDoses[i]->getDV(&data, histMask, &volume, count);
-				break;
-			case 2: // Media with no mask
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, &volume, count);
-				break;
-			case 3: // Media and mask
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, histMask, &volume, count);
-				break;
-			case 4: // Dose ranges
-				histDoses[i]->getDV(&data, &volume, minDose, maxDose, count);
-				break;
-			case 5: // Mask with no media and dose ranges
-				histDoses[i]->getDV(&data, histMask, &volume, minDose, maxDose, count);
-				break;
-			case 6: // Media with no mask and dose ranges
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, &volume, minDose, maxDose, count);
-				break;
-			case 7: // Media and mask and dose ranges
-				histDoses[i]->getDV(&data, histPhant, allowedMedia, histMask, &volume, minDose, maxDose, count);
-				break;
-			default: // #nofilter #nomakeup
-				histDoses[i]->getDV(&data, &volume, count);
-				break;
-		}
+		histCacheEntry* entry = histEntry(i, filter, count, true);
+		QVector <DV> &data = entry->data;
 		
 		parent->nameProgress("Building raw output");
 		
@@ -2771,7 +3040,15 @@ void doseInterface::profileRender() {
 	rInc /= double(points-1);
 	double xi, yi, zi, ri;
 	
-	double value, error;
+	double value;
+	
+	// The sample positions are shared by every dose
+	QVector <double> xs(points), ys(points), zs(points), values, errors;
+	for (int j = 0; j < points; j++) {
+		xs[j] = x0+xInc*j;
+		ys[j] = y0+yInc*j;
+		zs[j] = z0+zInc*j;
+	}
 	
 	for (int i = 0; i < count; i++) {
 		// Generate series data
@@ -2781,13 +3058,11 @@ void doseInterface::profileRender() {
 		savePlotName.append(profLoadedView->item(i)->text());
 		
 		if (profInterpBox->isChecked()) {
+			profDoses[i]->triInterpol(xs, ys, zs, &values, &errors);
+			
 			for (int j = 0; j < points; j++) {
-				xi = x0+xInc*j;
-				yi = y0+yInc*j;
-				zi = z0+zInc*j;
 				ri = rInc*j;
-				
-				profDoses[i]->triInterpol(xi,yi,zi,&value,&error);
+				value = values[j];
 				
 				if (value != -1) {
 					series.last()->append(ri,value);			
@@ -2942,7 +3217,7 @@ void doseInterface::showPreviewEgsphant() {
 		   z0 = profz0Edit->text().toDouble(), x1 = profx1Edit->text().toDouble(),
 		   y1 = profy1Edit->text().toDouble(), z1 = profz1Edit->text().toDouble();
 	
-	QString axis = profPhantAxis->currentText();
+	Axis axis = toAxis(profPhantAxis->currentText());
 	
 	double horLeft, horRight, verBot, verTop, depth;
 	
@@ -2996,11 +3271,11 @@ void doseInterface::showPreviewEgsphant() {
 				w = horStart+double(i)/density;
 				h = verStart+double(j)/density;
 				
-				if (!axis.compare("x axis"))
+				if (axis == X_AXIS)
 					med = profPhant->getMedia(depth, h, w);
-				else if (!axis.compare("y axis"))
+				else if (axis == Y_AXIS)
 					med = profPhant->getMedia(h, depth, w);
-				else if (!axis.compare("z axis"))
+				else if (axis == Z_AXIS)
 					med = profPhant->getMedia(h, w, depth);
 				
 				c = (indeces.indexOf(med)+1)*cInc;
@@ -3016,11 +3291,11 @@ void doseInterface::showPreviewEgsphant() {
 				w = horStart+double(i)/density;
 				h = verStart+double(j)/density;
 				
-				if (!axis.compare("x axis"))
+				if (axis == X_AXIS)
 					c = profPhant->getDensity(depth, h, w);
-				else if (!axis.compare("y axis"))
+				else if (axis == Y_AXIS)
 					c = profPhant->getDensity(h, depth, w);
-				else if (!axis.compare("z axis"))
+				else if (axis == Z_AXIS)
 					c = profPhant->getDensity(h, w, depth);
 				else
 					c = 0;
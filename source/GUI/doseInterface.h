@@ -44,6 +44,49 @@
 #include <QtCharts>
 #include <iostream>
 #include "../interface.h"
+#include "../batch.h"
+
+// Layers of the dose preview, recomputed in the background by previewLayers
+#define PREVIEW_PHANT  1
+#define PREVIEW_MAP    2
+#define PREVIEW_ISO    4
+#define PREVIEW_CANVAS 8 // Resize the blank canvas under the layers
+#define PREVIEW_ALL    15
+#define PREVIEW_PROGRESSIVE 16 // Show a coarse level of the layers before drawing them in full
+#define PREVIEW_COARSE 4 // Resolution of the coarse level is the full resolution over this
+#define PREVIEW_ZOOM 1.25 // Zoom factor of one mouse wheel step
+#define PREVIEW_DEBOUNCE 150 // ms of quiet after a live edit before rendering
+#define PREVIEW_CACHE_SLICES 8 // Slices kept per layer in the preview slice cache
+#define PREVIEW_PREFETCH 3 // Slices drawn ahead in the direction of slice stepping
+
+// Everything needed to draw the preview layers, read off of the widgets so
+// that the layers can be drawn on other threads
+struct previewParams {
+	Axis axis;
+	double horMin, horMax, vertMin, vertMax, depth, res;
+	bool media, density;
+	double denMin, denMax, mapMin, mapMax;
+	QColor minColour, midColour, maxColour;
+	QVector <double> doses; // Isodose levels
+	
+	QString key(int layer) const; // The exact parameters layer is drawn with, or just the view for layer -1
+};
+
+// One layer drawn with one set of parameters, as kept in the slice cache
+struct previewSlice {
+	QString key;
+	QImage pic; // Phantom and colour map layers
+	QVector <QVector <QPolygonF> > lines; // Isodose layers
+};
+
+// A layer to draw on the thread pool, layer 0 is the phantom, 1 the colour
+// map and 2 to 4 the isodose sets
+struct previewTask {
+	int layer;
+	previewParams params;
+	previewSlice slice;
+	bool done;
+};
 
 // Forward declaration of Interface to pass to the tab windows
 class Interface;
@@ -168,10 +211,53 @@ public:
 	QLabel      *mapOpacLabel;
 	QSlider     *mapOpacSlider;	
 	
+	// Background rendering of the layers below, only one render runs at a time
+	QFutureWatcher <void> *previewWatcher;
+	QVector <previewTask> previewTasks; // What is being drawn, only the pool touches it while it runs
+	int previewQueued; // Layers asked for while a render was running
+	QString previewKeys[5]; // Parameters the phantom, map and 3 isodose layers are shown with
+	QList <previewSlice> previewCache[5]; // Slices drawn per layer, most recently used first
+	QTimer *previewTimer; // Coalesces bursts of live edits
+	int previewDebounced; // Layers waiting on previewTimer
+	bool previewPrefetching; // The running render draws slices ahead rather than the shown ones
+	QAtomicInt previewCancel; // Set to skip the rest of a prefetch
+	int previewDirection; // Direction of the last slice step, 0 when not stepping
+	bool previewLoading; // A layer's file is being replaced, so nothing may be drawn
+	
+	void previewSchedule(int layers); // Render layers once live edits pause
+	void previewLayers(int layers); // Draw changed layers on the thread pool, then composite
+	void previewWait(); // Block until the layers are done, before changing what they read
+	void previewDiscard(int layer); // Stop drawing a layer and forget its slices before loading a new file
+	
+	previewParams previewRead();
+	void previewDraw(previewTask* task);
+	void previewStart(); // Draw previewTasks on the thread pool
+	void previewStore(int layer, const previewSlice &slice);
+	const previewSlice* previewFind(int layer, QString key);
+	void previewApply(); // Show the cached slices matching previewKeys
+	void previewPrefetch(); // Draw the slices ahead of a slice step
+	double previewStepDepth(double depth, bool up); // Centre of the next slice up or down
+	
+	// Zooming and panning the canvas with the mouse, the coarse levels shown
+	// while navigating are cached as slices of their own
+	int previewRefine; // Bits (1 << layer) of layers shown at their coarse level
+	QString previewCoarseKeys[5]; // Parameters of those coarse levels
+	double previewCoarseScale[5]; // Full over coarse resolution of those levels
+	QPoint previewPanStart; // Cursor position the current drag started at
+	bool previewPanning;
+	
+	void previewRefineLayers(); // Draw the layers shown at their coarse level in full
+	void previewZoom(QPoint pos, bool in);
+	void previewPan(QPoint delta);
+	
+protected:
+	bool eventFilter(QObject *object, QEvent *event); // Mouse navigation of the canvas
+	
+public:
 	// Isodose selection
-	QVector <QVector <QLineF> > solid;
-	QVector <QVector <QLineF> > dashed;
-	QVector <QVector <QLineF> > dotted;
+	QVector <QVector <QPolygonF> > solid;
+	QVector <QVector <QPolygonF> > dashed;
+	QVector <QVector <QPolygonF> > dotted;
 	
 	QFrame                 *isoFrame;
 	QGridLayout            *isoLayout;
@@ -185,6 +271,14 @@ public:
 	QVector <QLineEdit*>   isoColourDose;
 	QVector <QPushButton*> isoColourButton;
 	
+	// Structure overlay
+	QCheckBox              *structBox;
+	QString                structKey; // View and structures structPaths were made for
+	QVector <QPainterPath> structPaths; // Contours on the shown z slice in pixels, one path per struct
+	QVector <int>          structIds; // Struct index of each path
+	
+	void previewStructs(const previewParams &p); // Redo structPaths if the view or structures changed
+	
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ //
 //                               Histogram                             //
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ //
@@ -249,10 +343,28 @@ public:
 	QPushButton *histCalcButton;
 	QPushButton *histSaveButton;
 	QPushButton *histRawButton;
+	QPushButton *histSurfaceButton;
 				    
 	QFrame      *histOutputFrame;
 	QGridLayout *histOutputLayout;
 	
+	// Filtered dose data of the current filter selection, kept for each loaded dose so that
+	// plotting, metrics and outputs on an unchanged selection do not call getDV again
+	struct histCacheEntry {
+		Dose*        dose;
+		QVector <DV> data;
+		double       volume;
+		bool         sorted;
+		DVH          dvh; // Built from data the first time metrics are needed
+		bool         dvhBuilt;
+	};
+	QList <histCacheEntry> histCache;
+	QString histCacheKey; // The filter selection the cache holds
+	
+	histCacheEntry* histEntry(int i, DVFilter filter, int count, bool sorted);
+	DVH* histDVH(int i, DVFilter filter, int count);
+	void clearHistCache(Dose* dose = 0); // Drop the data of dose, or everything
+	
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ //
 //                                Profile                              //
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ //	
@@ -331,6 +443,8 @@ public slots:
     void previewMapRenderLive();
     void previewIsoRender(); // Change of doses, changes of values, change of colours
     void previewIsoRenderLive();
+    void previewLayersDone();
+    void previewDebounceDone();
 	
 	void previewChangeAxis();
 	void previewChangeColor(int i);
@@ -357,6 +471,7 @@ public slots:
 	void calcMetrics();
 	void outputMetrics();
 	void outputRawData();
+	void outputSurfaces();
 	
 	// Profile
     void profileRenderLive();
@@ -44,7 +44,7 @@ phantInterface::phantInterface()
 // 1) some number of digits
 // 2) (e|E)[+]?\d{1,2} character e or E, an optional +, then 1-2 digits 
 // 3) .\d*(e|E)[+]?\d{1,2} dot ., some number of digits, character e or E, an optional +, then 1-2 digits 
-	: allowedNums(QRegExp(REGEX_REAL_POS)) {
+	: allowedNums(QRegExp(REGEX_REAL_POS)), allowedNats(QRegExp(REGEX_NATURAL_POS)), allowedReals(QRegExp(REGEX_REAL)) {
 	parent = (Interface*)parentWidget();
 	
 	log = new logWindow();
@@ -58,7 +58,7 @@ phantInterface::phantInterface(Interface* p)
 // 1) some number of digits
 // 2) (e|E)[+]?\d{1,2} character e or E, an optional +, then 1-2 digits 
 // 3) .\d*(e|E)[+]?\d{1,2} dot ., some number of digits, character e or E, an optional +, then 1-2 digits 
-	: allowedNums(QRegExp(REGEX_REAL_POS)) {
+	: allowedNums(QRegExp(REGEX_REAL_POS)), allowedNats(QRegExp(REGEX_NATURAL_POS)), allowedReals(QRegExp(REGEX_REAL)) {
 	parent = p;
 	
 	log = new logWindow();
@@ -124,6 +124,12 @@ void phantInterface::createLayout() {
 	ttt = parent->data->hu_location;
 	structEdit->setToolTip(ttt);
 	
+	ctSidecarLoad  = new QPushButton(tr("Load CT sidecar"));
+	
+	ttt = tr("Load the decoded CT and structs saved alongside a previous egsphant\n"
+			 "instead of DICOM files, so they are not parsed again.");
+	ctSidecarLoad->setToolTip(ttt);
+	
 	create         = new QPushButton(tr("Create egsphant"));
 	
 	ttt = tr("Generate egsphant in local directory.");
@@ -151,7 +157,9 @@ void phantInterface::createLayout() {
 	dcmGrid->addWidget(calibLoad     , 6, 2, 1, 2);
 	dcmGrid->addWidget(calibEdit     , 6, 4, 1, 2);
 	
-	//dcmGrid->addWidget(create        , 7, 0, 1, 6); // Moved to elsewhere
+	dcmGrid->addWidget(ctSidecarLoad , 7, 0, 1, 6);
+	
+	//dcmGrid->addWidget(create        , 8, 0, 1, 6); // Moved to elsewhere
 	
 	dcmFrame->setLayout(dcmGrid);
 	dcmFrame->setFrameStyle(QFrame::Box | QFrame::Sunken);
@@ -243,6 +251,101 @@ void phantInterface::createLayout() {
 	prioFrame->setLayout(prioGrid);
 	prioFrame->setFrameStyle(QFrame::Box | QFrame::Sunken);
 	
+	// Build options
+	buildLabel       = new QLabel(tr("Build options"));
+	
+	streamEnable     = new QCheckBox("Low memory build");
+	ttt = tr("Build and write the egsphant and masks a few slices at a time so that\n"
+			 "memory use does not grow with the number of CT slices.");
+	streamEnable->setToolTip(ttt);
+	
+	slabLabel        = new QLabel(tr("Slices per slab"));
+	slabEdit         = new QLineEdit(QString::number(parent->data->egsphantSlabSize));
+	slabEdit->setValidator(&allowedNats);
+	ttt = tr("The number of CT slices held in memory at once by a low memory build.");
+	slabLabel->setToolTip(ttt);
+	slabEdit->setToolTip(ttt);
+	
+	cropLabel        = new QLabel(tr("Crop to"));
+	cropMode         = new QComboBox();
+	cropMode->addItem("no cropping");
+	cropMode->addItem("box");
+	cropMode->addItem("contour");
+	cropMode->addItem("seeds and margin");
+	ttt = tr("Only keep the voxels overlapping the selected region,\n"
+			 "fewer voxels make for faster egs_brachy runs.");
+	cropLabel->setToolTip(ttt);
+	cropMode->setToolTip(ttt);
+	
+	QStringList axes = {"x", "y", "z"};
+	for (int i = 0; i < 3; i++) {
+		cropAxisLabel << new QLabel(axes[i] + tr(" range (cm)"));
+		cropEdit << new QLineEdit("0") << new QLineEdit("0");
+		cropEdit[2*i]->setValidator(&allowedReals);
+		cropEdit[2*i+1]->setValidator(&allowedReals);
+		
+		ttt = tr("The minimum and maximum ") + axes[i] + tr(" of the crop box.");
+		cropAxisLabel[i]->setToolTip(ttt);
+		cropEdit[2*i]->setToolTip(ttt);
+		cropEdit[2*i+1]->setToolTip(ttt);
+	}
+	
+	cropContourLabel = new QLabel(tr("Contour"));
+	cropContourBox   = new QComboBox();
+	cropContourBox->addItem("no DICOM file selected");
+	ttt = tr("Crop to the box bounding this contour, typically the body.");
+	cropContourLabel->setToolTip(ttt);
+	cropContourBox->setToolTip(ttt);
+	
+	cropMarginLabel  = new QLabel(tr("Seed margin (cm)"));
+	cropMarginEdit   = new QLineEdit("2");
+	cropMarginEdit->setValidator(&allowedNums);
+	ttt = tr("Crop to the box bounding all plan seed positions, padded by this margin.");
+	cropMarginLabel->setToolTip(ttt);
+	cropMarginEdit->setToolTip(ttt);
+	
+	resampleEnable   = new QCheckBox("Resample to voxel size (cm)");
+	ttt = tr("Resample to a uniform grid of this voxel size, densities are averaged\n"
+			 "by overlapped volume and media and masks take the majority medium.");
+	resampleEnable->setToolTip(ttt);
+	for (int i = 0; i < 3; i++) {
+		resampleEdit << new QLineEdit("0.1");
+		resampleEdit[i]->setValidator(&allowedNums);
+		resampleEdit[i]->setToolTip(ttt);
+	}
+	
+	sidecarEnable    = new QCheckBox("Save CT sidecar for rebuilds");
+	ttt = tr("Also save the decoded CT and structs next to the egsphant, later\n"
+			 "builds can load them with \"Load CT sidecar\" instead of the DICOM files.");
+	sidecarEnable->setToolTip(ttt);
+	
+	buildGrid        = new QGridLayout();
+	buildFrame       = new QFrame();
+	
+	buildGrid->addWidget(buildLabel     ,  0, 0, 1, 3);
+	buildGrid->addWidget(streamEnable   ,  1, 0, 1, 3);
+	buildGrid->addWidget(slabLabel      ,  2, 0, 1, 1);
+	buildGrid->addWidget(slabEdit       ,  2, 1, 1, 2);
+	buildGrid->addWidget(cropLabel      ,  3, 0, 1, 1);
+	buildGrid->addWidget(cropMode       ,  3, 1, 1, 2);
+	for (int i = 0; i < 3; i++) {
+		buildGrid->addWidget(cropAxisLabel[i],  4+i, 0, 1, 1);
+		buildGrid->addWidget(cropEdit[2*i]   ,  4+i, 1, 1, 1);
+		buildGrid->addWidget(cropEdit[2*i+1] ,  4+i, 2, 1, 1);
+	}
+	buildGrid->addWidget(cropContourLabel,  7, 0, 1, 1);
+	buildGrid->addWidget(cropContourBox ,  7, 1, 1, 2);
+	buildGrid->addWidget(cropMarginLabel,  8, 0, 1, 1);
+	buildGrid->addWidget(cropMarginEdit ,  8, 1, 1, 2);
+	buildGrid->addWidget(resampleEnable ,  9, 0, 1, 3);
+	for (int i = 0; i < 3; i++)
+		buildGrid->addWidget(resampleEdit[i], 10, i, 1, 1);
+	buildGrid->addWidget(sidecarEnable  , 11, 0, 1, 3);
+	buildGrid->addWidget(create         , 12, 0, 1, 3);
+	
+	buildFrame->setLayout(buildGrid);
+	buildFrame->setFrameStyle(QFrame::Box | QFrame::Sunken);
+	
 	// Metallic artifact reduction
 	marLabel          = new QLabel(tr("Metallic artifact reduction"));
 	
@@ -288,7 +391,7 @@ void phantInterface::createLayout() {
 	marDenLabel->setToolTip(ttt);
 	marDenEdit->setToolTip(ttt);
 	
-	ttt = tr("The box side-length used to determine voxel replacement regions.");
+	ttt = tr("The radius around each source within which voxel densities are replaced.");
 	marRadLabel->setToolTip(ttt);
 	marRadEdit->setToolTip(ttt);
 	
@@ -341,7 +444,7 @@ void phantInterface::createLayout() {
 	mainLayout->addWidget(prioFrame   , 2, 0, 2, 1);
 	mainLayout->addWidget(contourFrame, 0, 1, 4, 1);
 	mainLayout->addWidget(marFrame    , 0, 2, 1, 1);
-	mainLayout->addWidget(create      , 3, 2, 1, 1);
+	mainLayout->addWidget(buildFrame  , 3, 2, 1, 1);
 	
 	mainLayout->setColumnStretch(0, 5);
 	mainLayout->setColumnStretch(1, 5);
@@ -357,6 +460,12 @@ void phantInterface::connectLayout() {
 			this, SLOT(fillMARvalues()));
     connect(marContour, SIGNAL(stateChanged(int)),
 			this, SLOT(refresh()));
+	connect(streamEnable, SIGNAL(stateChanged(int)),
+			this, SLOT(refresh()));
+	connect(cropMode, SIGNAL(currentIndexChanged(int)),
+			this, SLOT(refresh()));
+	connect(resampleEnable, SIGNAL(stateChanged(int)),
+			this, SLOT(refresh()));
 			
 	connect(structLoad, SIGNAL(pressed()),
 			this, SLOT(loadStruct()));
@@ -371,6 +480,8 @@ void phantInterface::connectLayout() {
 			this, SLOT(deleteCT()));
 	connect(ctDeleteAll, SIGNAL(pressed()),
 			this, SLOT(deleteAllCT()));
+	connect(ctSidecarLoad, SIGNAL(pressed()),
+			this, SLOT(loadSidecar()));
 			
 	connect(create, SIGNAL(pressed()),
 			this, SLOT(createEGSphant()));
@@ -418,7 +529,7 @@ void phantInterface::fillMARvalues() {
 // Pull DICOM data
 void phantInterface::createEGSphant() {
 	// Check if CT data is loaded
-	if (parent->data->CT_data.isEmpty()) {
+	if (parent->data->CT_data.isEmpty() && !parent->data->CT_cache) {
 		QMessageBox::warning(0, "Creating egsphant error",
 		tr("No CT data is loaded, aborting."));
 		return;		
@@ -436,6 +547,8 @@ void phantInterface::createEGSphant() {
 			// Delete all associated files
 			QFile(parent->data->localDirPhants[i]+fileName+".egsphant.gz").remove();
 			QFile(parent->data->localDirPhants[i]+fileName+".log").remove();
+			if (!parent->data->CT_cache || QFileInfo(parent->data->CT_cache->path) != QFileInfo(parent->data->localDirPhants[i]+fileName+".ct.gz"))
+				QFile(parent->data->localDirPhants[i]+fileName+".ct.gz").remove(); // Keep the sidecar this build reads
 			
 			// Delete the file references
 			parent->data->localNamePhants.removeAt(i);
@@ -466,6 +579,12 @@ void phantInterface::createEGSphant() {
 		}
 	}
 	
+	// Save a CT sidecar if requested, unless this build is already from one
+	if (sidecarEnable->isChecked() && !parent->data->CT_cache)
+		parent->data->sidecarPath = parent->data->gui_location+"/database/egsphant/"+fileName+".ct.gz";
+	else
+		parent->data->sidecarPath = "";
+	
 	// Set the default tas
 	int defaultTAS = -1;
 	for (int i = 0; i < parent->data->TAS_names.size(); i++) {
@@ -504,29 +623,76 @@ void phantInterface::createEGSphant() {
 	// Invoke build egsphant from data
 	EGSPhant phantom;
 	QString textLog;
+	QString phantPath = parent->data->gui_location+"/database/egsphant/"+fileName+".egsphant.gz";
 	int err;
-	err = parent->data->buildEgsphant(&phantom, &textLog, structIndex.size(), defaultTAS,
-								&structIndex, &tasIndex, &makeMasks);
 	
-	if (err == 0) {
-		// Connect the progress bar
-		parent->nameProgress("Saving in local egsphant database");
-		connect(&phantom, SIGNAL(madeProgress(double)),
-				parent, SLOT(updateProgress(double)));
+	if (streamEnable->isChecked()) {
+		// The low memory build writes the egsphant and masks as it goes
+		QStringList maskPaths;
+		for (int i = 0; i < structIndex.size(); i++) {
+			if (contourTASMask[i]->isChecked())
+				maskPaths << parent->data->gui_location+"/database/mask/"+fileName+"."+contourTASLabel[i]->text()+".mask.egsphant.gz";
+			else
+				maskPaths << "";
+		}
 		
-		// Output egsphant file
-		phantom.savegzEGSPhantFilePlus(parent->data->gui_location+"/database/egsphant/"+fileName+".egsphant.gz");
+		if (slabEdit->text().toInt() > 0)
+			parent->data->egsphantSlabSize = slabEdit->text().toInt();
+		err = parent->data->buildEgsphantStream(phantPath, maskPaths, &textLog, structIndex.size(), defaultTAS,
+												&structIndex, &tasIndex);
+	}
+	else {
+		err = parent->data->buildEgsphant(&phantom, &textLog, structIndex.size(), defaultTAS,
+										  &structIndex, &tasIndex, &makeMasks);
+		
+		// Crop down to the requested region
+		if (err == 0 && cropMode->currentIndex() > 0) {
+			QVector <double> box;
+			if (cropMode->currentIndex() == 1)
+				for (int i = 0; i < 6; i++)
+					box << cropEdit[i]->text().toDouble();
+			else if (cropMode->currentIndex() == 2)
+				box = parent->data->contourBox(parent->data->structName.indexOf(cropContourBox->currentText()));
+			else
+				box = parent->data->seedBox(cropMarginEdit->text().toDouble());
+			
+			if (box.isEmpty())
+				err = 402;
+			else
+				err = parent->data->cropEgsphant(&phantom, &makeMasks, box, &textLog);
+		}
+		
+		// Resample to the requested voxel size
+		if (err == 0 && resampleEnable->isChecked())
+			err = parent->data->resampleEgsphant(&phantom, &makeMasks, resampleEdit[0]->text().toDouble(),
+												 resampleEdit[1]->text().toDouble(), resampleEdit[2]->text().toDouble(), &textLog);
+		
+		if (err == 0) {
+			// Connect the progress bar
+			parent->nameProgress("Saving in local egsphant database");
+			connect(&phantom, SIGNAL(madeProgress(double)),
+					parent, SLOT(updateProgress(double)));
+			
+			// Output egsphant file
+			phantom.savegzEGSPhantFilePlus(phantPath);
+			
+			// Output masks
+			for (int i = 0; i < makeMasks.size(); i++) {
+				if (contourTASMask[i]->isChecked())
+					makeMasks[i]->savegzEGSPhantFile(parent->data->gui_location+"/database/mask/"+fileName+"."+contourTASLabel[i]->text()+".mask.egsphant.gz");
+			}
+		}
+		
+		// Delete masks
+		for (int i = 0; i < makeMasks.size(); i++)
+			delete makeMasks[i];
+	}
+	
+	if (err == 0) {
 		parent->data->localNamePhants << fileName+".egsphant.gz";
 		parent->data->localDirPhants << parent->data->gui_location+"/database/egsphant/";
 		parent->phantomRepopulate();
 		
-		// Output and delete masks
-		for (int i = 0; i < makeMasks.size(); i++) {
-			if (contourTASMask[i]->isChecked())
-				makeMasks[i]->savegzEGSPhantFile(parent->data->gui_location+"/database/mask/"+fileName+"."+contourTASLabel[i]->text()+".mask.egsphant.gz");
-			delete makeMasks[i];
-		}
-		
 		// Output log file
 		QFile logFile(parent->data->gui_location+"/database/egsphant/"+fileName+".log");
 		if (logFile.open(QIODevice::WriteOnly)) {
@@ -566,6 +732,21 @@ void phantInterface::createEGSphant() {
 	else if (err == 208)
 		QMessageBox::warning(0, "DICOM error",
         tr("Could not find field ") + "HU values (7fe0,0010)" + tr (" in CT DICOM file.  Aborting"));
+	else if (err == 301)
+		QMessageBox::warning(0, "Output error",
+        tr("Could not open ") + phantPath + tr(" for writing.  Aborting"));
+	else if (err == 302)
+		QMessageBox::warning(0, "Output error",
+        tr("Could not write the temporary density file.  Aborting"));
+	else if (err == 401)
+		QMessageBox::warning(0, "Cropping error",
+        tr("The crop box is empty or does not overlap the phantom.  Aborting"));
+	else if (err == 402)
+		QMessageBox::warning(0, "Cropping error",
+        tr("Could not find the crop region, check that the contour or the plan seeds are loaded.  Aborting"));
+	else if (err == 403)
+		QMessageBox::warning(0, "Resampling error",
+        tr("Resampled voxel sizes must be positive.  Aborting"));
 		
 	parent->finishedProgress();
 }
@@ -578,6 +759,12 @@ void phantInterface::loadCTFiles() {
 	if (paths.isEmpty()) // If you didn't get any files, quit
 		return;
 	
+	// DICOM slices replace any loaded CT sidecar
+	if (parent->data->CT_cache) {
+		parent->data->clearSidecar();
+		ctListView->clear();
+	}
+	
 	double increment = 100.0/paths.size();
     parent->resetProgress("Loading DICOM files");
 	
@@ -641,6 +828,12 @@ void phantInterface::loadCTDir() { // Very similar to CT files with an extra ste
 	QStringList paths;
 	QStringList failedFiles;
 	
+	// DICOM slices replace any loaded CT sidecar
+	if (parent->data->CT_cache) {
+		parent->data->clearSidecar();
+		ctListView->clear();
+	}
+	
 	double increment = 100.0/paths.size();
     parent->resetProgress("Loading DICOM files");
 	
@@ -716,6 +909,8 @@ void phantInterface::loadCTDir() { // Very similar to CT files with an extra ste
 // allowed to move files around, it should always be sorted in ascending z order
 void phantInterface::repopulateCT() {
 	ctListView->clear();
+	if (parent->data->CT_cache)
+		ctListView->addItem(parent->data->CT_cache->path.split("/").last());
 	for (int i = 0; i < parent->data->CT_data.size(); i++)
 		ctListView->addItem(parent->data->CT_data[i]->path.split("/").last());
 }
@@ -724,6 +919,13 @@ void phantInterface::deleteCT() {
 	// I'm operating under the assumption that parent->data->CT_data indexing
 	// matches ctListView, which could be a dangerous assumption, may be worth
 	// revisiting
+	// A loaded CT sidecar is the only entry in the list
+	if (parent->data->CT_cache) {
+		parent->data->clearSidecar();
+		repopulateCT();
+		return;
+	}
+	
 	QList <QListWidgetItem*> toBeDeleted = ctListView->selectedItems();
 	
 	QVector <int> ind;
@@ -744,6 +946,7 @@ void phantInterface::deleteAllCT() {
 		delete parent->data->CT_data[i];
 		parent->data->CT_data.remove(i);
 	}
+	parent->data->clearSidecar();
 	
 	// Repopulate CT list
 	repopulateCT();
@@ -938,12 +1141,26 @@ void phantInterface::loadStruct() {
 	parent->data->structPos  = structPos;
 	parent->data->structZ    = structZ;
 	parent->data->structName = structName;
+	parent->data->indexStructs();
+	
+	fillStructs();
+	
+	// Update the struct file field
+	structEdit->setText(path);
+	structEdit->setToolTip(path);
 	
+	// Save file in data
+	parent->data->struct_data = structFile;
+	parent->data->struct_loaded = true;
+}
+
+// Fill the contour widgets with the structs in data
+void phantInterface::fillStructs() {
 	// Filter out all structs which are essentially empty from the UI
 	QStringList validStructName;
-	for (int i = 0; i < structName.size(); i++) {
-		if (structZ[i].size() > 0) { // We have at least one layer
-			validStructName << structName[i];
+	for (int i = 0; i < parent->data->structName.size(); i++) {
+		if (parent->data->structZ[i].size() > 0) { // We have at least one layer
+			validStructName << parent->data->structName[i];
 		}
 	}
 	
@@ -971,13 +1188,47 @@ void phantInterface::loadStruct() {
 	marContourBox->clear();
 	marContourBox->addItems(validStructName);
 	
-	// Update the struct file field
+	cropContourBox->clear();
+	cropContourBox->addItems(validStructName);
+	
+	refresh();
+}
+
+// Load the decoded CT and structs of a previous build
+void phantInterface::loadSidecar() {
+	QString path = QFileDialog::getOpenFileName(this, tr("Load CT sidecar"), parent->data->gui_location+"/database/egsphant", tr("CT sidecar (*.ct.gz)"));
+	if (path.isEmpty())
+		return;
+	
+	int err = parent->data->loadSidecar(path);
+	if (err == 501) {
+		QMessageBox::warning(0, "file error",
+        tr("Could not open selected file, aborting."));
+        return;
+	}
+	else if (err == 502) {
+		QMessageBox::warning(0, "file error",
+        tr("Selected file is not a complete CT sidecar, aborting."));
+        return;
+	}
+	
+	// The sidecar replaces any DICOM slices, and its structs replace any loaded ones
+	for (int i = parent->data->CT_data.size()-1; i >= 0; i--) {
+		delete parent->data->CT_data[i];
+		parent->data->CT_data.remove(i);
+	}
+	repopulateCT();
+	
+	if (parent->data->struct_loaded)
+		delete parent->data->struct_data;
+	parent->data->struct_data = 0;
+	parent->data->struct_loaded = false;
+	
+	phantNameEdit->setText(path.split("/").last().left(path.split("/").last().size()-6));
+	
+	fillStructs();
 	structEdit->setText(path);
 	structEdit->setToolTip(path);
-	
-	// Save file in data
-	parent->data->struct_data = structFile;
-	parent->data->struct_loaded = true;
 }
 
 int phantInterface::parseError(int err) {
@@ -1057,6 +1308,26 @@ void phantInterface::refresh() {
 		marContour->setDisabled(true);
 		marContourBox->setDisabled(true);
 	}
+	
+	slabLabel->setDisabled(!streamEnable->isChecked());
+	slabEdit->setDisabled(!streamEnable->isChecked());
+	
+	// Cropping and resampling work on the whole phantom, so not on low memory builds
+	bool inMemory = !streamEnable->isChecked();
+	cropLabel->setEnabled(inMemory);
+	cropMode->setEnabled(inMemory);
+	for (int i = 0; i < 3; i++) {
+		cropAxisLabel[i]->setEnabled(inMemory && cropMode->currentIndex() == 1);
+		cropEdit[2*i]->setEnabled(inMemory && cropMode->currentIndex() == 1);
+		cropEdit[2*i+1]->setEnabled(inMemory && cropMode->currentIndex() == 1);
+	}
+	cropContourLabel->setEnabled(inMemory && cropMode->currentIndex() == 2);
+	cropContourBox->setEnabled(inMemory && cropMode->currentIndex() == 2 && !parent->data->structName.isEmpty());
+	cropMarginLabel->setEnabled(inMemory && cropMode->currentIndex() == 3);
+	cropMarginEdit->setEnabled(inMemory && cropMode->currentIndex() == 3);
+	resampleEnable->setEnabled(inMemory);
+	for (int i = 0; i < 3; i++)
+		resampleEdit[i]->setEnabled(inMemory && resampleEnable->isChecked());
 }
 
 void phantInterface::loadHU2rho() {
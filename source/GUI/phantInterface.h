@@ -64,6 +64,8 @@ public:
     QGridLayout *mainLayout;
 	
 	QRegExpValidator allowedNums;
+	QRegExpValidator allowedNats;
+	QRegExpValidator allowedReals;
 	
 	// Select DICOM files
 	QLabel*      dcmImport;
@@ -85,6 +87,8 @@ public:
 	QLineEdit*   calibEdit;
 	QPushButton* calibLoad;
 	
+	QPushButton* ctSidecarLoad;
+	
 	QPushButton* create;
 	
 	QGridLayout* dcmGrid;
@@ -140,6 +144,30 @@ public:
 	QGridLayout* marGrid;
 	QFrame*      marFrame;
 	
+	// Build options
+	QLabel*      buildLabel;
+	
+	QCheckBox*   streamEnable;
+	QLabel*      slabLabel;
+	QLineEdit*   slabEdit;
+	
+	QLabel*      cropLabel;
+	QComboBox*   cropMode;
+	QVector <QLabel*>    cropAxisLabel;
+	QVector <QLineEdit*> cropEdit; // x min, x max, y min, y max, z min, z max
+	QLabel*      cropContourLabel;
+	QComboBox*   cropContourBox;
+	QLabel*      cropMarginLabel;
+	QLineEdit*   cropMarginEdit;
+	
+	QCheckBox*   resampleEnable;
+	QVector <QLineEdit*> resampleEdit; // x, y, z voxel size
+	
+	QCheckBox*   sidecarEnable;
+	
+	QGridLayout* buildGrid;
+	QFrame*      buildFrame;
+	
 	// MAR settings arrays
 	QStringList defMARs, LTs, UTs, Dens, Rads;
 
@@ -156,6 +184,8 @@ public slots:
 	
 	// DICOM functions
 	void loadStruct(); // Read in DICOM struct file
+	void fillStructs(); // Refill the contour widgets from data
+	void loadSidecar(); // Read in a CT sidecar instead of DICOM CT and struct files
 	void loadHU2rho(); // Change material file
 	
 	void loadCTFiles(); // Load CT files into memory
@@ -0,0 +1,343 @@
+/*
+################################################################################
+#
+#  egs_brachy_GUI batch.cpp
+#  Copyright (C) 2021 Shannon Jarvis, Martin Martinov, and Rowan Thomson
+#
+#  This file is part of egs_brachy_GUI
+#
+#  egs_brachy_GUI is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Affero General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  egs_brachy_GUI is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Affero General Public License for more details:
+#  <http://www.gnu.org/licenses/>.
+#
+################################################################################
+#
+#  When egs_brachy is used for publications, please cite our paper:
+#  M. J. P. Chamberland, R. E. P. Taylor, D. W. O. Rogers, and R. M. Thomson,
+#  egs brachy: a versatile and fast Monte Carlo code for brachytherapy,
+#  Phys. Med. Biol. 61, 8214-8231 (2016).
+#
+#  When egs_brachy_GUI is used for publications, please cite our paper:
+#  To Be Announced
+#
+################################################################################
+#
+#  Author:        Shannon Jarvis
+#                 Martin Martinov (martinov@physics.carleton.ca)
+#
+#  Contributors:  Rowan Thomson (rthomson@physics.carleton.ca)
+#
+################################################################################
+*/
+#include "batch.h"
+
+QImage composeSlice(const QImage &base, const QImage &map, double opacity,
+                    const QVector <QVector <QPolygonF> >* const lines[3],
+                    const QVector <QColor> &colours, int thickness) {
+	QImage canvas = base;
+	QPainter paint (&canvas);
+	
+	// Add colour map
+	if (!map.isNull()) {
+		paint.setOpacity(opacity);
+		paint.drawImage(0,0,map);
+		paint.setOpacity(1);
+	}
+	
+	// Add isodose contours, each dose as a single path of its polylines
+	QPen pen;
+	pen.setWidth(thickness);
+	Qt::PenStyle styles[3] = {Qt::SolidLine, Qt::DotLine, Qt::DashLine};
+	QPainterPath path;
+	
+	for (int i = 0; i < 3; i++)
+		if (lines[i])
+			for (int j = 0; j < lines[i]->size() && j < colours.size(); j++) {
+				pen.setStyle(styles[i]);
+				pen.setColor(colours[j]);
+				paint.setPen(pen);
+				
+				path = QPainterPath();
+				for (int k = 0; k < (*lines[i])[j].size(); k++)
+					path.addPolygon((*lines[i])[j][k]);
+				paint.drawPath(path);
+			}
+	
+	paint.end();
+	return canvas;
+}
+
+// Load a phantom by its extension, false if it isn't one or holds no voxels
+static bool batchLoad(EGSPhant* phant, QString path) {
+	if (path.endsWith(".egsphant.gz"))
+		phant->loadgzEGSPhantFilePlus(path);
+	else if (path.endsWith(".begsphant"))
+		phant->loadbEGSPhantFilePlus(path);
+	else if (path.endsWith(".egsphant"))
+		phant->loadEGSPhantFilePlus(path);
+	else
+		return false;
+	return phant->nx > 0 && phant->ny > 0 && phant->nz > 0;
+}
+
+// Load a dose by its extension, false if it isn't one or holds no voxels
+static bool batchLoad(Dose* dose, QString path) {
+	if (path.endsWith(".b3ddose"))
+		dose->readBIn(path, 1);
+	else if (path.endsWith(".3ddose"))
+		dose->readIn(path, 1);
+	else
+		return false;
+	return dose->cx.size() > 1 && dose->cy.size() > 1 && dose->cz.size() > 1;
+}
+
+int batchRender(const batchJob &job, QString* error) {
+	// Load every layer, the first one loaded sets the slices and default bounds
+	EGSPhant phant;
+	Dose map, iso[3];
+	QVector <const QVector <double>* > bounds; // x, y and z boundaries of the first layer
+	
+	if (!job.phantPath.isEmpty()) {
+		if (!batchLoad(&phant, job.phantPath)) {
+			*error = QString("Could not read ")+job.phantPath+" as an egsphant.gz, begsphant or egsphant file";
+			return 1;
+		}
+		bounds << &phant.x << &phant.y << &phant.z;
+	}
+	
+	if (!job.mapPath.isEmpty()) {
+		if (!batchLoad(&map, job.mapPath)) {
+			*error = QString("Could not read ")+job.mapPath+" as a 3ddose or b3ddose file";
+			return 1;
+		}
+		if (bounds.isEmpty())
+			bounds << &map.cx << &map.cy << &map.cz;
+	}
+	
+	for (int i = 0; i < 3; i++)
+		if (!job.isoPaths[i].isEmpty()) {
+			if (!batchLoad(&iso[i], job.isoPaths[i])) {
+				*error = QString("Could not read ")+job.isoPaths[i]+" as a 3ddose or b3ddose file";
+				return 1;
+			}
+			if (bounds.isEmpty())
+				bounds << &iso[i].cx << &iso[i].cy << &iso[i].cz;
+		}
+	
+	if (bounds.isEmpty()) {
+		*error = "Nothing to render, no phantom or dose was given";
+		return 2;
+	}
+	
+	// The canvas x axis spans the vertical bounds and its y axis the horizontal ones
+	Axis horAxis = job.axis == Z_AXIS ? Y_AXIS : Z_AXIS, vertAxis = job.axis == X_AXIS ? Y_AXIS : X_AXIS;
+	double horMin = job.horMin, horMax = job.horMax, vertMin = job.vertMin, vertMax = job.vertMax;
+	if (!job.bounded) {
+		horMin  = bounds[horAxis]->first();
+		horMax  = bounds[horAxis]->last();
+		vertMin = bounds[vertAxis]->first();
+		vertMax = bounds[vertAxis]->last();
+	}
+	
+	// Slices of the first layer with their centres within the range
+	const QVector <double> &b = *bounds[job.axis];
+	double from = job.from < job.to ? job.from : job.to, to = job.from < job.to ? job.to : job.from, centre;
+	QVector <double> depths;
+	for (int i = 0; i < b.size()-1; i++) {
+		centre = (b[i]+b[i+1])/2.0;
+		if (from <= centre && centre <= to)
+			depths.append(centre);
+	}
+	
+	if (depths.isEmpty()) {
+		*error = QString("No slices have their centres between ")+QString::number(from)+" and "+QString::number(to);
+		return 2;
+	}
+	
+	// Window the colour map on its percentiles unless given, there are none without a map
+	double mapMin = job.mapMin, mapMax = job.mapMax;
+	if (!job.mapWindow && !job.mapPath.isEmpty()) {
+		mapMin = map.getPercentile(0.01);
+		mapMax = map.getPercentile(0.99);
+	}
+	
+	// Build the lookups here, so that the slices sharing a file only read them
+	if (!job.phantPath.isEmpty())
+		phant.prepareLookups();
+	if (!job.mapPath.isEmpty())
+		map.prepareLookups();
+	for (int i = 0; i < 3; i++)
+		if (!job.isoPaths[i].isEmpty())
+			iso[i].prepareLookups();
+	
+	// Render each slice as its own task, with the compositing of the preview
+	QImage black(int((vertMax-vertMin)*job.res), int((horMax-horMin)*job.res), QImage::Format_ARGB32_Premultiplied);
+	black.fill(qRgb(0,0,0));
+	QVector <int> slices(depths.size()), failed(depths.size(), 0);
+	for (int n = 0; n < slices.size(); n++)
+		slices[n] = n;
+	
+	QtConcurrent::blockingMap(slices, [&](int &n) {
+		QImage base = black, colours;
+		QVector <QVector <QPolygonF> > lines[3];
+		const QVector <QVector <QPolygonF> >* shown[3] = {0, 0, 0};
+		
+		if (!job.phantPath.isEmpty() && job.density)
+			base = phant.getEGSPhantPicDen(job.axis, horMin, horMax, vertMin, vertMax, depths[n], job.res,
+										   job.denMin, job.denMax);
+		else if (!job.phantPath.isEmpty())
+			base = phant.getEGSPhantPicMed(job.axis, horMin, horMax, vertMin, vertMax, depths[n], job.res);
+		
+		if (!job.mapPath.isEmpty())
+			colours = map.getColourMap(job.axis, horMin, horMax, vertMin, vertMax, depths[n], job.res,
+									   mapMin, mapMax, job.minColour, job.midColour, job.maxColour);
+		
+		for (int i = 0; i < 3; i++)
+			if (!job.isoPaths[i].isEmpty()) {
+				iso[i].getContour(&lines[i], job.levels, job.axis, depths[n], horMin, horMax, vertMin, vertMax, job.res);
+				shown[i] = &lines[i];
+			}
+		
+		QImage slice = composeSlice(base, colours, job.opacity, shown, job.levelColours, job.thickness);
+		if (!slice.save(job.output+QString("_%1.png").arg(n+1, 4, 10, QChar('0')), "PNG"))
+			failed[n] = 1;
+	});
+	
+	for (int n = 0; n < failed.size(); n++)
+		if (failed[n]) {
+			*error = QString("Could not write ")+job.output+QString("_%1.png").arg(n+1, 4, 10, QChar('0'));
+			return 3;
+		}
+	
+	return 0;
+}
+
+// Split a comma separated list of numbers, false if any of them isn't one
+static bool batchNumbers(QString text, QVector <double>* values) {
+	QStringList fields = text.replace(' ',',').split(',', QString::SkipEmptyParts);
+	bool ok = true;
+	values->clear();
+	for (int i = 0; i < fields.size() && ok; i++)
+		values->append(fields[i].toDouble(&ok));
+	return ok && !values->isEmpty();
+}
+
+int batchMain(int argc, char **argv) {
+	QCoreApplication app(argc, argv); // Nothing here needs a display
+	QCoreApplication::setApplicationName("eb_gui");
+	
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Render a stack of dose preview slices to a PNG sequence without a window.");
+	parser.addHelpOption();
+	parser.addOptions({
+		{"batch", "Run without a window, as this."},
+		{"phant", "Phantom file drawn under the doses.", "file"},
+		{"density", "Grey the phantom by density within min,max rather than by media.", "min,max"},
+		{"dose", "Dose file drawn as a colour map.", "file"},
+		{"dose-range", "Doses spanned by the colour map, the 1st to 99th percentiles by default.", "min,max"},
+		{"opacity", "Opacity of the colour map in %, 50 by default.", "percent"},
+		{"isodose", "Dose file contoured as solid, dotted then dashed lines, at most 3 times.", "file"},
+		{"levels", "Isodose levels in Gy, 20,40,60,80,100 by default.", "list"},
+		{"axis", "Axis the slices are stacked along, z by default.", "x|y|z"},
+		{"from", "Centre of the first slice rendered (cm).", "depth"},
+		{"to", "Centre of the last slice rendered (cm).", "depth"},
+		{"res", "Pixels per cm, 10 by default.", "n"},
+		{"bounds", "Horizontal then vertical range of the slices (cm), the first file's by default.", "hmin,hmax,vmin,vmax"},
+		{"out", "Prefix of the PNG files, slice n being saved as prefix_000n.png (from 0001).", "prefix"}
+	});
+	parser.process(app);
+	
+	batchJob job;
+	QVector <double> values;
+	QStringList isoPaths = parser.values("isodose");
+	
+	job.phantPath = parser.value("phant");
+	job.mapPath   = parser.value("dose");
+	for (int i = 0; i < isoPaths.size() && i < 3; i++)
+		job.isoPaths[i] = isoPaths[i];
+	job.output = parser.value("out");
+	
+	QString axis = parser.value("axis").isEmpty() ? QString("z") : parser.value("axis").toLower();
+	if (axis != "x" && axis != "y" && axis != "z") {
+		std::cerr << "--axis takes x, y or z\n";
+		return 1;
+	}
+	job.axis = toAxis(axis);
+	
+	if (job.output.isEmpty() || !parser.isSet("from") || !parser.isSet("to")) {
+		std::cerr << "A slice range (--from and --to) and an output prefix (--out) are needed, see --help\n";
+		return 1;
+	}
+	job.from = parser.value("from").toDouble();
+	job.to   = parser.value("to").toDouble();
+	
+	if (parser.isSet("density")) {
+		if (!batchNumbers(parser.value("density"), &values) || values.size() != 2) {
+			std::cerr << "--density takes min,max\n";
+			return 1;
+		}
+		job.density = true;
+		job.denMin = values[0];
+		job.denMax = values[1];
+	}
+	
+	if (parser.isSet("dose-range")) {
+		if (!batchNumbers(parser.value("dose-range"), &values) || values.size() != 2) {
+			std::cerr << "--dose-range takes min,max\n";
+			return 1;
+		}
+		job.mapWindow = true;
+		job.mapMin = values[0];
+		job.mapMax = values[1];
+	}
+	
+	if (parser.isSet("opacity")) {
+		bool ok;
+		job.opacity = parser.value("opacity").toDouble(&ok)/100.0;
+		if (!ok || job.opacity < 0 || job.opacity > 1) {
+			std::cerr << "--opacity takes a percentage from 0 to 100\n";
+			return 1;
+		}
+	}
+	
+	if (parser.isSet("levels")) {
+		if (!batchNumbers(parser.value("levels"), &job.levels)) {
+			std::cerr << "--levels takes a list of doses\n";
+			return 1;
+		}
+		while (job.levelColours.size() < job.levels.size()) // Reuse the colours past the fifth level
+			job.levelColours.append(job.levelColours[job.levelColours.size()-5]);
+	}
+	
+	if (parser.isSet("res"))
+		job.res = parser.value("res").toInt();
+	if (job.res < 1) {
+		std::cerr << "--res takes a positive number of pixels per cm\n";
+		return 1;
+	}
+	
+	if (parser.isSet("bounds")) {
+		if (!batchNumbers(parser.value("bounds"), &values) || values.size() != 4) {
+			std::cerr << "--bounds takes hmin,hmax,vmin,vmax\n";
+			return 1;
+		}
+		job.bounded = true;
+		job.horMin  = qMin(values[0], values[1]);
+		job.horMax  = qMax(values[0], values[1]);
+		job.vertMin = qMin(values[2], values[3]);
+		job.vertMax = qMax(values[2], values[3]);
+	}
+	
+	QString error;
+	int err = batchRender(job, &error);
+	if (err)
+		std::cerr << error.toStdString() << "\n";
+	return err;
+}
@@ -0,0 +1,87 @@
+/*
+################################################################################
+#
+#  egs_brachy_GUI batch.h
+#  Copyright (C) 2021 Shannon Jarvis, Martin Martinov, and Rowan Thomson
+#
+#  This file is part of egs_brachy_GUI
+#
+#  egs_brachy_GUI is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Affero General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  egs_brachy_GUI is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Affero General Public License for more details:
+#  <http://www.gnu.org/licenses/>.
+#
+################################################################################
+#
+#  When egs_brachy is used for publications, please cite our paper:
+#  M. J. P. Chamberland, R. E. P. Taylor, D. W. O. Rogers, and R. M. Thomson,
+#  egs brachy: a versatile and fast Monte Carlo code for brachytherapy,
+#  Phys. Med. Biol. 61, 8214-8231 (2016).
+#
+#  When egs_brachy_GUI is used for publications, please cite our paper:
+#  To Be Announced
+#
+################################################################################
+#
+#  Author:        Shannon Jarvis
+#                 Martin Martinov (martinov@physics.carleton.ca)
+#
+#  Contributors:  Rowan Thomson (rthomson@physics.carleton.ca)
+#
+################################################################################
+*/
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <QtGui>
+#include <QtConcurrent>
+
+#include "data/egsphant.h"
+#include "data/dose.h"
+
+// Draw the colour map over base at opacity (skipped if map is null), then the
+// isodose lines of each of the 3 sets that isn't 0, dose level j in colours[j]
+QImage composeSlice(const QImage &base, const QImage &map, double opacity,
+                    const QVector <QVector <QPolygonF> >* const lines[3],
+                    const QVector <QColor> &colours, int thickness);
+
+// Everything a stack of slices is rendered with, the defaults being those of the
+// dose preview
+struct batchJob {
+    QString phantPath, mapPath, isoPaths[3]; // Empty for layers left out
+	
+    bool density = false; // Grey the phantom by density within [denMin, denMax] rather than by media
+    double denMin = 0, denMax = 3;
+	
+    bool mapWindow = false; // Use [mapMin, mapMax] rather than the 1st and 99th dose percentiles
+    double mapMin = 0, mapMax = 0, opacity = 0.5;
+    QColor minColour = QColor(0,0,255), midColour = QColor(0,255,0), maxColour = QColor(255,0,0);
+	
+    QVector <double> levels = {20, 40, 60, 80, 100}; // Isodose levels in Gy
+    QVector <QColor> levelColours = {QColor(0,0,255), QColor(0,255,255), QColor(0,255,0),
+                                     QColor(255,255,0), QColor(255,0,0)};
+    int thickness = 2;
+	
+    Axis axis = Z_AXIS;
+    double from = 0, to = 0; // Every slice with its centre in [from, to] is rendered
+    int res = 10; // Pixels per cm
+    bool bounded = false; // Use the bounds below rather than the extent of the first layer
+    double horMin = 0, horMax = 0, vertMin = 0, vertMax = 0;
+	
+    QString output; // Slice n (from 1) is saved as output_000n.png, zero padded to 4 digits
+};
+
+// Load the files of job and save every slice, rendered in parallel, returning 0
+// on success or the number of the step that failed with its reason in error
+int batchRender(const batchJob &job, QString* error);
+
+// Run a batch from the command line (see --help), without any window
+int batchMain(int argc, char **argv);
+
+#endif
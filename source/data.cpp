@@ -107,6 +107,8 @@ int Data::loadDefaults() {
 				isodoseLineThickness = text.right(text.length()-24).trimmed().toInt();
 			else if (text.left(22).compare("histogram bin count =") == 0)
 				histogramBinCount = text.right(text.length()-22).trimmed().toInt();
+			else if (text.left(20).compare("egsphant slab size =") == 0)
+				egsphantSlabSize = text.right(text.length()-20).trimmed().toInt();
 			else if (text.left(24).compare("seed discovery density =") == 0)
 				def_seedDisc = text.right(text.length()-24).trimmed();
 	    }
@@ -294,6 +296,7 @@ int Data::loadDefaults() {
 Data::~Data(){
 	if (struct_data) delete struct_data;
 	if (plan_data) delete plan_data;
+	if (CT_cache) delete CT_cache;
 }
 
 int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defaultTAS,
@@ -305,14 +308,216 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 	
 	newProgress("Building egsphant");
 	
+	egsphantBuild build;
+	int err = buildSetup(&build, phant, log, contourNum, defaultTAS, structIndex, tasIndex);
+	if (err)
+		return err;
+	
+	// Setup media array
+	{
+		QVector <char> mz(phant->nz, 0);
+		QVector <QVector <char> > my(phant->ny, mz);
+		QVector <QVector <QVector <char> > > mx(phant->nx, my);
+		phant->m = mx;
+	}
+	
+	// Setup masks before allocating density array to save space
+	
+	#if defined(DEBUG_BUILDEGSPHANT)
+		std::cout << "Making masks\n"; std::cout.flush();
+	#endif
+	
+	for (int i = 0; i < contourNum; i++) {
+		EGSPhant* temp = new EGSPhant;
+		temp->makeMask(phant);
+		makeMasks->append(temp);
+	}
+	
+	// Setup density array
+	{
+		QVector <double> dz(phant->nz, 0);
+		QVector <QVector <double> > dy(phant->ny, dz);
+		QVector <QVector <QVector <double> > > dx(phant->nx, dy);
+		phant->d = dx;
+	}
+	
+	// The whole phantom is built as a single slab
+	err = buildSlab(&build, phant, makeMasks, 0);
+	finishSidecar(&build, !err);
+	if (err) {
+		for (int i = 0; i < makeMasks->size(); i++)
+			delete (*makeMasks)[i];
+		makeMasks->clear();
+		return err;
+	}
+	
+	buildLog(&build, log);
+	
+	return 0;
+}
+
+int Data::buildEgsphantStream(QString path, QStringList maskPaths, QString* log, int contourNum,
+							  int defaultTAS, QVector <int>* structIndex, QVector <int>* tasIndex) {
+	#if defined(DEBUG_BUILDEGSPHANT)
+		std::cout << "Streaming egsphant\n"; std::cout.flush();
+	#endif
+	
+	newProgress("Building egsphant");
+	
+	// phant only holds the geometry and media of the full phantom, the voxel
+	// data is built slabSize slices at a time and written out immediately
+	egsphantBuild build;
+	EGSPhant phant;
+	int err = buildSetup(&build, &phant, log, contourNum, defaultTAS, structIndex, tasIndex);
+	if (err)
+		return err;
+	
+	// Open the egsphant output and write its header
+	ogzstream phantOut(path.toStdString().c_str());
+	if (!phantOut.good()) {
+		finishSidecar(&build, false);
+		return 301;
+	}
+	phant.saveHeader(&phantOut);
+	
+	// Open the requested mask outputs (empty paths are not output) and write their headers
+	EGSPhant maskGeom;
+	maskGeom.nx = phant.nx;
+	maskGeom.ny = phant.ny;
+	maskGeom.nz = phant.nz;
+	maskGeom.x = phant.x;
+	maskGeom.y = phant.y;
+	maskGeom.z = phant.z;
+	maskGeom.media << "OTHER" << "TARGET";
+	
+	QVector <ogzstream*> maskOut(contourNum, 0);
+	for (int i = 0; i < contourNum && i < maskPaths.size(); i++)
+		if (!maskPaths[i].isEmpty()) {
+			maskOut[i] = new ogzstream(maskPaths[i].toStdString().c_str());
+			maskGeom.saveHeader(maskOut[i]);
+		}
+	
+	// Densities follow all the media in the file, so they are spooled to a
+	// temporary file as raw doubles and appended once all slabs are built
+	QTemporaryFile spool;
+	if (!spool.open())
+		err = 302;
+	
+	int slabSize = egsphantSlabSize > 0 ? egsphantSlabSize : 1;
+	QVector <double> row(phant.nx);
+	for (int k0 = 0; k0 < phant.nz && !err; k0 += slabSize) {
+		EGSPhant slab;
+		slab.nx = phant.nx;
+		slab.ny = phant.ny;
+		slab.nz = qMin(slabSize, phant.nz-k0);
+		slab.x = phant.x;
+		slab.y = phant.y;
+		slab.z = phant.z.mid(k0, slab.nz+1);
+		slab.media = phant.media;
+		slab.maxDensity = 0;
+		
+		// Setup media and density arrays for this slab only
+		{
+			QVector <char> mz(slab.nz, 0);
+			QVector <QVector <char> > my(slab.ny, mz);
+			QVector <QVector <QVector <char> > > mx(slab.nx, my);
+			slab.m = mx;
+			
+			QVector <double> dz(slab.nz, 0);
+			QVector <QVector <double> > dy(slab.ny, dz);
+			QVector <QVector <QVector <double> > > dx(slab.nx, dy);
+			slab.d = dx;
+		}
+		
+		QVector <EGSPhant*> slabMasks;
+		for (int i = 0; i < contourNum; i++) {
+			EGSPhant* temp = new EGSPhant;
+			temp->makeMask(&slab);
+			slabMasks.append(temp);
+		}
+		
+		err = buildSlab(&build, &slab, &slabMasks, k0);
+		
+		if (!err) {
+			// Media goes straight to the outputs
+			slab.saveMedia(&phantOut);
+			for (int i = 0; i < contourNum; i++)
+				if (maskOut[i])
+					slabMasks[i]->saveMedia(maskOut[i]);
+			
+			// Densities are spooled in the same k, j, i order they are written in
+			for (int k = 0; k < slab.nz && !err; k++)
+				for (int j = 0; j < slab.ny && !err; j++) {
+					for (int i = 0; i < slab.nx; i++)
+						row[i] = slab.d[i][j][k];
+					if (spool.write((const char*)row.constData(), slab.nx*sizeof(double)) != qint64(slab.nx*sizeof(double)))
+						err = 302;
+				}
+			
+			emit madeProgress(10.0*double(slab.nz)/double(phant.nz)); // 10%
+		}
+		
+		for (int i = 0; i < slabMasks.size(); i++)
+			delete slabMasks[i];
+	}
+	
+	// Append the spooled densities
+	if (!err) {
+		emit newProgressName("Writing density arrays");
+		phantOut << "\n";
+		spool.seek(0);
+		
+		double increment = 35.0/double(phant.nz); // 35%
+		for (int k = 0; k < phant.nz && !err; k++) {
+			for (int j = 0; j < phant.ny; j++) {
+				if (spool.read((char*)row.data(), phant.nx*sizeof(double)) != qint64(phant.nx*sizeof(double))) {
+					err = 302;
+					break;
+				}
+				for (int i = 0; i < phant.nx; i++)
+					phantOut << row[i] << " ";
+			}
+			emit madeProgress(increment);
+		}
+	}
+	phantOut.close();
+	finishSidecar(&build, !err);
+	
+	for (int i = 0; i < contourNum; i++)
+		if (maskOut[i]) {
+			if (!err)
+				(*maskOut[i]) << "\n";
+			maskOut[i]->close();
+			delete maskOut[i];
+		}
+	
+	// Don't leave partial files behind
+	if (err) {
+		QFile::remove(path);
+		for (int i = 0; i < contourNum && i < maskPaths.size(); i++)
+			if (!maskPaths[i].isEmpty())
+				QFile::remove(maskPaths[i]);
+		return err;
+	}
+	
+	buildLog(&build, log);
+	
+	return 0;
+}
+
+int Data::buildSetup(egsphantBuild* build, EGSPhant* phant, QString* log, int contourNum, int defaultTAS,
+					 QVector <int>* structIndex, QVector <int>* tasIndex) {
 	QString medIdx = "123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 	QMap <QString, QChar> mediaIndex;
-	QMap <int, int> structToTas;
+	
+	build->contourNum = contourNum;
+	build->defaultTAS = defaultTAS;
+	build->structIndex = structIndex;
 	
 	// Create a mapping from struct indices to non-default TAS indices for later
 	for (int i = 0; i < contourNum; i++) {
 		if ((*tasIndex)[i] >= 0)
-			structToTas[(*structIndex)[i]] = (*tasIndex)[i];
+			build->structToTas[(*structIndex)[i]] = (*tasIndex)[i];
 	}
 	
 	// Start empty log
@@ -332,7 +537,7 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 		for (int i = 0; i < mediaIndex.size(); i++)
 			std::cout << mediaIndex.keys()[i].toStdString() << " - " << mediaIndex.values()[i].toLatin1() << "\n";
 	#endif
-		
+	
 	*log = *log + "\nContour TAS defined below in order of descending priority:\n";
 	for (int i = 0; i < contourNum; i++) {
 		if (tasIndex->at(i) != -1) { // Not default TAS
@@ -380,6 +585,30 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 	
 	*log = *log + "----------------------------------\n";
 	
+	// Compile each TAS in use into its thresholds (all but the last, as the last
+	// media takes everything above them) and the egsphant character and media
+	// index of each of its media, so each voxel needs a single lookup
+	QList <int> usedTAS = build->structToTas.values();
+	usedTAS << defaultTAS;
+	build->tasThreshold.resize(TAS_names.size());
+	build->tasSorted.fill(true, TAS_names.size());
+	build->tasChar.resize(TAS_names.size());
+	build->tasMedium.resize(TAS_names.size());
+	for (int i = 0; i < usedTAS.size(); i++) {
+		int q = usedTAS[i];
+		if (!build->tasChar[q].isEmpty()) // Already compiled
+			continue;
+		
+		build->tasThreshold[q] = threshold[q].mid(0, threshold[q].size()-1);
+		for (int n = 1; n < build->tasThreshold[q].size(); n++)
+			if (build->tasThreshold[q][n] < build->tasThreshold[q][n-1])
+				build->tasSorted[q] = false; // Fall back on the linear scan
+		
+		for (int n = 0; n < media[q].size(); n++) {
+			build->tasChar[q] << mediaIndex[media[q][n]].toLatin1();
+			build->tasMedium[q] << phant->media.indexOf(media[q][n]);
+		}
+	}
 	
 	// Fetch HU units map from the file
 	*log = *log + "--- HU to density conversion data ---\n";
@@ -399,8 +628,8 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 			}
 			else if (tempS.contains("\t")) {
 				HUMap << tempS.split('\t', QString::SkipEmptyParts)[0].toDouble();
-				denMap << tempS.split('\t', QString::SkipEmptyParts)[1].toDouble();		
-				*log = *log + "  " + QString::number(HUMap.last()).rightJustified(8,' ') + " " + QString::number(denMap.last()) + "\n";		
+				denMap << tempS.split('\t', QString::SkipEmptyParts)[1].toDouble();
+				*log = *log + "  " + QString::number(HUMap.last()).rightJustified(8,' ') + " " + QString::number(denMap.last()) + "\n";
 			}
 			else {
 				return 101;
@@ -408,17 +637,182 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 		}
     }
 	else {
-		return 102;	
+		return 102;
 	}
 	file.close();
 	*log = *log + "-------------------------------------\n";
 	
+	// Interpolation needs at least one segment
+	if (HUMap.size() < 2)
+		return 101;
+	
+	// Tabulate the density of every possible HU value, so each voxel is converted
+	// with a single lookup
+	build->HUDensity.resize(65536);
+	for (int h = -32768; h < 32768; h++) {
+		int n;
+		
+		// Linear search because I don't think these arrays every get big
+		// get the right density
+		for (n = 0; n < HUMap.size()-1; n++)
+			if (HUMap[n] <= h && h < HUMap[n+1])
+				break;
+		
+		// Extrapolate the first and last segments past either end of the table
+		if (h < HUMap[0])
+			n = 0;
+		else if (n > HUMap.size()-2)
+			n = HUMap.size()-2;
+		
+		double temp = interp(h,HUMap[n],HUMap[n+1],denMap[n],denMap[n+1]);
+		build->HUDensity[h+32768] = temp<=0?0.000001:temp; // Set min density to 0.000001
+	}
+	
+	// Get the egsphant geometry, from the loaded CT sidecar if there is one
+	if (CT_cache) {
+		*log = *log + "--- Loading cached CT data ---\n";
+		*log = *log + "Using the " + QString::number(CT_cache->nz) + " (" + QString::number(CT_cache->nx) + "x" + QString::number(CT_cache->ny) + ") slices of CT sidecar " + CT_cache->path + "\n";
+		*log = *log + "-----------------------------\n";
+		
+		phant->nx = CT_cache->nx;
+		phant->ny = CT_cache->ny;
+		phant->nz = CT_cache->nz;
+		phant->x = CT_cache->x;
+		phant->y = CT_cache->y;
+		phant->z = CT_cache->z;
+		emit madeProgress(5.0);
+	}
+	else {
+		int err = parseCTGeometry(build, phant, log);
+		if (err)
+			return err;
+	}
+	
+	phant->maxDensity = 0;
+	build->nz = phant->nz;
+	
+	// Arrays for holding voxel counts for log file
+	for (int i = 0; i < structName.size(); i++)
+		build->structVol[structName[i]] = 0;
+	for (int i = 0; i < phant->media.size(); i++)
+		build->medVol[phant->media[i]] = 0;
+	
+	// Start the CT sidecar, the HU values are appended as each slice is decoded
+	if (!CT_cache && !sidecarPath.isEmpty())
+		startSidecar(build, phant, log);
+	
+	// Get bounding rectangles over each struct
+	
+	#if defined(DEBUG_BUILDEGSPHANT)
+		std::cout << "Constructing bounds around the structs\n"; std::cout.flush();
+	#endif
+	
+	//*log = *log + "Struct boundaries\n";
+	
+	QVector <QVector <QRectF> > &structRect = build->structRect;
+	
+	for (int i = 0; i < structPos.size(); i++) {
+		structRect.resize(i+1);
+		
+		#if defined(DEBUG_BUILDEGSPHANT)
+			std::cout << "  Struct: " + structName[i].toStdString() + "\n"; std::cout.flush();
+		#endif
+		
+		//*log = *log + "  Struct: " + structName[i] + "\n";
+		
+		for (int j = 0; j < structPos[i].size(); j++) {
+			structRect[i].resize(j+1);
+			structRect[i][j] = structPos[i][j].boundingRect();
+			
+			#if defined(DEBUG_BUILDEGSPHANT)
+				std::cout << "    z = " << structZ[i][j] << " : (";
+				std::cout << structRect[i][j].top() << ",";
+				std::cout << structRect[i][j].left() << "),(";
+				std::cout << structRect[i][j].bottom() << ",";
+				std::cout << structRect[i][j].right() << ")\n"; std::cout.flush();
+			#endif
+		}
+	}
+	
+	// Collect the metallic artifact reduction sources, the densities
+	// themselves are replaced as each slice is built
+	*log = *log + "--- Metallic artifact reduction ---\n";
+	if (do_MAR) {
+		*log = *log + "MAR is requested\n";
+		*log = *log + QString("  Set all densities outside of range [%1,%2] to %3\n").arg(lowerThresh).arg(upperThresh).arg(marDen);
+		*log = *log + QString("  within %1 cm of the source\n").arg(marRad);
+		if (marContourInd != -1) {
+			*log = *log + "  only in contour " + marContour + "\n";
+		}
+		*log = *log + "\n";
+	}
+	else
+		*log = *log + "no MAR is requested\n";
+	
+	build->marOpened = false;
+	build->marCount = build->marEvaluated = 0;
+	
+	if (do_MAR) {
+		// Input reading code
+		QFile file (gui_location+"/database/transformation/"+transformFile);
+		QString line;
+		double xP, yP, zP;
+		bool inStruct;
+		
+		if (file.open(QIODevice::ReadOnly)) {
+			build->marOpened = true;
+			QTextStream in (&file);
+			while(!in.atEnd()) {
+				
+				// Get the transformation lines from the text
+				line = in.readLine();
+				if (line.contains("translation =")) {
+					line = line.split("=")[1].trimmed();
+					xP = line.split(" ")[0].trimmed().toDouble();
+					yP = line.split(" ")[1].trimmed().toDouble();
+					zP = line.split(" ")[2].trimmed().toDouble();
+					
+					inStruct = false;
+					if (contourNum > 0 && marContourInd != -1) {
+						for (int m = 0; m < structZ[structIndex->at(marContourInd)].size(); m++) {
+							// If slice j of struct i on the same plane as slice k of the phantom
+							if (abs(structZ[structIndex->at(marContourInd)][m] - zP) < 0.1) { // 1 mm threshold
+								if (structPos[structIndex->at(marContourInd)][m].containsPoint(QPointF(xP,yP), Qt::OddEvenFill))
+									inStruct = true;
+							}
+						}
+					}
+					else
+						inStruct = true;
+					
+					if (inStruct) {
+						// Check that the cube bounding the sphere is within the phantom
+						if (phant->getIndex(X_AXIS,xP-marRad) < 0 || phant->getIndex(X_AXIS,xP+marRad) < 0 ||
+							phant->getIndex(Y_AXIS,yP-marRad) < 0 || phant->getIndex(Y_AXIS,yP+marRad) < 0 ||
+							phant->getIndex(Z_AXIS,zP-marRad) < 0 || phant->getIndex(Z_AXIS,zP+marRad) < 0)
+							*log = *log + QString("source position/radius out of bounds error for source [%1,%2,%3], skipping it\n").arg(xP).arg(yP).arg(zP);
+						else
+							build->marSources << (QVector <double>() << xP << yP << zP);
+						*log = *log + QString("    MAR performed at source position [%1,%2,%3]\n").arg(xP).arg(yP).arg(zP);
+					}
+				}
+			}
+		}
+		else {
+			*log = *log + "failed to open transport file, MAR aborted\n";
+		}
+	}
+	
+	return 0;
+}
+
+// Read the geometry of every CT slice into the egsphant boundaries, the HU
+// values themselves are only decoded by parseCTSlice as each slice is built
+int Data::parseCTGeometry(egsphantBuild* build, EGSPhant* phant, QString* log) {
 	// Read CT data
-	// Sort out all the DICOM data into the following
-	double rescaleM = 1, rescaleB = 0, rescaleFlag;
-    QVector <QVector <QVector <short int> > > HU;
-    QVector <unsigned short int> xPix;
-    QVector <unsigned short int> yPix;
+	// Sort out all the DICOM geometry into the following
+    QVector <unsigned short int> &xPix = build->xPix;
+    QVector <unsigned short int> &yPix = build->yPix;
     QVector <QVector <double> > imagePos;
     QVector <QVector <double> > xySpacing;
     QVector <double> zSpacing;
@@ -435,7 +829,6 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 		
 		emit madeProgress(increment);
 		
-		rescaleFlag = 0;
 		Attribute* tempAtt;
 		
 		// Pixel Spacing (Decimal String), row spacing and then column spacing (in mm)
@@ -443,12 +836,12 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 		if (tempAtt->tag[0] == 0x0028 && tempAtt->tag[1] == 0x0030) {
 			xySpacing.resize(xySpacing.size()+1);
 			xySpacing.last().resize(2);
-
+			
 			QString temp = "";
 			for (unsigned int s = 0; s < tempAtt->vl; s++) {
 				temp.append(tempAtt->vf[s]);
 			}
-
+			
 			xySpacing.last()[0] = (temp.split('\\',QString::SkipEmptyParts)[0]).toDouble();
 			xySpacing.last()[1] = (temp.split('\\',QString::SkipEmptyParts)[1]).toDouble();
 		}
@@ -462,9 +855,9 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 			for (unsigned int s = 0; s < tempAtt->vl; s++) {
 				temp.append(tempAtt->vf[s]);
 			}
-
+			
 			zSpacing.append(temp.toDouble());
-		} 
+		}
 		else
 			return 202;
 		
@@ -473,16 +866,16 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 		if (tempAtt->tag[0] == 0x0020 && tempAtt->tag[1] == 0x0032) {
 			imagePos.resize(imagePos.size()+1);
 			imagePos.last().resize(3);
-
+			
 			QString temp = "";
 			for (unsigned int s = 0; s < tempAtt->vl; s++) {
 				temp.append(tempAtt->vf[s]);
 			}
-
+			
 			imagePos.last()[0] = (temp.split('\\',QString::SkipEmptyParts)[0]).toDouble();
 			imagePos.last()[1] = (temp.split('\\',QString::SkipEmptyParts)[1]).toDouble();
 			imagePos.last()[2] = (temp.split('\\',QString::SkipEmptyParts)[2]).toDouble();
-		} 
+		}
 		else
 			return 203;
 		
@@ -494,7 +887,7 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 				(short int)(tempAtt->vf[1])));
 			else
 				xPix.append((unsigned short int)(((short int)(tempAtt->vf[1]) << 8) +
-				(short int)(tempAtt->vf[0])));	
+				(short int)(tempAtt->vf[0])));
 		}
 		else
 			return 204;
@@ -507,77 +900,15 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 				(short int)(tempAtt->vf[1])));
 			else
 				yPix.append((unsigned short int)(((short int)(tempAtt->vf[1]) << 8) +
-				(short int)(tempAtt->vf[0])));		
-		} 
-		else
-			return 205;
-		
-		// Rescale HU slope (assuming type is HU)
-		tempAtt = CT_data[i]->getEntry(0x0028,0x1053);
-		if (tempAtt->tag[0] == 0x0028 && tempAtt->tag[1] == 0x1053) {
-			QString temp = "";
-			for (unsigned int s = 0; s < tempAtt->vl; s++) {
-				temp.append(tempAtt->vf[s]);
-			}
-			
-			rescaleM = temp.toDouble();
-			rescaleFlag++;
-		}
-		//else
-		//	return 206;
-		// If not found, just don't rescale HU
-		
-		// Rescale HU intercept (assuming type is HU)
-		tempAtt = CT_data[i]->getEntry(0x0028,0x1052);
-		if (tempAtt->tag[0] == 0x0028 && tempAtt->tag[1] == 0x1052) {
-			QString temp = "";
-			for (unsigned int s = 0; s < tempAtt->vl; s++) {
-				temp.append(tempAtt->vf[s]);
-			}
-			
-			rescaleB = temp.toDouble();
-			rescaleFlag++;
-		}
-		//else
-		//	return 207;
-		// If not found, just don't rescale HU
-		
-		// HU values
-		tempAtt = CT_data[i]->getEntry(0x7FE0,0x0010);
-		if (tempAtt->tag[0] == 0x7FE0 && tempAtt->tag[1] == 0x0010) {
-			HU.resize(HU.size()+1);
-			if (HU.size() == xPix.size() && HU.size() == yPix.size()) {
-				HU.last().resize(yPix.last());
-				for (unsigned int k = 0; k < yPix.last(); k++) {
-					HU.last()[k].resize(xPix.last());
-				}
-				
-				short int temp;
-				if (CT_data[i]->isBigEndian)
-					for (unsigned int s = 0; s < tempAtt->vl; s+=2) {
-						temp  = (tempAtt->vf[s+1]);
-						temp += (short int)(tempAtt->vf[s]) << 8;
-						
-						HU.last()[int(int(s/2)/xPix.last())][int(s/2)%xPix.last()] =
-							rescaleFlag == 2 ? rescaleM*temp+rescaleB : temp;
-					}
-				else
-					for (unsigned int s = 0; s < tempAtt->vl; s+=2) {
-						temp  = (tempAtt->vf[s]);
-						temp += (short int)(tempAtt->vf[s+1]) << 8;
-						
-						HU.last()[int(int(s/2)/xPix.last())][int(s/2)%xPix.last()] =
-							rescaleFlag == 2 ? rescaleM*temp+rescaleB : temp;
-					}
-			}
+				(short int)(tempAtt->vf[0])));
 		}
 		else
-			return 208;
+			return 205;
 		
 		#if defined(DEBUG_BUILDEGSPHANT)
 			std::cout << " parsed!\n"; std::cout.flush();
 		#endif
-		
+    
     }
 	*log = *log + "Extracted all HU data for the " + QString::number(CT_data.size()) + " (" + QString::number(xPix[0]) + "x" + QString::number(yPix[0]) + ") slices\n";
 	*log = *log + "-----------------------------\n";
@@ -596,22 +927,15 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
     phant->x.fill(0,phant->nx+1);
     phant->y.fill(0,phant->ny+1);
     phant->z.fill(0,phant->nz+1);
-	
-	QMap <QString, int> medVol, structVol; // Arrays for holding voxel counts for log file
-	for (int i = 0; i < structName.size(); i++)
-		structVol[structName[i]] = 0;
-	for (int i = 0; i < phant->media.size(); i++)
-		medVol[phant->media[i]] = 0;
-	
 	#if defined(DEBUG_BUILDEGSPHANT)
 		std::cout << "  Assigning x and y bounds\n"; std::cout.flush();
 	#endif
-	
+    
     for (int i = 0; i <= phant->nx; i++)
 		phant->x[i] = (imagePos[0][0]+(i-0.5)*xySpacing[0][0])/10.0;
     for (int i = 0; i <= phant->ny; i++)
 		phant->y[i] = (imagePos[0][1]+(i-0.5)*xySpacing[0][1])/10.0;
-
+	
 	// Define z bound values
 	
 	#if defined(DEBUG_BUILDEGSPHANT)
@@ -626,334 +950,360 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 		phant->z[i] = prevZ/10.0;
 	}
 	phant->z.last() = nextZ/10.0;
-		
-	// Setup media array
-	{
-		QVector <char> mz(phant->nz, 0);
-		QVector <QVector <char> > my(phant->ny, mz);
-		QVector <QVector <QVector <char> > > mx(phant->nx, my);
-		phant->m = mx;
-	}
 	
-	// Setup masks before allocating density array to save space
+	return 0;
+}
+
+int Data::parseCTSlice(egsphantBuild* build, int k, QVector <QVector <short int> >* slice) {
+	// Copy the slice from the loaded CT sidecar if there is one
+	if (CT_cache) {
+		*slice = CT_cache->HU[k];
+		return 0;
+	}
 	
-	#if defined(DEBUG_BUILDEGSPHANT)
-		std::cout << "Making masks\n"; std::cout.flush();
-	#endif
+	double rescaleM = 1, rescaleB = 0, rescaleFlag = 0;
+	Attribute* tempAtt;
 	
-	for (int i = 0; i < contourNum; i++) {
-		EGSPhant* temp = new EGSPhant;
-		temp->makeMask(phant);
-		makeMasks->append(temp);
-	}
+	// Rescale HU slope (assuming type is HU)
+	tempAtt = CT_data[k]->getEntry(0x0028,0x1053);
+	if (tempAtt->tag[0] == 0x0028 && tempAtt->tag[1] == 0x1053) {
+		QString temp = "";
+		for (unsigned int s = 0; s < tempAtt->vl; s++) {
+			temp.append(tempAtt->vf[s]);
+		}
 		
-	// Setup density array
-	{
-		QVector <double> dz(phant->nz, 0);
-		QVector <QVector <double> > dy(phant->ny, dz);
-		QVector <QVector <QVector <double> > > dx(phant->nx, dy);
-		phant->d = dx;
+		rescaleM = temp.toDouble();
+		rescaleFlag++;
 	}
-		
-	// Get bounding rectangles over each struct
-	
-	#if defined(DEBUG_BUILDEGSPHANT)
-		std::cout << "Constructing bounds around the structs\n"; std::cout.flush();
-	#endif
-	
-	//*log = *log + "Struct boundaries\n";
-	
-	QVector <QVector <QRectF> > structRect;
+	//else
+	//	return 206;
+	// If not found, just don't rescale HU
 	
-	for (int i = 0; i < structPos.size(); i++) {
-		structRect.resize(i+1);
-		
-		#if defined(DEBUG_BUILDEGSPHANT)
-			std::cout << "  Struct: " + structName[i].toStdString() + "\n"; std::cout.flush();
-		#endif
-		
-		//*log = *log + "  Struct: " + structName[i] + "\n";
+	// Rescale HU intercept (assuming type is HU)
+	tempAtt = CT_data[k]->getEntry(0x0028,0x1052);
+	if (tempAtt->tag[0] == 0x0028 && tempAtt->tag[1] == 0x1052) {
+		QString temp = "";
+		for (unsigned int s = 0; s < tempAtt->vl; s++) {
+			temp.append(tempAtt->vf[s]);
+		}
 		
-		for (int j = 0; j < structPos[i].size(); j++) {
-			structRect[i].resize(j+1);
-			structRect[i][j] = structPos[i][j].boundingRect();
-			
-			#if defined(DEBUG_BUILDEGSPHANT)
-				std::cout << "    z = " << structZ[i][j] << " : (";
-				std::cout << structRect[i][j].top() << ",";
-				std::cout << structRect[i][j].left() << "),(";
-				std::cout << structRect[i][j].bottom() << ",";
-				std::cout << structRect[i][j].right() << ")\n"; std::cout.flush();
-			#endif
+		rescaleB = temp.toDouble();
+		rescaleFlag++;
+	}
+	//else
+	//	return 207;
+	// If not found, just don't rescale HU
+	
+	// HU values
+	tempAtt = CT_data[k]->getEntry(0x7FE0,0x0010);
+	if (tempAtt->tag[0] == 0x7FE0 && tempAtt->tag[1] == 0x0010) {
+		unsigned short int xPix = build->xPix[k], yPix = build->yPix[k];
+		slice->resize(yPix);
+		for (unsigned int j = 0; j < yPix; j++) {
+			(*slice)[j].resize(xPix);
 		}
+		
+		short int temp;
+		if (CT_data[k]->isBigEndian)
+			for (unsigned int s = 0; s < tempAtt->vl; s+=2) {
+				temp  = (tempAtt->vf[s+1]);
+				temp += (short int)(tempAtt->vf[s]) << 8;
+				
+				(*slice)[int(int(s/2)/xPix)][int(s/2)%xPix] =
+					rescaleFlag == 2 ? rescaleM*temp+rescaleB : temp;
+			}
+		else
+			for (unsigned int s = 0; s < tempAtt->vl; s+=2) {
+				temp  = (tempAtt->vf[s]);
+				temp += (short int)(tempAtt->vf[s+1]) << 8;
+				
+				(*slice)[int(int(s/2)/xPix)][int(s/2)%xPix] =
+					rescaleFlag == 2 ? rescaleM*temp+rescaleB : temp;
+			}
 	}
+	else
+		return 208;
 	
-	// Arrays that hold the struct numbers and center voxel values to be used
+	return 0;
+}
+
+int Data::buildSlab(egsphantBuild* build, EGSPhant* slab, QVector <EGSPhant*>* makeMasks, int k0) {
+	int contourNum = build->contourNum;
+	QVector <int>* structIndex = build->structIndex;
+	QVector <QVector <QRectF> > &structRect = build->structRect;
 	
 	#if defined(DEBUG_BUILDEGSPHANT)
-		std::cout << "Assigning density and media using HU\n"; std::cout.flush();
+		std::cout << "Assigning density and media using HU to slices " << k0 << " to " << k0+slab->nz-1 << "\n"; std::cout.flush();
 	#endif
 	
-	QList<QPoint> zIndex, yIndex;
-	QList<QPoint>::iterator p;
-	double zMid, yMid, xMid, temp;
-	int tempHU = 0, n = 0, q = 0, inStruct = 0, nj = 0;
+	int err = 0;
 	
-	// Convert HU to density and media
-    increment = 15.0/double(phant->nz); // 45% is making the egsphant (15 for density, 30 for media)
+	// Decode the HU of every slice in the slab
+    double increment = 15.0/double(build->nz); // 45% is making the egsphant (15 for decoding, 30 for the rest)
 	emit newProgressName("Building density arrays");
 	
-	for (int k = 0; k < phant->nz; k++) { // Z //
+	QVector <QVector <QVector <short int> > > HU(slab->nz);
+	for (int k = 0; k < slab->nz; k++) { // Z //
 		emit madeProgress(increment);
-		zMid = (phant->z[k]+phant->z[k+1])/2.0;
-		
-		for (int j = 0; j < phant->ny; j++) { // Y //
-			yMid = (phant->y[j]+phant->y[j+1])/2.0;
-			
-			for (int i = 0; i < phant->nx; i++) { // X //
-				xMid = (phant->x[i]+phant->x[i+1])/2.0;
-				
-				tempHU = HU[k][j][i];
-				
-				// Linear search because I don't think these arrays every get big
-				// get the right density
-				for (n = 0; n < HUMap.size()-1; n++)
-					if (HUMap[n] <= tempHU && tempHU < HUMap[n+1])
-						break;
-				if (tempHU < HUMap[0])
-					n = 0;
-				
-				temp = interp(tempHU,HUMap[n],HUMap[n+1],denMap[n],denMap[n+1]);
-				temp = temp<=0?0.000001:temp; // Set min density to 0.000001
-				
-				if (temp > phant->maxDensity) // Track max density for images
-					phant->maxDensity = temp;
-				
-				// Assign density
-				phant->d[i][j][k] = temp;
-			}
-		}
-	}
-	
-	// Perform metallic artifact reduction
-	emit newProgressName("Metallic artifact reduction");
-		
-	*log = *log + "--- Metallic artifact reduction ---\n";
-	if (do_MAR) {
-		*log = *log + "MAR is requested\n";
-		*log = *log + QString("  Set all densities outside of range [%1,%2] to %3\n").arg(lowerThresh).arg(upperThresh).arg(marDen);
-		*log = *log + QString("  within %1 cm of the source\n").arg(marRad);		
-		if (marContourInd != -1) {
-			*log = *log + "  only in contour " + marContour + "\n";			
-		}
-		*log = *log + "\n";	
+		err = parseCTSlice(build, k0+k, &HU[k]);
+		if (err)
+			return err;
 	}
-	else
-		*log = *log + "no MAR is requested\n";	
 	
-	if (do_MAR) {
-		// Input reading code
-		QFile file (gui_location+"/database/transformation/"+transformFile);
-		QString line;
-		
-		// Variables that will hold dimensions and fetched density
-		double xP, yP, zP, dens;
-		int minX, minY, minZ, maxX, maxY, maxZ;
-		bool inStruct;
-		
-		// A set (hash table) that we will append all unique values to
-		QSet <int> voxels;
-		
-		if (file.open(QIODevice::ReadOnly)) {
-			QTextStream in (&file);
-			while(!in.atEnd()) {
-				
-				// Get the transformation lines from the text
-				line = in.readLine();
-				if (line.contains("translation =")) {
-					line = line.split("=")[1].trimmed();
-					xP = line.split(" ")[0].trimmed().toDouble();
-					yP = line.split(" ")[1].trimmed().toDouble();
-					zP = line.split(" ")[2].trimmed().toDouble();
-					
-					inStruct = false;
-					if (contourNum > 0 && marContourInd != -1) {
-						for (int m = 0; m < structZ[structIndex->at(marContourInd)].size(); m++) {
-							// If slice j of struct i on the same plane as slice k of the phantom
-							if (abs(structZ[structIndex->at(marContourInd)][m] - zP) < 0.1) { // 1 mm threshold
-								if (structPos[structIndex->at(marContourInd)][m].containsPoint(QPointF(xP,yP), Qt::OddEvenFill))
-									inStruct = true;
-							}
-						}
-					}
-					else
-						inStruct = true;
-					
-					if (inStruct) {
-						// Get the indices
-						minX = phant->getIndex("x axis",xP-marRad);
-						minY = phant->getIndex("y axis",yP-marRad);
-						minZ = phant->getIndex("z axis",zP-marRad);
-						maxX = phant->getIndex("x axis",xP+marRad)+1;
-						maxY = phant->getIndex("y axis",yP+marRad)+1;
-						maxZ = phant->getIndex("z axis",zP+marRad)+1;
-						if (minX < 0 || minY < 0 || minZ < 0 || maxX < 0 || maxY < 0 || maxZ < 0) {
-							*log = *log + QString("source position/radius out of bounds error for source [%1,%2,%3], skipping it\n").arg(xP).arg(yP).arg(zP);
-							inStruct = false;
-						}
-						
-						// Add all the voxels within marRad to the voxels set
-						if (inStruct) {
-							for (int k = minZ; k < maxZ; k++) {
-								for (int j = minY; j < maxY; j++) {
-									for (int i = minX; i < maxX; i++) {
-										voxels.insert(i+(j*phant->nx)+(k*phant->nx*phant->ny));
-									}
-								}
-							}
-						}
-						*log = *log + QString("    MAR performed at source position [%1,%2,%3]\n").arg(xP).arg(yP).arg(zP);
-					}
-				}
-			}
+	// Append the decoded slices to the CT sidecar
+	if (build->sidecar)
+		for (int k = 0; k < slab->nz; k++)
+			for (int j = 0; j < slab->ny; j++)
+				build->sidecar->write((const char*)HU[k][j].constData(), slab->nx*sizeof(short int));
+	
+	// Flag the voxels to perform metallic artifact reduction on
+	int nxy = slab->nx*slab->ny;
+	QBitArray voxels;
+	
+	if (do_MAR && build->marOpened) {
+		// Variables that will hold source positions and the sphere extents
+		double xP, yP, zP, dy, dz, rowRad;
+		int minX, minY, maxX, maxY;
+		
+		// A bitmap over the slab (indexed i+j*nx+k*nx*ny) in which we flag
+		// every voxel within marRad of a source, overlapping sources share voxels
+		voxels.resize(nxy*slab->nz);
+		
+		for (int s = 0; s < build->marSources.size(); s++) {
+			xP = build->marSources[s][0];
+			yP = build->marSources[s][1];
+			zP = build->marSources[s][2];
 			
-			// Now do threshold replacement to all voxels in voxels set
-			QSet<int>::iterator it = voxels.begin();
-			int count = 0;
-			increment = 2.5/voxels.size(); // 2.5%
-			int i, j, k;
+			// Get the y indices of the cube bounding the sphere, sources were
+			// already checked to be within the phantom
+			minY = slab->getIndex(Y_AXIS,yP-marRad);
+			maxY = slab->getIndex(Y_AXIS,yP+marRad);
 			
-			while (it != voxels.end()) {
-				i = *it;
-				k = int(i/phant->nx/phant->ny);
-				j = int(i/phant->nx)%phant->ny;
-				i = i%phant->nx;
-				
-				dens = phant->getDensity(i,j,k);
-				emit madeProgress(increment);
-				if (dens < lowerThresh || dens > upperThresh) {
-					phant->setDensity(i,j,k,marDen);
-					count++;
+			// Flag all the voxels whose centres are within marRad of the source,
+			// the x extent of the sphere is solved once per (y,z) row
+			for (int k = 0; k < slab->nz; k++) {
+				dz = (slab->z[k]+slab->z[k+1])/2.0-zP;
+				if (dz*dz > marRad*marRad) // This slice misses the sphere
+					continue;
+				for (int j = minY; j <= maxY; j++) {
+					dy = (slab->y[j]+slab->y[j+1])/2.0-yP;
+					rowRad = marRad*marRad-dy*dy-dz*dz;
+					if (rowRad < 0) // This row misses the sphere
+						continue;
+					rowRad = sqrt(rowRad);
+					
+					// Start and end on the voxels containing the span ends, then drop
+					// them if their centres fall outside of the sphere
+					minX = slab->getIndex(X_AXIS,xP-rowRad);
+					maxX = slab->getIndex(X_AXIS,xP+rowRad);
+					if ((slab->x[minX]+slab->x[minX+1])/2.0 < xP-rowRad)
+						minX++;
+					if ((slab->x[maxX]+slab->x[maxX+1])/2.0 > xP+rowRad)
+						maxX--;
+					
+					for (int i = minX; i <= maxX; i++)
+						voxels.setBit(i+j*slab->nx+k*nxy);
 				}
-				it++;
 			}
-			*log = *log + "\nMAR applied to " + QString::number(count) + " of the " + QString::number(voxels.size()) + " evaluated voxels\n";	
 		}
-		else {
-			*log = *log + "failed to open transport file, MAR aborted\n";
-			increment = 5.0; // 5%
-			emit madeProgress(increment);
-		}
-	}
-	else {
-		increment = 5.0; // 5%
-		emit madeProgress(increment);
-	}
-	
-	*log = *log + "-----------------------------------\n";
 		
-	// Convert density to media
-	*log = *log + "--- Assigning the egsphant media ---\n";
-	emit newProgressName("Building media arrays");
-	increment = 30.0/double(phant->nz); // 30%
-	
-	*log = *log + "Added slices z heights:\n\n";
-	
-	for (int k = 0; k < phant->nz; k++) { // Z //
-		emit madeProgress(increment);
-		zMid = (phant->z[k]+phant->z[k+1])/2.0;
-			
-		// Preprocess step to check which structs to look up on this slices\n
+		build->marEvaluated += voxels.count(true);
+	}
+	bool doMAR = !voxels.isEmpty();
+	
+	// Preprocess step to check which structs to look up on each slice and pixel row,
+	// yIndex[k][j] is going to have all indices of structPos that we need to look up
+	QVector <double> zMid(slab->nz), yMid(slab->ny), xMid(slab->nx);
+	for (int k = 0; k < slab->nz; k++)
+		zMid[k] = (slab->z[k]+slab->z[k+1])/2.0;
+	for (int j = 0; j < slab->ny; j++)
+		yMid[j] = (slab->y[j]+slab->y[j+1])/2.0;
+	for (int i = 0; i < slab->nx; i++)
+		xMid[i] = (slab->x[i]+slab->x[i+1])/2.0;
+	
+	QVector <QVector <QList <QPoint> > > yIndex(slab->nz, QVector <QList <QPoint> > (slab->ny));
+	QList <QPoint> zIndex;
+	QList <QPoint>::iterator p;
+	
+	for (int k = 0; k < slab->nz && contourNum > 0; k++) { // Z //
 		// zIndex is going to have all indices of structRect that we will need to look up
-		if (contourNum > 0) {
-			zIndex.clear(); // Reset lookup
-			for (int l = 0; l < contourNum; l++) {
-					for (int m = 0; m < structZ[structIndex->at(l)].size(); m++) {
-						// If slice j of struct i on the same plane as slice k of the phantom
-						if (abs(structZ[structIndex->at(l)][m] - zMid) < (phant->z[k+1]-phant->z[k])/2.0) { // && tasIndex->at(l) != -1) { // Don't filter non-default to be able to tally
-							zIndex << QPoint(structIndex->at(l),m); // Add it to lookup
-						}
-					}
+		zIndex.clear(); // Reset lookup
+		for (int l = 0; l < contourNum; l++) {
+			for (int m = 0; m < structZ[structIndex->at(l)].size(); m++) {
+				// If slice j of struct i on the same plane as slice k of the phantom
+				if (abs(structZ[structIndex->at(l)][m] - zMid[k]) < (slab->z[k+1]-slab->z[k])/2.0) { // Don't filter non-default to be able to tally
+					zIndex << QPoint(structIndex->at(l),m); // Add it to lookup
 				}
+			}
 		}
 		
 		#if defined(DEBUG_BUILDEGSPHANT)
-			std::cout << "  In slice " << k << " checking against " << zIndex.size() << " structs:\n"; std::cout.flush();
+			std::cout << "  In slice " << k0+k << " checking against " << zIndex.size() << " structs:\n"; std::cout.flush();
 			for (int n = 0; n < zIndex.size(); n++) {
 				std::cout << "    structName[" << zIndex[n].x() << "]=" << structName[zIndex[n].x()].toStdString() << "\n"; std::cout.flush();
 			}
 		#endif
 		
-		for (int j = 0; j < phant->ny; j++) { // Y //
-			yMid = (phant->y[j]+phant->y[j+1])/2.0;
-			nj = phant->ny-1-j;
-		
-			// Preprocess step to check which structs to look up on this pixel column\n
-			// yIndex is going to have all indices of structPos that we need to look up
-			if (zIndex.size() > 0) {
-				yIndex.clear(); // Reset lookup
+		if (zIndex.size() > 0)
+			for (int j = 0; j < slab->ny; j++) { // Y //
 				for (p = zIndex.begin(); p != zIndex.end(); p++) {
 					// If column p->y() of struct p->x() is on the same column as slice k,j of the phantom
-					if (structRect[p->x()][p->y()].top() <= yMid && yMid <= structRect[p->x()][p->y()].bottom()) {
-						yIndex << *p;
+					if (structRect[p->x()][p->y()].top() <= yMid[j] && yMid[j] <= structRect[p->x()][p->y()].bottom()) {
+						yIndex[k][j] << *p;
 					}
 				}
 			}
+	}
+	
+	// Convert HU to density, apply MAR and assign media in a single pass over
+	// the slab, each x column of the egsphant is handed to the thread pool as
+	// its own task and keeps its own tallies
+	emit newProgressName("Building media arrays");
+	
+	int mediaNum = slab->media.size(), structNum = structName.size();
+	QVector <int> columns(slab->nx);
+	QVector <QVector <int> > columnMed(slab->nx), columnStruct(slab->nx);
+	QVector <int> columnMAR(slab->nx, 0);
+	QVector <double> columnMax(slab->nx, 0);
+	for (int i = 0; i < slab->nx; i++)
+		columns[i] = i;
+	
+	// Everything shared between the tasks is only read through const references
+	const egsphantBuild* cBuild = build;
+	const QVector <QVector <QVector <short int> > > &cHU = HU;
+	const QVector <QVector <QList <QPoint> > > &cIndex = yIndex;
+	const QVector <QVector <QRectF> > &cRect = structRect;
+	const QVector <QVector <QPolygonF> > &cPos = structPos;
+	const QVector <double> &cxMid = xMid, &cyMid = yMid;
+	const QVector <EGSPhant*> &cMasks = *makeMasks;
+	
+	QtConcurrent::blockingMap(columns, [&](int &i) {
+		QVector <QVector <char> > &mColumn = slab->m[i];
+		QVector <QVector <double> > &dColumn = slab->d[i];
+		QVector <int> medCount(mediaNum, 0), structCount(structNum, 0);
+		const double* HUDensity = cBuild->HUDensity.constData() + 32768;
+		int inStruct, q, n, nj, replaced = 0;
+		double temp, maxDensity = 0;
+		QList <QPoint>::const_iterator p;
+		
+		for (int j = 0; j < slab->ny; j++) { // Y //
+			QVector <char> &mRow = mColumn[j];
+			QVector <double> &dRow = dColumn[j];
+			nj = slab->ny-1-j;
 			
-			#if defined(DEBUG_BUILDEGSPHANT)
-				std::cout << "    In y column " << j << " checking against " << yIndex.size() << " structs:\n"; std::cout.flush();
-				for (int n = 0; n < yIndex.size(); n++) {
-					std::cout << "      structName[" << yIndex[n].x() << "]=" << structName[yIndex[n].x()].toStdString() << "\n"; std::cout.flush();
+			for (int k = 0; k < slab->nz; k++) { // Z //
+				// Look up the density of this HU
+				temp = HUDensity[cHU[k][j][i]];
+				
+				// Perform metallic artifact reduction
+				if (doMAR && voxels.testBit(i+j*slab->nx+k*nxy) && (temp < lowerThresh || temp > upperThresh)) {
+					temp = marDen;
+					replaced++;
 				}
-			#endif
-			
-			for (int i = 0; i < phant->nx; i++) { // X //
-				xMid = (phant->x[i]+phant->x[i+1])/2.0;
 				
-				temp = phant->d[i][j][k];
+				if (temp > maxDensity) // Track max density for images
+					maxDensity = temp;
+				
+				// Assign density
+				dRow[k] = temp;
 				
 				// Check if we are in a structure
 				inStruct = -1;
-				if (yIndex.size() > 0) {
-					for (p = yIndex.begin(); p != yIndex.end(); p++) { // Check through each
+				const QList <QPoint> &structs = cIndex[k][j];
+				for (p = structs.constBegin(); p != structs.constEnd(); p++) { // Check through each
 					// If row p->y() of struct p->x() on the same row as slice k,j,i of the phantom
-						if (structRect[p->x()][p->y()].left() <= xMid && xMid <= structRect[p->x()][p->y()].right())
-							if (structPos[p->x()][p->y()].containsPoint(QPointF(xMid,yMid), Qt::OddEvenFill)) {
-								inStruct = p->x();
-								break; // Assign first struct found and quit, assumed highest priority
-							}
-					}
+					if (cRect[p->x()][p->y()].left() <= cxMid[i] && cxMid[i] <= cRect[p->x()][p->y()].right())
+						if (cPos[p->x()][p->y()].containsPoint(QPointF(cxMid[i],cyMid[j]), Qt::OddEvenFill)) {
+							inStruct = p->x();
+							break; // Assign first struct found and quit, assumed highest priority
+						}
 				}
 				
-				q = defaultTAS; // Default tissue assignment scheme
-					
+				q = cBuild->defaultTAS; // Default tissue assignment scheme
+				
 				if (inStruct > -1) { // Change TAS if we are in structure
 					// Count structure volume
-					structVol[structName[inStruct]]++;
+					structCount[inStruct]++;
 					
 					// Setup mask
-					(*makeMasks)[inStruct]->m[i][nj][k] = 50;
+					cMasks[inStruct]->m[i][nj][k] = 50;
 					
 					// Check to see if a TAS is assigned
-					if (structToTas.contains(inStruct)) 
-						q = structToTas[inStruct];
-				}		
-
-				// Find the right media in the right TAS
-				for (n = 0; n < threshold[q].size()-1; n++)
-					if (temp < threshold[q][n])
-						break;
+					if (cBuild->structToTas.contains(inStruct))
+						q = cBuild->structToTas.value(inStruct);
+				}
 				
-				// Assign that media
-				phant->m[i][j][k] = mediaIndex[media[q][n]].toLatin1();
+				// Find the right media in the right TAS and assign it
+				n = tasLookup(cBuild, q, temp);
+				mRow[k] = cBuild->tasChar[q][n];
 				
 				// Count media volume
-				medVol[media[q][n]]++;
+				medCount[cBuild->tasMedium[q][n]]++;
 			}
 		}
-		*log = *log + QString::number(zMid) + " ";
+		
+		columnMed[i] = medCount;
+		columnStruct[i] = structCount;
+		columnMAR[i] = replaced;
+		columnMax[i] = maxDensity;
+	});
+	
+	// Merge the column tallies
+	for (int i = 0; i < slab->nx; i++) {
+		for (int n = 0; n < mediaNum; n++)
+			build->medVol[slab->media[n]] += columnMed[i][n];
+		for (int n = 0; n < structNum; n++)
+			build->structVol[structName[n]] += columnStruct[i][n];
+		build->marCount += columnMAR[i];
+		if (columnMax[i] > slab->maxDensity)
+			slab->maxDensity = columnMax[i];
 	}
 	
+	for (int k = 0; k < slab->nz; k++)
+		build->zHeights = build->zHeights + QString::number(zMid[k]) + " ";
+	
+	increment = 35.0*double(slab->nz)/double(build->nz); // 35%
+	emit madeProgress(increment);
+	
+	return 0;
+}
+
+// Get the index into TAS q of the media for density, the first threshold
+// above density (or the last media), which is the original linear scan
+int Data::tasLookup(const egsphantBuild* build, int q, double density) {
+	const QVector <double> &t = build->tasThreshold[q];
+	int len = t.size();
+	
+	if (!build->tasSorted[q]) {
+		int n;
+		for (n = 0; n < len; n++)
+			if (density < t[n])
+				break;
+		return n;
+	}
+	
+	// Branchless binary search (upper bound)
+	const double* base = t.constData();
+	int half;
+	while (len > 1) {
+		half = len/2;
+		base += (base[half-1] <= density) ? half : 0;
+		len -= half;
+	}
+	return (base-t.constData()) + (len == 1 && *base <= density);
+}
+
+void Data::buildLog(egsphantBuild* build, QString* log) {
+	// Close off the MAR section started in buildSetup
+	if (do_MAR && build->marOpened)
+		*log = *log + "\nMAR applied to " + QString::number(build->marCount) + " of the " + QString::number(build->marEvaluated) + " evaluated voxels\n";
+	
+	*log = *log + "-----------------------------------\n";
+	
+	*log = *log + "--- Assigning the egsphant media ---\n";
+	*log = *log + "Added slices z heights:\n\n";
+	*log = *log + build->zHeights;
+	
 	// Reverse y-axis - keep image "flipped" and just change the preview images to match to invert y
 	//emit newProgressName("Inverting y-axis");
 	//increment = 2.5/phant->nz; // 2.5%
@@ -972,7 +1322,7 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 	//		}
 	//	}
 	//	emit madeProgress(increment);
-	//}	
+	//}
 	
 	*log = *log + "\n\nEGSPhant building is complete\n";
 	
@@ -984,22 +1334,315 @@ int Data::buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defau
 	*log = *log + "--- Outputting voxel counts ---\n";
 	
 	*log = *log + "Media voxel count:\n";
-	for (int i = 0; i < medVol.size(); i++)
-		*log = *log + "  " + medVol.keys()[i].left(20).rightJustified(20,' ') + " " + QString::number(medVol.values()[i]).rightJustified(12,' ') + "\n";
+	for (int i = 0; i < build->medVol.size(); i++)
+		*log = *log + "  " + build->medVol.keys()[i].left(20).rightJustified(20,' ') + " " + QString::number(build->medVol.values()[i]).rightJustified(12,' ') + "\n";
 	
 	*log = *log + "Structure voxel count:\n";
-	for (int i = 0; i < structVol.size(); i++)
-		*log = *log + "  " + structVol.keys()[i].left(20).rightJustified(20,' ') + " " + QString::number(structVol.values()[i]).rightJustified(12,' ') + "\n";
+	for (int i = 0; i < build->structVol.size(); i++)
+		*log = *log + "  " + build->structVol.keys()[i].left(20).rightJustified(20,' ') + " " + QString::number(build->structVol.values()[i]).rightJustified(12,' ') + "\n";
 	
 	*log = *log + "-------------------------------\n";
-			
+	
 	#if defined(DEBUG_BUILDEGSPHANT)
 		std::cout << "Log complete\n"; std::cout.flush();
 	#endif
+}
+
+// Crop the phantom and its masks down to the voxels overlapping box,
+// which is [xmin,xmax,ymin,ymax,zmin,zmax] in cm
+int Data::cropEgsphant(EGSPhant* phant, QVector <EGSPhant*>* masks, QVector <double> box, QString* log) {
+	if (box.size() != 6 || box[0] >= box[1] || box[2] >= box[3] || box[4] >= box[5])
+		return 401;
+	if (box[0] >= phant->x.last() || box[1] <= phant->x[0] ||
+		box[2] >= phant->y.last() || box[3] <= phant->y[0] ||
+		box[4] >= phant->z.last() || box[5] <= phant->z[0])
+		return 401;
+	
+	emit newProgressName("Cropping egsphant");
+	
+	// Get the voxels holding each end of the box, clamped to the phantom
+	int i0 = box[0] <= phant->x[0] ? 0 : phant->getIndex(X_AXIS, box[0]);
+	int j0 = box[2] <= phant->y[0] ? 0 : phant->getIndex(Y_AXIS, box[2]);
+	int k0 = box[4] <= phant->z[0] ? 0 : phant->getIndex(Z_AXIS, box[4]);
+	int i1 = box[1] >= phant->x.last() ? phant->nx-1 : phant->getIndex(X_AXIS, box[1]);
+	int j1 = box[3] >= phant->y.last() ? phant->ny-1 : phant->getIndex(Y_AXIS, box[3]);
+	int k1 = box[5] >= phant->z.last() ? phant->nz-1 : phant->getIndex(Z_AXIS, box[5]);
+	
+	*log = *log + "--- Cropping the egsphant ---\n";
+	*log = *log + QString("Requested box [%1,%2]x[%3,%4]x[%5,%6] cm\n").arg(box[0]).arg(box[1]).arg(box[2]).arg(box[3]).arg(box[4]).arg(box[5]);
+	*log = *log + QString("Cropped from %1x%2x%3 ").arg(phant->nx).arg(phant->ny).arg(phant->nz);
+	
+	// Masks are stored with their y axis inverted, but share the phantom boundaries
+	for (int i = 0; i < masks->size(); i++)
+		(*masks)[i]->crop(i0, i1, phant->ny-1-j1, phant->ny-1-j0, k0, k1);
+	phant->crop(i0, i1, j0, j1, k0, k1);
+	for (int i = 0; i < masks->size(); i++)
+		(*masks)[i]->y = phant->y;
+	
+	*log = *log + QString("to %1x%2x%3 voxels\n").arg(phant->nx).arg(phant->ny).arg(phant->nz);
+	*log = *log + "-----------------------------\n";
+	
+	return 0;
+}
+
+// Resample the phantom and its masks to dx by dy by dz cm voxels
+int Data::resampleEgsphant(EGSPhant* phant, QVector <EGSPhant*>* masks, double dx, double dy, double dz, QString* log) {
+	if (dx <= 0 || dy <= 0 || dz <= 0)
+		return 403;
+	
+	emit newProgressName("Resampling egsphant");
+	
+	*log = *log + "--- Resampling the egsphant ---\n";
+	*log = *log + QString("Requested voxel size %1x%2x%3 cm\n").arg(dx).arg(dy).arg(dz);
+	*log = *log + QString("Resampled from %1x%2x%3 ").arg(phant->nx).arg(phant->ny).arg(phant->nz);
+	
+	phant->resample(dx, dy, dz);
+	for (int i = 0; i < masks->size(); i++)
+		(*masks)[i]->resample(dx, dy, dz);
+	
+	*log = *log + QString("to %1x%2x%3 voxels of size %4x%5x%6 cm\n").arg(phant->nx).arg(phant->ny).arg(phant->nz)
+				  .arg(phant->x[1]-phant->x[0]).arg(phant->y[1]-phant->y[0]).arg(phant->z[1]-phant->z[0]);
+	*log = *log + "Densities are volume-weighted averages, media and masks are majority votes\n";
+	*log = *log + "-------------------------------\n";
+	
+	return 0;
+}
+
+// Sort every contour slice into structPlanes, slices of different structs that
+// lie within STRUCT_PLANE_TOL of each other share a plane
+void Data::indexStructs() {
+	QMap <double, QVector <QPoint> > planes;
+	for (int i = 0; i < structZ.size(); i++)
+		for (int j = 0; j < structZ[i].size(); j++)
+			planes[structZ[i][j]] << QPoint(i,j);
+	
+	structPlanes.clear();
+	structPlaneContours.clear();
+	for (QMap <double, QVector <QPoint> >::const_iterator p = planes.constBegin(); p != planes.constEnd(); p++) {
+		if (!structPlanes.isEmpty() && p.key()-structPlanes.last() < STRUCT_PLANE_TOL) {
+			structPlaneContours.last() << p.value();
+			continue;
+		}
+		structPlanes << p.key();
+		structPlaneContours << p.value();
+	}
+	
+	structSpacing = 0;
+	for (int k = 1; k < structPlanes.size(); k++)
+		if (structSpacing == 0 || structPlanes[k]-structPlanes[k-1] < structSpacing)
+			structSpacing = structPlanes[k]-structPlanes[k-1];
+	
+	structRevision++;
+}
+
+// Get the contours on the plane nearest z, or 0 if no plane is within tol of z
+const QVector <QPoint>* Data::structsAt(double z, double tol) {
+	if (structPlanes.isEmpty())
+		return 0;
+	
+	// First plane at or above z, then step down if the one below is nearer
+	int k = std::lower_bound(structPlanes.constBegin(), structPlanes.constEnd(), z)-structPlanes.constBegin();
+	if (k == structPlanes.size() || (k > 0 && z-structPlanes[k-1] < structPlanes[k]-z))
+		k--;
+	
+	if (fabs(structPlanes[k]-z) > tol)
+		return 0;
+	return &structPlaneContours[k];
+}
+
+// Get the box bounding all slices of struct i
+QVector <double> Data::contourBox(int i) {
+	QVector <double> box;
+	if (i < 0 || i >= structPos.size() || structPos[i].isEmpty())
+		return box;
+	
+	QRectF rect = structPos[i][0].boundingRect();
+	double zMin = structZ[i][0], zMax = structZ[i][0];
+	for (int j = 1; j < structPos[i].size(); j++) {
+		rect = rect.united(structPos[i][j].boundingRect());
+		zMin = qMin(zMin, structZ[i][j]);
+		zMax = qMax(zMax, structZ[i][j]);
+	}
+	
+	box << rect.left() << rect.right() << rect.top() << rect.bottom() << zMin << zMax;
+	return box;
+}
+
+// Get the box bounding all seeds, padded by margin cm
+QVector <double> Data::seedBox(double margin) {
+	QVector <double> box;
+	if (seedPos.isEmpty())
+		return box;
+	
+	double xMin = seedPos[0].x(), xMax = seedPos[0].x();
+	double yMin = seedPos[0].y(), yMax = seedPos[0].y();
+	double zMin = seedPos[0].z(), zMax = seedPos[0].z();
+	for (int i = 1; i < seedPos.size(); i++) {
+		xMin = qMin(xMin, double(seedPos[i].x()));
+		xMax = qMax(xMax, double(seedPos[i].x()));
+		yMin = qMin(yMin, double(seedPos[i].y()));
+		yMax = qMax(yMax, double(seedPos[i].y()));
+		zMin = qMin(zMin, double(seedPos[i].z()));
+		zMax = qMax(zMax, double(seedPos[i].z()));
+	}
+	
+	box << xMin-margin << xMax+margin << yMin-margin << yMax+margin << zMin-margin << zMax+margin;
+	return box;
+}
+
+// Write the header of a CT sidecar, which is a gz compressed binary file holding
+// the egsphant geometry, the structs and then the HU values of every slice, so that
+// later builds can skip all DICOM parsing
+void Data::startSidecar(egsphantBuild* build, EGSPhant* phant, QString* log) {
+	build->sidecar = new ogzstream(sidecarPath.toStdString().c_str());
+	std::ostream* out = (std::ostream*)(build->sidecar);
+	
+	if (!out->good()) {
+		*log = *log + "Could not open CT sidecar " + sidecarPath + ", it will not be saved\n";
+		delete build->sidecar;
+		build->sidecar = 0;
+		return;
+	}
+	*log = *log + "Saving the decoded CT data and structs to CT sidecar " + sidecarPath + "\n";
+	
+	qint32 n;
+	double p;
+	out->write(CT_SIDECAR_MAGIC, 8);
+	
+	// Dimensions and boundaries
+	n = phant->nx; out->write((const char*)&n, sizeof(n));
+	n = phant->ny; out->write((const char*)&n, sizeof(n));
+	n = phant->nz; out->write((const char*)&n, sizeof(n));
+	out->write((const char*)phant->x.constData(), phant->x.size()*sizeof(double));
+	out->write((const char*)phant->y.constData(), phant->y.size()*sizeof(double));
+	out->write((const char*)phant->z.constData(), phant->z.size()*sizeof(double));
+	
+	// Structs, each as its name, then the z and points of each of its slices
+	n = structName.size(); out->write((const char*)&n, sizeof(n));
+	for (int i = 0; i < structName.size(); i++) {
+		QByteArray name = structName[i].toUtf8();
+		n = name.size(); out->write((const char*)&n, sizeof(n));
+		out->write(name.constData(), name.size());
+		
+		n = structZ[i].size(); out->write((const char*)&n, sizeof(n));
+		for (int j = 0; j < structZ[i].size(); j++) {
+			p = structZ[i][j]; out->write((const char*)&p, sizeof(p));
+			n = structPos[i][j].size(); out->write((const char*)&n, sizeof(n));
+			for (int m = 0; m < structPos[i][j].size(); m++) {
+				p = structPos[i][j][m].x(); out->write((const char*)&p, sizeof(p));
+				p = structPos[i][j][m].y(); out->write((const char*)&p, sizeof(p));
+			}
+		}
+	}
+}
+
+// Close the CT sidecar, removing it if the build failed
+void Data::finishSidecar(egsphantBuild* build, bool keep) {
+	if (!build->sidecar)
+		return;
+	
+	build->sidecar->close();
+	delete build->sidecar;
+	build->sidecar = 0;
+	
+	if (!keep)
+		QFile::remove(sidecarPath);
+}
+
+// Read a CT sidecar into CT_cache and replace the structs with its own
+int Data::loadSidecar(QString path) {
+	igzstream gzin(path.toStdString().c_str());
+	std::istream* in = (std::istream*)(&gzin);
+	if (!in->good())
+		return 501;
+	
+	char magic[8];
+	in->read(magic, 8);
+	if (!in->good() || QByteArray(magic, 8) != QByteArray(CT_SIDECAR_MAGIC, 8))
+		return 502;
+	
+	ctVolume* volume = new ctVolume;
+	QVector <QVector <QPolygonF> > pos;
+	QVector <QVector <double> > zs;
+	QVector <QString> names;
+	qint32 n, structs, slices, points;
+	double p, q;
+	
+	// Dimensions and boundaries
+	in->read((char*)&n, sizeof(n)); volume->nx = n;
+	in->read((char*)&n, sizeof(n)); volume->ny = n;
+	in->read((char*)&n, sizeof(n)); volume->nz = n;
+	if (!in->good() || volume->nx <= 0 || volume->ny <= 0 || volume->nz <= 0) {
+		delete volume;
+		return 502;
+	}
+	volume->x.resize(volume->nx+1);
+	volume->y.resize(volume->ny+1);
+	volume->z.resize(volume->nz+1);
+	in->read((char*)volume->x.data(), volume->x.size()*sizeof(double));
+	in->read((char*)volume->y.data(), volume->y.size()*sizeof(double));
+	in->read((char*)volume->z.data(), volume->z.size()*sizeof(double));
+	
+	// Structs
+	in->read((char*)&structs, sizeof(structs));
+	for (int i = 0; i < structs && in->good(); i++) {
+		in->read((char*)&n, sizeof(n));
+		QByteArray name(qMax(n, 0), 0);
+		in->read(name.data(), name.size());
+		names << QString::fromUtf8(name);
+		
+		pos.resize(i+1);
+		zs.resize(i+1);
+		in->read((char*)&slices, sizeof(slices));
+		for (int j = 0; j < slices && in->good(); j++) {
+			in->read((char*)&p, sizeof(p));
+			zs[i] << p;
+			
+			pos[i].resize(j+1);
+			in->read((char*)&points, sizeof(points));
+			for (int m = 0; m < points && in->good(); m++) {
+				in->read((char*)&p, sizeof(p));
+				in->read((char*)&q, sizeof(q));
+				pos[i][j] << QPointF(p, q);
+			}
+		}
+	}
+	
+	// HU values, one sequential read per row
+	volume->HU.resize(volume->nz);
+	for (int k = 0; k < volume->nz && in->good(); k++) {
+		volume->HU[k].resize(volume->ny);
+		for (int j = 0; j < volume->ny && in->good(); j++) {
+			volume->HU[k][j].resize(volume->nx);
+			in->read((char*)volume->HU[k][j].data(), volume->nx*sizeof(short int));
+		}
+	}
+	
+	if (!in->good()) {
+		delete volume;
+		return 502;
+	}
+	gzin.close();
+	
+	// Swap in the new data
+	volume->path = path;
+	clearSidecar();
+	CT_cache = volume;
+	structPos = pos;
+	structZ = zs;
+	structName = names;
+	indexStructs();
 	
 	return 0;
 }
 
+// Drop the loaded CT sidecar, so builds read CT_data again
+void Data::clearSidecar() {
+	if (CT_cache)
+		delete CT_cache;
+	CT_cache = 0;
+}
+
 double Data::interp(double x, double x1, double x2, double y1, double y2) {
 	return (y2*(x-x1)+y1*(x2-x))/(x2-x1);
 }
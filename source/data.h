@@ -40,12 +40,49 @@
 #define DATA_H
 
 #include <QtGui>
+#include <QtConcurrent>
 
 #include "data/DICOM.h"
 #include "data/egsphant.h"
 #include "data/input.h"
 #include "data/dose.h"
 
+// Identifies CT sidecar files and their format version
+#define CT_SIDECAR_MAGIC "EGSCT001"
+
+// Contour slices closer than this in z (cm) are taken to lie on the same plane
+#define STRUCT_PLANE_TOL 0.001
+
+// A decoded CT volume and its egsphant geometry, as read from a CT sidecar
+struct ctVolume {
+	QString path; // Sidecar it was read from
+	int nx, ny, nz;
+	QVector <double> x, y, z; // Voxel boundaries in cm
+	QVector <QVector <QVector <short int> > > HU; // HU values indexed [k][j][i]
+};
+
+// This holds the lookups and tallies shared by the steps of an egsphant build,
+// so that the same steps can build the whole phantom at once or one slab of
+// slices at a time
+struct egsphantBuild {
+	int contourNum, defaultTAS, nz; // nz is the slice count of the whole phantom
+	QVector <int>* structIndex;
+	QMap <int, int> structToTas; // Struct index to non-default TAS index
+	QVector <double> HUDensity; // Density of every short HU value, indexed HU+32768
+	QVector <QVector <double> > tasThreshold; // Thresholds of each TAS in use, minus the last
+	QVector <bool> tasSorted; // Whether the binary search can be used on each TAS
+	QVector <QVector <char> > tasChar; // egsphant character of each media of each TAS in use
+	QVector <QVector <int> > tasMedium; // Index in the phantom media of each media of each TAS in use
+	QVector <unsigned short int> xPix, yPix; // Rows and columns of each CT slice
+	QVector <QVector <QRectF> > structRect; // Bounding rectangles of each struct slice
+	QVector <QVector <double> > marSources; // [x,y,z] of each source MAR is performed at
+	bool marOpened; // Whether the transformation file could be read
+	int marCount, marEvaluated; // MAR voxel tallies for the log file
+	QMap <QString, int> medVol, structVol; // Voxel counts for the log file
+	QString zHeights; // Slice heights for the log file
+	ogzstream* sidecar = 0; // CT sidecar being written, if any
+};
+
 // This class holds all the back-end data available to the interface
 // and holds many of the backend members for data manipulation
 class Data : public QObject {
@@ -84,6 +121,7 @@ public:
 	// GUI parameters
 	int isodoseLineThickness = 2;
 	int histogramBinCount = 20;
+	int egsphantSlabSize = 16; // Slices held in memory at once by low memory egsphant builds
 	
 	// egs_brachy library data
 	QStringList libNamePhants;
@@ -128,6 +166,8 @@ public:
                        // https://www.dicomlibrary.com/dicom/dicom-tags/
 	
 	QVector <DICOM*> CT_data; // Holds all CT phantoms
+	ctVolume* CT_cache = 0; // Decoded CT from a sidecar, used instead of CT_data when loaded
+	QString sidecarPath; // CT sidecar written by the next build, none if empty
 	DICOM* struct_data = 0; // Holds the structure data
 	bool struct_loaded = false;
 	DICOM* plan_data = 0; // Holds the plan data
@@ -140,6 +180,13 @@ public:
 	QVector <QVector <double> > structZ; // Holds contour z positions
 	QVector <QString> structName; // Holds contour name
 	
+	// Contours sorted by z, indexed once by indexStructs so that drawing a slice
+	// is a binary search rather than a scan of structZ
+	QVector <double> structPlanes; // Distinct z of all contours, ascending
+	QVector <QVector <QPoint> > structPlaneContours; // (struct, slice) of the contours on each plane
+	double structSpacing = 0; // Smallest gap between planes
+	int structRevision = 0; // Bumped by indexStructs so views know to redo their polygons
+	
 	// Plan data to import from DICOM
 	QString treatmentType; // MANUAL, HDR, MDR, LDR, or PDR
 	QString treatmentTechnique; // INTRALUMENARY, INTRACAVITARY, INTERSTITIAL,
@@ -159,6 +206,31 @@ public:
 	int buildEgsphant(EGSPhant* phant, QString* log, int contourNum, int defaultTAS,
 					  QVector <int>* structIndex, QVector <int>* tasIndex,
 					  QVector <EGSPhant*>* makeMasks);
+	int buildEgsphantStream(QString path, QStringList maskPaths, QString* log, int contourNum,
+							int defaultTAS, QVector <int>* structIndex, QVector <int>* tasIndex);
+	
+	// Build egsphant steps
+	int buildSetup(egsphantBuild* build, EGSPhant* phant, QString* log, int contourNum, int defaultTAS,
+				   QVector <int>* structIndex, QVector <int>* tasIndex);
+	int parseCTGeometry(egsphantBuild* build, EGSPhant* phant, QString* log);
+	int parseCTSlice(egsphantBuild* build, int k, QVector <QVector <short int> >* slice);
+	int buildSlab(egsphantBuild* build, EGSPhant* slab, QVector <EGSPhant*>* makeMasks, int k0);
+	void buildLog(egsphantBuild* build, QString* log);
+	int tasLookup(const egsphantBuild* build, int q, double density);
+	
+	// CT sidecars
+	void startSidecar(egsphantBuild* build, EGSPhant* phant, QString* log);
+	void finishSidecar(egsphantBuild* build, bool keep);
+	int loadSidecar(QString path);
+	void clearSidecar();
+	
+	// Crop and resample a built egsphant
+	int cropEgsphant(EGSPhant* phant, QVector <EGSPhant*>* masks, QVector <double> box, QString* log);
+	int resampleEgsphant(EGSPhant* phant, QVector <EGSPhant*>* masks, double dx, double dy, double dz, QString* log);
+	QVector <double> contourBox(int i); // [xmin,xmax,ymin,ymax,zmin,zmax] around struct i
+	void indexStructs(); // Sort the contours into structPlanes
+	const QVector <QPoint>* structsAt(double z, double tol); // Contours on the plane nearest z, 0 if none within tol
+	QVector <double> seedBox(double margin); // [xmin,xmax,ymin,ymax,zmin,zmax] around seedPos
 	
 	double interp(double x, double x1, double x2, double y1, double y2);
 	
@@ -72,10 +72,13 @@ Dose::Dose(const Dose &d)
             }
         }
     }
+	
+    stats = d.stats;
 }
 
 Dose::Dose(QString path, int n)
     : QObject(0) {
+    x = y = z = 0; // Stay empty if no file is read
 	if (!n) {
 		// do nothing
 	}
@@ -93,103 +96,145 @@ Dose::~Dose() {
 
 double Dose::triInterpol(double xp, double yp, double zp, double *val,
                          double *err) {
-    // Convert real numbers to indices to see if we are in the phantom
-    int xi = getIndex("X", xp);
-    int yi = getIndex("Y", yp);
-    int zi = getIndex("Z", zp);
-    if (zi == -1 || yi == -1 || xi == -1) {
+    // Find the voxel centres bracketing the point along each axis, which also
+    // tells us if we are in the phantom
+    int x0, x1, y0, y1, z0, z1;
+    double wx, wy, wz;
+    if (!cellWeight(X_AXIS, xp, &x0, &x1, &wx) || !cellWeight(Y_AXIS, yp, &y0, &y1, &wy) ||
+        !cellWeight(Z_AXIS, zp, &z0, &z1, &wz)) {
         return *val = *err = -1; // If outside of bounds, return -1
     }
-							 
-    // All the positions needed (in addition to the ones passed in)
-    double x0, y0, z0, x1, y1, z1;
-
-    // Define X
-    if (xp < (cx[xi] + cx[xi-1])/2.0) {
-        x0 = (cx[xi] + cx[xi-1])/2.0;
-        x1 = (cx[xi] + cx[xi+1])/2.0;
-    }
-    else {
-        x0 = (cx[xi] + cx[xi+1])/2.0;
-        x1 = (cx[xi+1] + cx[xi+2])/2.0;
-    }
 
-    // Define Y
-    if (yp < (cy[yi] + cy[yi-1])/2.0) {
-        y0 = (cy[yi] + cy[yi-1])/2.0;
-        y1 = (cy[yi] + cy[yi+1])/2.0;
+    // Read the 8 corners straight from the rows holding them, corner c is
+    // x1 if bit 0 of c is set, y1 if bit 1 is set and z1 if bit 2 is set
+    const double* dRow[4] = {this->val.at(x0).at(y0).constData(), this->val.at(x1).at(y0).constData(),
+                             this->val.at(x0).at(y1).constData(), this->val.at(x1).at(y1).constData()};
+    const double* eRow[4] = {this->err.at(x0).at(y0).constData(), this->err.at(x1).at(y0).constData(),
+                             this->err.at(x0).at(y1).constData(), this->err.at(x1).at(y1).constData()};
+    double w[8], d[8], e[8];
+    for (int c = 0; c < 8; c++) {
+        w[c] = (c&1?wx:1-wx)*(c&2?wy:1-wy)*(c&4?wz:1-wz);
+        d[c] = dRow[c&3][c&4?z1:z0];
+        e[c] = eRow[c&3][c&4?z1:z0];
     }
-    else {
-        y0 = (cy[yi] + cy[yi+1])/2.0;
-        y1 = (cy[yi+1] + cy[yi+2])/2.0;
+
+    // Add all 8 values together, weighted by the volume of the rectangular
+    // prism formed by the point that was passed in and the one in the opposite
+    // corner of the total rectangular prism volume, and add their absolute
+    // uncertainties in quadrature with the same weights
+    double weight = 0;
+    *val = *err = 0;
+    for (int c = 0; c < 8; c++) {
+        *val += d[c]*w[c];
+        *err += (d[c]*e[c]*w[c])*(d[c]*e[c]*w[c]);
+        weight += w[c]*w[c];
     }
 
-    // Define Z
-    if (zp < (cz[zi] + cz[zi-1])/2.0) {
-        z0 = (cz[zi] + cz[zi-1])/2.0;
-        z1 = (cz[zi] + cz[zi+1])/2.0;
+    *err = *val ? sqrt(*err/weight)/(*val) : 0;
+
+    return *val;
+}
+
+void Dose::triInterpol(const QVector <double> &xp, const QVector <double> &yp, const QVector <double> &zp,
+                       QVector <double> *value, QVector <double> *error) {
+    int n = xp.size();
+    value->fill(0, n);
+    error->fill(0, n);
+
+    // Resolve the bracketing voxels and weights of every point up front, the
+    // buffers are corner-major (corner c of point i at c*n+i) so that each of
+    // the loops below runs over contiguous memory
+    QVector <double> w(8*n, 0), d(8*n, 0), e(8*n, 0);
+    QVector <const double*> dRow(4*n), eRow(4*n);
+    QVector <int> zc(2*n);
+    QVector <char> inside(n);
+    int x0, x1, y0, y1, z0, z1;
+    double wx, wy, wz;
+    for (int i = 0; i < n; i++) {
+        inside[i] = cellWeight(X_AXIS, xp[i], &x0, &x1, &wx) && cellWeight(Y_AXIS, yp[i], &y0, &y1, &wy) &&
+                    cellWeight(Z_AXIS, zp[i], &z0, &z1, &wz);
+        if (!inside[i])
+            continue;
+
+        // Corner c is x1 if bit 0 of c is set, y1 if bit 1 is set and z1 if bit 2 is set
+        for (int c = 0; c < 8; c++)
+            w[c*n+i] = (c&1?wx:1-wx)*(c&2?wy:1-wy)*(c&4?wz:1-wz);
+        dRow[i] = val.at(x0).at(y0).constData(), dRow[n+i] = val.at(x1).at(y0).constData();
+        dRow[2*n+i] = val.at(x0).at(y1).constData(), dRow[3*n+i] = val.at(x1).at(y1).constData();
+        eRow[i] = err.at(x0).at(y0).constData(), eRow[n+i] = err.at(x1).at(y0).constData();
+        eRow[2*n+i] = err.at(x0).at(y1).constData(), eRow[3*n+i] = err.at(x1).at(y1).constData();
+        zc[i] = z0, zc[n+i] = z1;
     }
-    else {
-        z0 = (cz[zi] + cz[zi+1])/2.0;
-        z1 = (cz[zi+1] + cz[zi+2])/2.0;
+
+    // Gather the corners of every point into the flat buffers
+    for (int c = 0; c < 8; c++) {
+        const double* const* dr = dRow.constData()+(c&3)*n;
+        const double* const* er = eRow.constData()+(c&3)*n;
+        const int* zi = zc.constData()+(c&4?n:0);
+        double* dc = d.data()+c*n;
+        double* ec = e.data()+c*n;
+        for (int i = 0; i < n; i++)
+            if (inside[i]) {
+                dc[i] = dr[i][zi[i]];
+                ec[i] = er[i][zi[i]];
+            }
     }
 
-    // Precompute lengths
-    double ix = xp-x0, fx = x1-xp, iy = yp-y0, fy = y1-yp, iz = zp-z0, fz = z1-zp;
-    double vol = 0, weight = 0;
+    // Accumulate the weighted values and the absolute uncertainties in
+    // quadrature, as in the single point triInterpol, with no branches or
+    // lookups left so the compiler can vectorize over the points
+    double* v = value->data();
+    double* u = error->data();
+    QVector <double> weight(n, 0);
+    double* ws = weight.data();
+    for (int c = 0; c < 8; c++) {
+        const double* wc = w.constData()+c*n;
+        const double* dc = d.constData()+c*n;
+        const double* ec = e.constData()+c*n;
+        for (int i = 0; i < n; i++) {
+            v[i]  += dc[i]*wc[i];
+            u[i]  += (dc[i]*ec[i]*wc[i])*(dc[i]*ec[i]*wc[i]);
+            ws[i] += wc[i]*wc[i];
+        }
+    }
 
-    // Add all 8 values together, weighted by the volume of the rectangular
-    // prism formed by the point that was passed in and the one in the opposite
-    // corner of the total rectangular prism volume
-    *val = *err = 0;
+    for (int i = 0; i < n; i++) {
+        if (!inside[i])
+            v[i] = u[i] = -1; // If outside of bounds, return -1
+        else
+            u[i] = v[i] ? sqrt(u[i]/ws[i])/v[i] : 0;
+    }
+}
 
-    vol = fx*fy*fz;
-    weight += vol*vol;
-    *val += getDose(x0,y0,z0)*vol;
-    *err += pow(getDose(x0,y0,z0)*getError(x0,y0,z0)*vol,2);
-
-    vol = ix*fy*fz;
-    weight += vol*vol;
-    *val += getDose(x1,y0,z0)*vol;
-    *err += pow(getDose(x1,y0,z0)*getError(x1,y0,z0)*vol,2);
-
-    vol = fx*iy*fz;
-    weight += vol*vol;
-    *val += getDose(x0,y1,z0)*vol;
-    *err += pow(getDose(x0,y1,z0)*getError(x0,y1,z0)*vol,2);
-
-    vol = fx*fy*iz;
-    weight += vol*vol;
-    *val += getDose(x0,y0,z1)*vol;
-    *err += pow(getDose(x0,y0,z1)*getError(x0,y0,z1)*vol,2);
-
-    vol = fx*iy*iz;
-    weight += vol*vol;
-    *val += getDose(x0,y1,z1)*vol;
-    *err += pow(getDose(x0,y1,z1)*getError(x0,y1,z1)*vol,2);
-
-    vol = ix*fy*iz;
-    weight += vol*vol;
-    *val += getDose(x1,y0,z1)*vol;
-    *err += pow(getDose(x1,y0,z1)*getError(x1,y0,z1)*vol,2);
-
-    vol = ix*iy*fz;
-    weight += vol*vol;
-    *val += getDose(x1,y1,z0)*vol;
-    *err += pow(getDose(x1,y1,z0)*getError(x1,y1,z0)*vol,2);
-
-    vol = ix*iy*iz;
-    weight += vol*vol;
-    *val += getDose(x1,y1,z1)*vol;
-    *err += pow(getDose(x1,y1,z1)*getError(x1,y1,z1)*vol,2);
-
-    *val /= (x1-x0)*(y1-y0)*(z1-z0);
-    *err = sqrt(*err/weight)/(*val);
+// Find the voxels whose centres bracket p along axis and the weight of the second,
+// points within half a voxel of the edge use the edge voxel alone
+bool Dose::cellWeight(Axis axis, double p, int* i0, int* i1, double* w1) {
+    const QVector <double> &c = axis == X_AXIS ? cx : (axis == Y_AXIS ? cy : cz);
+    int n = c.size()-1, i = getIndex(axis, p);
+    if (i == -1) {
+        return false;
+    }
 
-    return *val;
+    double mid = (c[i]+c[i+1])/2.0, other;
+    *i0 = *i1 = i;
+    *w1 = 0;
+    if (p < mid && i > 0) {
+        other = (c[i-1]+c[i])/2.0;
+        *i0 = i-1;
+        *w1 = (p-other)/(mid-other);
+    }
+    else if (p >= mid && i < n-1) {
+        other = (c[i+1]+c[i+2])/2.0;
+        *i1 = i+1;
+        *w1 = (p-mid)/(other-mid);
+    }
+    return true;
 }
 
 void Dose::readIn(QString path, int n) {
+    stats.valid = false; // Forget the statistics of any previous file
+    levelCache.levels.clear();
+
     // Open the .3ddose file
     QFile *file;
     QTextStream *input;
@@ -270,12 +315,16 @@ void Dose::readIn(QString path, int n) {
             emit madeProgress(increment); // Update progress bar
         }
 
+        computeStats(); // Summarize the new dose once while it is hot
         delete input;
     }
     delete file;
 }
 
 void Dose::readBIn(QString path, int n) {
+    stats.valid = false; // Forget the statistics of any previous file
+    levelCache.levels.clear();
+
     // Open the .3ddose file
     QFile *file;
     QDataStream *input;
@@ -365,6 +414,7 @@ void Dose::readBIn(QString path, int n) {
             emit madeProgress(increment); // Update progress bar
         }
 
+        computeStats(); // Summarize the new dose once while it is hot
         delete input;
     }
     delete file;
@@ -558,46 +608,25 @@ int Dose::strip() {
     y -= 2;
     z -= 2;
 
+    stats.valid = false; // The outer voxels are gone
+    levelCache.levels.clear();
     return 1; // Success
 }
 
-int Dose::getIndex(QString axis, double val) {
-    // This algorithm checks to see if val is within the outer bounds of axis'
-    // coord array, then checks from c[0] to c[x] until it finds a c[n] smaller
-    // than val and returns it's index
-
-    int index = -1;
-    if (!axis.compare("X")) {
-        if (val <= cx[0] || val >= cx[x]) {
-            return index;
-        }
-
-        for (int i = 0; i <= x; i++)
-            if (cx[i] <= val) {
-                index = i;
-            }
-    }
-    else if (!axis.compare("Y")) {
-        if (val <= cy[0] || val >= cy[y]) {
-            return index;
-        }
-
-        for (int i = 0; i <= y; i++)
-            if (cy[i] <= val) {
-                index = i;
-            }
+int Dose::getIndex(Axis axis, double val) {
+    // This checks to see if val is within the outer bounds of axis' coord
+    // array, then finds the last c[n] at or below val and returns its index
+    const QVector <double> &c = axis == X_AXIS ? cx : (axis == Y_AXIS ? cy : cz);
+    if (c.isEmpty() || val <= c[0]) {
+        return -1;
     }
-    else if (!axis.compare("Z")) {
-        if (val <= cz[0] || val >= cz[z]) {
-            return index;
-        }
+    return lookup[axis].lower(c, val); // Will return -1 on failure to find
+}
 
-        for (int i = 0; i <= z; i++)
-            if (cz[i] <= val) {
-                index = i;
-            }
-    }
-    return index; // Will return -1 on failure to find
+void Dose::prepareLookups() {
+    lookup[X_AXIS].lower(cx, 0);
+    lookup[Y_AXIS].lower(cy, 0);
+    lookup[Z_AXIS].lower(cz, 0);
 }
 
 double Dose::getDose(int ix, int iy, int iz) {
@@ -620,9 +649,9 @@ double Dose::getError(int ix, int iy, int iz) {
 
 double Dose::getDose(double px, double py, double pz) {
     // Convert real numbers to indices and return dose at index
-    int ix = getIndex("X", px);
-    int iy = getIndex("Y", py);
-    int iz = getIndex("Z", pz);
+    int ix = getIndex(X_AXIS, px);
+    int iy = getIndex(Y_AXIS, py);
+    int iz = getIndex(Z_AXIS, pz);
     if (iz == -1 || iy == -1 || ix == -1) {
         return -1;    // If outside of bounds, return -1
     }
@@ -632,9 +661,9 @@ double Dose::getDose(double px, double py, double pz) {
 
 double Dose::getError(double px, double py, double pz) {
     // Convert real numbers to indices and return error at index
-    int ix = getIndex("X", px);
-    int iy = getIndex("Y", py);
-    int iz = getIndex("Z", pz);
+    int ix = getIndex(X_AXIS, px);
+    int iy = getIndex(Y_AXIS, py);
+    int iz = getIndex(Z_AXIS, pz);
     if (iz == -1 || iy == -1 || ix == -1) {
         return -1;    // If outside of bounds, return -1
     }
@@ -643,17 +672,120 @@ double Dose::getError(double px, double py, double pz) {
 }
 
 double Dose::getMax() {
-    double max = val[0][0][0];
+    return getStats().max;
+}
 
-    // Iterate through all dose to get largest and smallest dose
-    for (int k = 0; k < z; k++)
-        for (int j = 0; j < y; j++)
-            for (int i = 0; i < x; i++)
-                if (val[i][j][k] > max) {
-                    max = val[i][j][k];
-                }
+const doseStats &Dose::getStats() {
+    if (!stats.valid) {
+        computeStats();
+    }
+    return stats;
+}
 
-    return max;
+double Dose::getPercentile(double fraction) {
+    const doseStats &s = getStats();
+    if (!s.count) {
+        return 0;
+    }
+	
+    // Find the bin holding the target voxel and interpolate within it
+    double target = fraction*double(s.count), width = (s.max-s.min)/double(DOSE_STATS_BINS);
+    int seen = 0;
+    for (int b = 0; b < DOSE_STATS_BINS; b++) {
+        if (s.histogram[b] && seen+s.histogram[b] >= target) {
+            return s.min+width*(double(b)+(target-double(seen))/double(s.histogram[b]));
+        }
+        seen += s.histogram[b];
+    }
+    return s.max;
+}
+
+// Fill stats in two passes over the x columns, each column being its own task,
+// the first for extrema and sums and the second for the histogram, which needs
+// the extrema
+void Dose::computeStats() {
+    stats = doseStats();
+    stats.histogram.fill(0, DOSE_STATS_BINS);
+    stats.valid = true;
+    if (x <= 0 || y <= 0 || z <= 0) {
+        return;
+    }
+	
+    struct partial {double max, min, sum, sum2, integral, wSum, wDose;};
+    QVector <int> columns(x);
+    QVector <partial> columnStats(x);
+    QVector <QVector <int> > columnCounts(x);
+    for (int i = 0; i < x; i++)
+        columns[i] = i;
+	
+    // Everything shared between the tasks is only read through const references
+    const QVector <QVector <QVector <double> > > &cVal = val, &cErr = err;
+    const QVector <double> &ccx = cx, &ccy = cy, &ccz = cz;
+    int ny = y, nz = z;
+	
+    QtConcurrent::blockingMap(columns, [&](int &i) {
+        partial p = {cVal[i][0][0], cVal[i][0][0], 0, 0, 0, 0, 0};
+        double xLen = ccx[i+1]-ccx[i], area, var;
+        const double* zLen = ccz.constData();
+		
+        for (int j = 0; j < ny; j++) {
+            const double* v = cVal[i][j].constData();
+            const double* e = cErr[i][j].constData();
+            area = xLen*(ccy[j+1]-ccy[j]);
+            for (int k = 0; k < nz; k++) {
+                p.max = v[k] > p.max ? v[k] : p.max;
+                p.min = v[k] < p.min ? v[k] : p.min;
+                p.sum += v[k];
+                p.sum2 += v[k]*v[k];
+                p.integral += v[k]*area*(zLen[k+1]-zLen[k]);
+				
+                // Absolute variance, voxels without uncertainty are left out
+                var = v[k]*e[k]*v[k]*e[k];
+                if (var > 0) {
+                    p.wSum += 1.0/var;
+                    p.wDose += v[k]/var;
+                }
+            }
+        }
+		
+        columnStats[i] = p;
+    });
+	
+    double wSum = 0, wDose = 0;
+    stats.max = columnStats[0].max;
+    stats.min = columnStats[0].min;
+    for (int i = 0; i < x; i++) {
+        stats.max = columnStats[i].max > stats.max ? columnStats[i].max : stats.max;
+        stats.min = columnStats[i].min < stats.min ? columnStats[i].min : stats.min;
+        stats.sum += columnStats[i].sum;
+        stats.sum2 += columnStats[i].sum2;
+        stats.integral += columnStats[i].integral;
+        wSum += columnStats[i].wSum;
+        wDose += columnStats[i].wDose;
+    }
+    stats.count = x*y*z;
+    stats.weightedMean = wSum > 0 ? wDose/wSum : 0;
+	
+    // Bin every voxel, the maximum going in the last bin
+    double lo = stats.min, inv = stats.max > stats.min ? double(DOSE_STATS_BINS)/(stats.max-stats.min) : 0;
+    QtConcurrent::blockingMap(columns, [&](int &i) {
+        QVector <int> counts(DOSE_STATS_BINS, 0);
+        int b;
+		
+        for (int j = 0; j < ny; j++) {
+            const double* v = cVal[i][j].constData();
+            for (int k = 0; k < nz; k++) {
+                b = int((v[k]-lo)*inv);
+                counts[b < DOSE_STATS_BINS ? b : DOSE_STATS_BINS-1]++;
+            }
+        }
+		
+        columnCounts[i] = counts;
+    });
+	
+    for (int i = 0; i < x; i++)
+        for (int b = 0; b < DOSE_STATS_BINS; b++)
+            stats.histogram[b] += columnCounts[i][b];
 }
 
 int Dose::scale(double factor) {
@@ -667,698 +799,1123 @@ int Dose::scale(double factor) {
                 val[i][j][k] *= factor;    // Multiply each value by factor
             }
 
-    // Since error is fractional, it does not change
+    levelCache.levels.clear(); // The slice now falls on other colours
+
+    // Since error is fractional, it does not change, and the histogram bins
+    // scale along with the doses, so the rest of the stats just scale
+    if (stats.valid) {
+        stats.max *= factor;
+        stats.min *= factor;
+        stats.sum *= factor;
+        stats.sum2 *= factor*factor;
+        stats.integral *= factor;
+        stats.weightedMean *= factor;
+    }
     return 1;
 }
 
-// Run through all 3ddose values and create lines for each pixel
-void Dose::getContour(QVector <QVector <QLineF> > *con,
-                      QVector <double> doses, QString axis, double depth,
+// Marching squares cases, indexed by which corners of a cell are above the dose
+// (bit 0 for (r,c), 1 for (r,c+1), 2 for (r+1,c+1) and 3 for (r+1,c)), as pairs
+// of the cell edges (0 bottom, 1 right, 2 top and 3 left) each segment joins
+static const signed char contourCases[16][4] = {
+	{-1,-1,-1,-1}, { 3, 0,-1,-1}, { 0, 1,-1,-1}, { 3, 1,-1,-1},
+	{ 1, 2,-1,-1}, { 3, 0, 1, 2}, { 0, 2,-1,-1}, { 3, 2,-1,-1},
+	{ 2, 3,-1,-1}, { 0, 2,-1,-1}, { 0, 1, 2, 3}, { 1, 2,-1,-1},
+	{ 1, 3,-1,-1}, { 0, 1,-1,-1}, { 3, 0,-1,-1}, {-1,-1,-1,-1}
+};
+
+// Saddle cases 5 and 10 when the cell centre is above the dose, joining the two
+// corners above rather than separating them
+static const signed char contourSaddles[2][4] = {
+	{ 0, 1, 2, 3}, { 3, 0, 1, 2}
+};
+
+// Run marching squares over the voxel centres of the slice for all doses at once
+void Dose::getContour(QVector <QVector <QPolygonF> > *con,
+                      QVector <double> doses, Axis axis, double depth,
                       double ai, double af, double bi, double bf,
                       int res) {
-    // Use marching squares to determine lines of the contour by looking at
-    // rectangles formed by 4 neighbouring doses and determining the contour
-    // lines going through the rectangle
-
-    // Find the slice to be used
-    con->clear();
-    con->resize(doses.size());
-    int n = getIndex(axis, depth);
-    if (n == -1) {
-        return;
-    }
+	// Find the slice to be used
+	con->resize(doses.size());
+	for (int p = 0; p < doses.size(); p++)
+		(*con)[p].resize(0);
+	int n = getIndex(axis, depth);
+	if (n == -1)
+		return;
 	
-    int cases = 0, tl = 0, tr = 0, bl = 0, br = 0;
-    int fa, fb, flag = false;
-    QVector <int> px, py;
-    QVector <QVector <double> > d;
-    QVector <double> temp;
-
-    px.clear();
-    py.clear();
-	
-    // Setup dose and pixel arrays
-    if (!axis.compare("X")) {
-        for (int i = 0; i < y; i++)
-            if (cy[i] > bi && cy[i+1] < bf) {
-                px.append(int(((cy[i]+cy[i+1])/2.0-bi)*double(res)));
-                temp.clear();
-                for (int j = 0; j < z; j++)
-                    if (cz[j] > ai && cz[j+1] < af) {
-                        temp.append(val[n][i][j]);
-                        if (!flag)
-                            py.append(int(((cz[j]+cz[j+1])/2.0-ai)*double(res)));
-                    }
-                flag++;
-                d.append(temp);
-            }
-    }
-    else if (!axis.compare("Y")) {
-        for (int i = 0; i < x; i++)
-            if (cx[i] > bi && cx[i+1] < bf) {
-                px.append(int(((cx[i]+cx[i+1])/2.0-bi)*double(res)));
-                temp.clear();
-                for (int j = 0; j < z; j++)
-                    if (cz[j] > ai && cz[j+1] < af) {
-                        temp.append(val[i][n][j]);
-                        if (!flag)
-                            py.append(int(((cz[j]+cz[j+1])/2.0-ai)*double(res)));
-                    }
-                flag++;
-                d.append(temp);
-            }
-    }
-    else if (!axis.compare("Z")) {
-        for (int i = 0; i < x; i++)
-            if (cx[i] > bi && cx[i+1] < bf) {
-                px.append(int(((cx[i]+cx[i+1])/2.0-bi)*double(res)));
-                temp.clear();
-                for (int j = 0; j < y; j++)
-                    if (cy[j] > ai && cy[j+1] < af) {
-                        temp.append(val[i][j][n]);
-                        if (!flag)
-                            py.append(int(((cy[j]+cy[j+1])/2.0-ai)*double(res)));
-                    }
-                flag++;
-                d.append(temp);
-            }
-    }
+	// Voxels whose centres are within the bounds, columns along b and rows along a
+	const QVector <double> &bb = axis == X_AXIS ? cy : cx, &ab = axis == Z_AXIS ? cy : cz;
+	int b0 = 0, b1 = bb.size()-1, a0 = 0, a1 = ab.size()-1;
+	while (b0 < b1 && (bb[b0]+bb[b0+1])/2.0 < bi) b0++;
+	while (b1 > b0 && (bb[b1-1]+bb[b1])/2.0 > bf) b1--;
+	while (a0 < a1 && (ab[a0]+ab[a0+1])/2.0 < ai) a0++;
+	while (a1 > a0 && (ab[a1-1]+ab[a1])/2.0 > af) a1--;
+	int nb = b1-b0, na = a1-a0;
+	if (nb < 2 || na < 2)
+		return;
 	
-    for (int i = 0; i < px.size()-1; i++)
-        for (int j = 0; j < py.size()-1; j++)
-            for (int p = 0; p < doses.size(); p++) {
-                // Cases tells us the number of vertices above the
-                // contour dose
-                // Bottom Left
-                cases  = bl = (d[i][j] > doses[p]);
-                // Bottom Right
-                cases += br = (d[i+1][j] > doses[p]);
-                // Top Left
-                cases += tl = (d[i][j+1] > doses[p]);
-                // Top Right
-                cases += tr = (d[i+1][j+1] > doses[p]);
-
-                if (cases == 1) { // We have 1 vertex within contour, use linear
-                    // interpolation to determine line
-                    if (bl) {
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j], d[i+1][j],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i][j], d[i][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j], px[i], fb));
-                    }
-                    else if (br) {
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j], d[i+1][j],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i+1][j], d[i+1][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j], px[i+1], fb));
-                    }
-                    else if (tl) {
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j+1], d[i+1][j+1],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i][j], d[i][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j+1], px[i], fb));
-                    }
-                    else if (tr) {
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j+1], d[i+1][j+1],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i+1][j], d[i+1][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j+1], px[i+1], fb));
-                    }
-                }
-                else if (cases == 3) { // We have 3 vertices within contour, use
-                    // linear interpolation to determine line
-                    if (!bl) {
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j], d[i+1][j],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i][j], d[i][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j], px[i], fb));
-                    }
-                    else if (!br) {
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j], d[i+1][j],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i+1][j], d[i+1][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j], px[i+1], fb));
-                    }
-                    else if (!tl) {
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j+1], d[i+1][j+1],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i][j], d[i][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j+1], px[i], fb));
-                    }
-                    else if (!tr) {
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j+1], d[i+1][j+1],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i+1][j], d[i+1][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j+1], px[i+1], fb));
-                    }
-                }
-                else if (cases == 2) { // We have 2 vertices within contour, use
-                    // linear interpolation to determine line
-                    // The first two are simple single line cases
-                    if ((bl && br) || (tl && tr)) { // Horizontal line
-                        fa = interp(py[j], py[j+1],
-                                    d[i][j], d[i][j+1],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i+1][j], d[i+1][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(px[i], fa, px[i+1], fb));
-                    }
-                    else if ((bl && tl) || (br && tr)) { // Vertical line
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j], d[i+1][j],
-                                    doses[p]);
-                        fb = interp(px[i], px[i+1],
-                                    d[i][j+1], d[i+1][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j], fb, py[j+1]));
-                    }
-                    else if ((bl && tr)) { // First ambiguous case
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j], d[i+1][j],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i][j], d[i][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j], px[i], fb));
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j+1], d[i+1][j+1],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i+1][j], d[i+1][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j+1], px[i+1], fb));
-                    }
-                    else if ((br && tl)) { // Second ambiguous case
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j], d[i+1][j],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i+1][j], d[i+1][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j], px[i+1], fb));
-                        fa = interp(px[i], px[i+1],
-                                    d[i][j+1], d[i+1][j+1],
-                                    doses[p]);
-                        fb = interp(py[j], py[j+1],
-                                    d[i][j], d[i][j+1],
-                                    doses[p]);
-                        (*con)[p].append(QLineF(fa, py[j+1], px[i], fb));
-                    }
-                }
-            }
-}
-
-int Dose::interp(int x1, int x2, double y1, double y2, double y0) {
-    return int(x1+(y0-y1)*(x2-x1)/(y2-y1));
-}
-
-QImage Dose::getColourMap(QString axis, double ai, double af, double bi, double bf, double d, int res,
-						  double di, double df, QColor min, QColor mid, QColor max) {
-    // Create a temporary image
-    int width  = (af-ai)*res; // Reversed on the image
-    int height = (bf-bi)*res; // Reversed on the image
-    QImage image(height, width, QImage::Format_ARGB32_Premultiplied);
-    double hInc, wInc;
-    double h, w, dose = 0;
-	double c, weight, invWeight;
-	double red, green, blue;
-
-    // Calculate the size (in cm) of pixels, and then the range for grayscaling
-    wInc = 1/double(res);
-    hInc = 1/double(res);
-	c = (df+di)/2.0;
-
-    for (int i = 0; i < height; i++)
-        for (int j = 0; j < width; j++) {
-            // determine the location of the current pixel in the phantom
-            h = (double(bi)) + hInc * double(i);
-            w = (double(ai)) + wInc * double(j);
-
-            // get the density, which differs based on axis through which image
-            // os sliced
-            if (!axis.compare("x axis")) {
-                dose = getDose(d, h, w);
-            }
-            else if (!axis.compare("y axis")) {
-                dose = getDose(h, d, w);
-            }
-            else if (!axis.compare("z axis")) {
-                dose = getDose(h, w, d);
-            }
+	contourBuffers local;
+	bool cached = contourLock.tryLock();
+	contourBuffers &buf = cached ? contourBuffer : local;
+	
+	// Copy the slice into flat storage
+	buf.plane.resize(na*nb);
+	buf.pa.resize(na);
+	buf.pb.resize(nb);
+	double* plane = buf.plane.data();
+	for (int r = 0; r < na; r++)
+		buf.pa[r] = ((ab[a0+r]+ab[a0+r+1])/2.0-ai)*double(res);
+	for (int c = 0; c < nb; c++) {
+		buf.pb[c] = ((bb[b0+c]+bb[b0+c+1])/2.0-bi)*double(res);
+		if (axis == X_AXIS) {
+			const double* row = val[n][b0+c].constData()+a0;
+			for (int r = 0; r < na; r++)
+				plane[r*nb+c] = row[r];
+		}
+		else if (axis == Y_AXIS) {
+			const double* row = val[b0+c][n].constData()+a0;
+			for (int r = 0; r < na; r++)
+				plane[r*nb+c] = row[r];
+		}
+		else {
+			const QVector <QVector <double> > &column = val[b0+c];
+			for (int r = 0; r < na; r++)
+				plane[r*nb+c] = column[a0+r][n];
+		}
+	}
+	
+	// Cell edges are numbered horizontal ones first (r*(nb-1)+c), then vertical
+	// ones (H+r*nb+c), so that neighbouring cells share the number of an edge
+	int H = na*(nb-1), E = H+(na-1)*nb, levels = doses.size();
+	buf.segments.resize(levels);
+	for (int p = 0; p < levels; p++)
+		buf.segments[p].resize(0);
+	if (buf.links.size() != 2*E)
+		buf.links.fill(-1, 2*E);
+	
+	int cases, edge[4];
+	double v0, v1, v2, v3, lo, hi;
+	const signed char* seg;
+	for (int r = 0; r < na-1; r++)
+		for (int c = 0; c < nb-1; c++) {
+			v0 = plane[r*nb+c];
+			v1 = plane[r*nb+c+1];
+			v2 = plane[(r+1)*nb+c+1];
+			v3 = plane[(r+1)*nb+c];
+			lo = qMin(qMin(v0, v1), qMin(v2, v3));
+			hi = qMax(qMax(v0, v1), qMax(v2, v3));
+			
+			edge[0] = r*(nb-1)+c;
+			edge[1] = H+r*nb+c+1;
+			edge[2] = (r+1)*(nb-1)+c;
+			edge[3] = H+r*nb+c;
 			
-			if (dose < c) {
-				dose      = di>dose?di:dose;
-				weight    = (dose-di)/(c-di);
-				invWeight = 1.0-weight;
+			for (int p = 0; p < levels; p++) {
+				if (doses[p] < lo || doses[p] >= hi) // All corners on one side
+					continue;
 				
-				red   = (mid.red()  * weight) + (min.red()  * invWeight);
-				green = (mid.green()* weight) + (min.green()* invWeight);
-				blue  = (mid.blue() * weight) + (min.blue() * invWeight);
-			}
-			else {
-				dose      = df<dose?df:dose;
-				weight    = (df-dose)/(df-c);
-				invWeight = 1.0-weight;
+				cases = (v0 > doses[p]) | (v1 > doses[p]) << 1 | (v2 > doses[p]) << 2 | (v3 > doses[p]) << 3;
+				if ((cases == 5 || cases == 10) && (v0+v1+v2+v3)/4.0 > doses[p])
+					seg = contourSaddles[cases == 10];
+				else
+					seg = contourCases[cases];
 				
-				red   = (mid.red()  * weight) + (max.red()  * invWeight);
-				green = (mid.green()* weight) + (max.green()* invWeight);
-				blue  = (mid.blue() * weight) + (max.blue() * invWeight);
+				for (int k = 0; k < 4 && seg[k] >= 0; k += 2)
+					buf.segments[p] << edge[seg[k]] << edge[seg[k+1]];
 			}
-			
-			// Rescale to max brightness
-			weight = red>blue?red:blue;
-			weight = weight>green?weight:green;
-			weight = 255.0/weight;
-			
-			// finally, paint the pixel
-			image.setPixel(i, j, qRgb(red*weight,green*weight,blue*weight));
-        }
-
-    return image; // return the image created
+		}
+	
+	for (int p = 0; p < levels; p++)
+		stitchContour(buf, buf.segments[p], nb, doses[p], &(*con)[p]);
+	
+	if (cached)
+		contourLock.unlock();
 }
 
-void Dose::getDV(QVector <DV> *data, double* volume, int n) {
-    double increment = 95.0/double(n)/double(z);
-	double xLen, yLen, zLen;
-	double vol = (*volume) = 0;
-	data->clear();
-    for (int k = 0; k < z; k++) {
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				xLen = (cx[i+1]-cx[i]);
-				vol = xLen*yLen*zLen;
-				(*volume) += vol;
-				data->append({val[i][j][k], err[i][j][k], vol});
-			}
+void Dose::stitchContour(contourBuffers &buf, const QVector <int> &segments, int nb, double dose,
+						 QVector <QPolygonF> *lines) {
+	int m = segments.size()/2, H = buf.pa.size()*(nb-1);
+	const int* seg = segments.constData();
+	const double* plane = buf.plane.constData();
+	int* links = buf.links.data();
+	
+	// Each cell edge is crossed by at most the two segments of the cells sharing it
+	for (int k = 0; k < 2*m; k++)
+		links[2*seg[k]] < 0 ? links[2*seg[k]] = k/2 : links[2*seg[k]+1] = k/2;
+	buf.used.fill(0, m);
+	
+	// The segment other than k through edge e, and the edge of k other than e
+	auto next   = [&](int k, int e) {return links[2*e] == k ? links[2*e+1] : links[2*e];};
+	auto across = [&](int k, int e) {return seg[2*k] == e ? seg[2*k+1] : seg[2*k];};
+	
+	// Where the dose crosses edge e
+	auto point = [&](int e) {
+		int r, c;
+		double f;
+		if (e < H) {
+			r = e/(nb-1), c = e%(nb-1);
+			f = (dose-plane[r*nb+c])/(plane[r*nb+c+1]-plane[r*nb+c]);
+			return QPointF(buf.pb[c]+f*(buf.pb[c+1]-buf.pb[c]), buf.pa[r]);
+		}
+		r = (e-H)/nb, c = (e-H)%nb;
+		f = (dose-plane[r*nb+c])/(plane[(r+1)*nb+c]-plane[r*nb+c]);
+		return QPointF(buf.pb[c], buf.pa[r]+f*(buf.pa[r+1]-buf.pa[r]));
+	};
+	
+	int cur, prev, e;
+	for (int k = 0; k < m; k++) {
+		if (buf.used[k])
+			continue;
+		
+		// Walk back to an open end of the polyline, or all the way around it
+		cur = k, e = seg[2*k];
+		while ((prev = next(cur, e)) >= 0 && prev != k) {
+			e = across(prev, e);
+			cur = prev;
 		}
+		if (prev == k)
+			cur = k, e = seg[2*k];
+		
+		// Then forward through every segment of it
+		QPolygonF line;
+		line << point(e);
+		while (cur >= 0 && !buf.used[cur]) {
+			buf.used[cur] = 1;
+			e = across(cur, e);
+			line << point(e);
+			cur = next(cur, e);
+		}
+		lines->append(line);
 	}
 	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	std::sort(data->begin(), data->end(), DV_sorter);
+	// Leave the links empty for the next dose
+	for (int k = 0; k < 2*m; k++)
+		links[2*seg[k]] = links[2*seg[k]+1] = -1;
 }
 
-void Dose::getDV(QVector <DV> *data, EGSPhant* media, QString allowedChars, double* volume, int n) {
-    double increment = 95.0/double(n)/double(z);
-	double xVal, yVal, zVal;
-	double xLen, yLen, zLen;
-	double vol = (*volume) = 0;
-	data->clear();
-    for (int k = 0; k < z; k++) {
-		zVal = (cz[k]+cz[k+1])/2.0;
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yVal = (cy[j]+cy[j+1])/2.0;
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				xVal = (cx[i]+cx[i+1])/2.0;
-				if (allowedChars.contains(media->getMedia(xVal, yVal, zVal))) {
-					xLen = (cx[i+1]-cx[i]);
-					vol = xLen*yLen*zLen;
-					(*volume) += vol;
-					data->append({val[i][j][k], err[i][j][k], vol});
+// Each cell of the surface grid is split into the six tetrahedra sharing its
+// (0,0,0)-(1,1,1) diagonal, corners are numbered x | y << 1 | z << 2, so that
+// the corners of a tetrahedron are each a subset of the next one
+static const int isoTetrahedra[6][4] = {
+	{0, 1, 3, 7}, {0, 1, 5, 7}, {0, 2, 3, 7}, {0, 2, 6, 7}, {0, 4, 5, 7}, {0, 4, 6, 7}
+};
+
+// Marching tetrahedra over a grid of the voxel centres, padded with a node of no
+// dose on the outer boundaries so that every surface is closed
+void Dose::getIsoSurface(isoSurface* mesh, double dose) {
+	mesh->dose = dose;
+	mesh->vertices.clear();
+	mesh->triangles.clear();
+	mesh->volume = 0;
+	if (x < 1 || y < 1 || z < 1)
+		return;
+	
+	// Node positions along each axis, the first and last on the dose boundaries
+	int nn[3] = {x+2, y+2, z+2};
+	QVector <double> pos[3];
+	const QVector <double>* bounds[3] = {&cx, &cy, &cz};
+	for (int a = 0; a < 3; a++) {
+		const QVector <double> &b = *bounds[a];
+		pos[a].resize(nn[a]);
+		pos[a][0] = b[0];
+		for (int i = 1; i < nn[a]-1; i++)
+			pos[a][i] = (b[i-1]+b[i])/2.0;
+		pos[a][nn[a]-1] = b.last();
+	}
+	
+	// Positions are taken about the centre of the grid for the volume sum
+	double origin[3] = {(cx[0]+cx.last())/2.0, (cy[0]+cy.last())/2.0, (cz[0]+cz.last())/2.0};
+	
+	// Each layer of cells along x is a task building its own mesh, with vertices
+	// keyed by the grid edge they lie on, node*8 + the corner bits it spans
+	struct layerMesh {
+		QVector <qint64> keys;
+		QVector <QVector3D> vertices;
+		QVector <int> triangles;
+		double volume = 0;
+	};
+	QVector <layerMesh> layers(nn[0]-1);
+	QVector <int> index(nn[0]-1);
+	for (int i = 0; i < index.size(); i++)
+		index[i] = i;
+	
+	const QVector < QVector < QVector <double> > > &cVal = val;
+	QtConcurrent::blockingMap(index, [&](int &i) {
+		layerMesh &layer = layers[i];
+		QHash <qint64, int> local;
+		int node[8][3], corner, tri[3];
+		double f[8], q[3][3], t, n[3], d[3];
+		bool above[4];
+		
+		// Dose at node (a, b, c), none outside of the voxels
+		auto value = [&](int a, int b, int c) {
+			if (a < 1 || b < 1 || c < 1 || a > x || b > y || c > z)
+				return 0.0;
+			return cVal[a-1][b-1][c-1];
+		};
+		
+		// The vertex on the edge between tetrahedron corners u and v, u being a
+		// subset of v, placed where the dose crosses it
+		auto vertex = [&](int u, int v, const int* tet, double* out) {
+			int cu = tet[u], cv = tet[v];
+			qint64 key = ((qint64(node[cu][0])*nn[1]+node[cu][1])*nn[2]+node[cu][2])*8+(cu^cv);
+			t = (dose-f[cu])/(f[cv]-f[cu]);
+			for (int a = 0; a < 3; a++)
+				out[a] = pos[a][node[cu][a]]+t*(pos[a][node[cv][a]]-pos[a][node[cu][a]])-origin[a];
+			
+			QHash <qint64, int>::const_iterator found = local.constFind(key);
+			if (found != local.constEnd())
+				return found.value();
+			
+			local.insert(key, layer.vertices.size());
+			layer.keys.append(key);
+			layer.vertices.append(QVector3D(out[0]+origin[0], out[1]+origin[1], out[2]+origin[2]));
+			return layer.vertices.size()-1;
+		};
+		
+		// Add triangle a, b, c facing along d, and its term of the divergence theorem
+		auto triangle = [&](int a, int b, int c) {
+			n[0] = (q[1][1]-q[0][1])*(q[2][2]-q[0][2])-(q[1][2]-q[0][2])*(q[2][1]-q[0][1]);
+			n[1] = (q[1][2]-q[0][2])*(q[2][0]-q[0][0])-(q[1][0]-q[0][0])*(q[2][2]-q[0][2]);
+			n[2] = (q[1][0]-q[0][0])*(q[2][1]-q[0][1])-(q[1][1]-q[0][1])*(q[2][0]-q[0][0]);
+			double sign = n[0]*d[0]+n[1]*d[1]+n[2]*d[2] < 0 ? -1 : 1;
+			layer.triangles << a << (sign > 0 ? b : c) << (sign > 0 ? c : b);
+			layer.volume += sign*(q[0][0]*(q[1][1]*q[2][2]-q[1][2]*q[2][1])
+								 -q[0][1]*(q[1][0]*q[2][2]-q[1][2]*q[2][0])
+								 +q[0][2]*(q[1][0]*q[2][1]-q[1][1]*q[2][0]))/6.0;
+		};
+		
+		for (int j = 0; j < nn[1]-1; j++)
+			for (int k = 0; k < nn[2]-1; k++) {
+				for (corner = 0; corner < 8; corner++) {
+					node[corner][0] = i+(corner&1);
+					node[corner][1] = j+((corner>>1)&1);
+					node[corner][2] = k+((corner>>2)&1);
+					f[corner] = value(node[corner][0], node[corner][1], node[corner][2]);
+				}
+				
+				for (int s = 0; s < 6; s++) {
+					const int* tet = isoTetrahedra[s];
+					int count = 0;
+					for (int m = 0; m < 4; m++)
+						count += above[m] = f[tet[m]] > dose;
+					if (count == 0 || count == 4)
+						continue;
+					
+					// d points from the corners above the dose to those below it
+					for (int a = 0; a < 3; a++) {
+						double upSum = 0, downSum = 0;
+						for (int m = 0; m < 4; m++) {
+							if (above[m])
+								upSum += pos[a][node[tet[m]][a]];
+							else
+								downSum += pos[a][node[tet[m]][a]];
+						}
+						d[a] = downSum/double(4-count)-upSum/double(count);
+					}
+					
+					if (count == 1 || count == 3) {
+						// One corner on its own side, cut off by a single triangle
+						int lone = 0;
+						while (above[lone] != (count == 1))
+							lone++;
+						for (int m = 0, e = 0; m < 4; m++)
+							if (m != lone) {
+								tri[e] = lone < m ? vertex(lone, m, tet, q[e]) : vertex(m, lone, tet, q[e]);
+								e++;
+							}
+						triangle(tri[0], tri[1], tri[2]);
+					}
+					else {
+						// Two corners on each side, cut by a quadrilateral a0-b0, a0-b1, a1-b1, a1-b0
+						int up[2], down[2], nu = 0, nd = 0, quad[4];
+						double r[4][3];
+						for (int m = 0; m < 4; m++) {
+							if (above[m])
+								up[nu++] = m;
+							else
+								down[nd++] = m;
+						}
+						int ends[4][2] = {{up[0], down[0]}, {up[0], down[1]}, {up[1], down[1]}, {up[1], down[0]}};
+						for (int e = 0; e < 4; e++) {
+							int u = qMin(ends[e][0], ends[e][1]), v = qMax(ends[e][0], ends[e][1]);
+							quad[e] = vertex(u, v, tet, r[e]);
+						}
+						
+						for (int a = 0; a < 3; a++)
+							q[0][a] = r[0][a], q[1][a] = r[1][a], q[2][a] = r[2][a];
+						triangle(quad[0], quad[1], quad[2]);
+						for (int a = 0; a < 3; a++)
+							q[0][a] = r[0][a], q[1][a] = r[2][a], q[2][a] = r[3][a];
+						triangle(quad[0], quad[2], quad[3]);
+					}
 				}
 			}
+	});
+	
+	// Merge the layers, vertices on the faces between them are shared
+	QHash <qint64, int> global;
+	QHash <qint64, int>::const_iterator found;
+	QVector <int> remap;
+	for (int i = 0; i < layers.size(); i++) {
+		const layerMesh &layer = layers[i];
+		remap.resize(layer.keys.size());
+		for (int v = 0; v < layer.keys.size(); v++) {
+			found = global.constFind(layer.keys[v]);
+			if (found != global.constEnd())
+				remap[v] = found.value();
+			else {
+				remap[v] = mesh->vertices.size();
+				global.insert(layer.keys[v], remap[v]);
+				mesh->vertices.append(layer.vertices[v]);
+			}
 		}
+		
+		for (int t = 0; t < layer.triangles.size(); t++)
+			mesh->triangles.append(remap[layer.triangles[t]]);
+		mesh->volume += layer.volume;
 	}
+}
+
+int isoSurface::writePLY(QString path) const {
+	QFile file(path);
+	if (!file.open(QIODevice::WriteOnly))
+		return 1;
+	
+	QString header = QString("ply\nformat binary_little_endian 1.0\n")
+				   + "comment isodose surface of "+QString::number(dose)+" Gy, units of cm\n"
+				   + "element vertex "+QString::number(vertices.size())+"\n"
+				   + "property float x\nproperty float y\nproperty float z\n"
+				   + "element face "+QString::number(triangles.size()/3)+"\n"
+				   + "property list uchar int vertex_indices\nend_header\n";
+	file.write(header.toLatin1());
+	
+	QDataStream out(&file);
+	out.setByteOrder(QDataStream::LittleEndian);
+	out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+	for (int v = 0; v < vertices.size(); v++)
+		out << float(vertices[v].x()) << float(vertices[v].y()) << float(vertices[v].z());
+	for (int t = 0; t < triangles.size(); t += 3)
+		out << quint8(3) << qint32(triangles[t]) << qint32(triangles[t+1]) << qint32(triangles[t+2]);
 	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	std::sort(data->begin(), data->end(), DV_sorter);
+	file.close();
+	return 0;
 }
 
-void Dose::getDV(QVector <DV> *data, EGSPhant* mask, double* volume, int n) {
-    double increment = 95.0/double(n)/double(z);
-	double xVal, yVal, zVal;
-	double xLen, yLen, zLen;
-	double vol = (*volume) = 0;
-	data->clear();
-    for (int k = 0; k < z; k++) {
-		zVal = (cz[k]+cz[k+1])/2.0;
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yVal = (cy[j]+cy[j+1])/2.0;
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				xVal = (cx[i]+cx[i+1])/2.0;
-				if (mask->getMedia(xVal, yVal, zVal) == 50) {
-					xLen = (cx[i+1]-cx[i]);
-					vol = xLen*yLen*zLen;
-					(*volume) += vol;
-					data->append({val[i][j][k], err[i][j][k], vol});
-				}
-			}
-		}
+int isoSurface::writeSTL(QString path) const {
+	QFile file(path);
+	if (!file.open(QIODevice::WriteOnly))
+		return 1;
+	
+	QByteArray header = (QString("isodose surface of ")+QString::number(dose)+" Gy, units of cm").toLatin1();
+	header = header.leftJustified(80, '\0', true);
+	file.write(header);
+	
+	QDataStream out(&file);
+	out.setByteOrder(QDataStream::LittleEndian);
+	out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+	out << quint32(triangles.size()/3);
+	
+	QVector3D a, b, c, n;
+	for (int t = 0; t < triangles.size(); t += 3) {
+		a = vertices[triangles[t]];
+		b = vertices[triangles[t+1]];
+		c = vertices[triangles[t+2]];
+		n = QVector3D::normal(a, b, c);
+		out << n.x() << n.y() << n.z() << a.x() << a.y() << a.z()
+			<< b.x() << b.y() << b.z() << c.x() << c.y() << c.z() << quint16(0);
 	}
 	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	std::sort(data->begin(), data->end(), DV_sorter);
+	file.close();
+	return 0;
 }
 
-void Dose::getDV(QVector <DV> *data, EGSPhant* media, QString allowedChars, EGSPhant* mask, double* volume, int n) {
-    double increment = 95.0/double(n)/double(z);
-	double xVal, yVal, zVal;
-	double xLen, yLen, zLen;
-	double vol = (*volume) = 0;
-	data->clear();
-    for (int k = 0; k < z; k++) {
-		zVal = (cz[k]+cz[k+1])/2.0;
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yVal = (cy[j]+cy[j+1])/2.0;
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				xVal = (cx[i]+cx[i+1])/2.0;
-				if (allowedChars.contains(media->getMedia(xVal, yVal, zVal)) &&
-					mask->getMedia(xVal, yVal, zVal) == 50) {
-					xLen = (cx[i+1]-cx[i]);
-					vol = xLen*yLen*zLen;
-					(*volume) += vol;
-					data->append({val[i][j][k], err[i][j][k], vol});
-				}
-			}
-		}
-	}
+// Tables of the voxels sampled by each pixel of an image sliced through axis at
+// d, found with the same convention as getDose
+void Dose::getSliceMap(sliceMap* map, Axis axis, double ai, double af,
+                       double bi, double bf, double d, int res) {
+	Axis hAxis = axis == X_AXIS ? Y_AXIS : X_AXIS, wAxis = axis == Z_AXIS ? Y_AXIS : Z_AXIS;
+	int width  = (af-ai)*res; // Reversed on the image
+	int height = (bf-bi)*res; // Reversed on the image
+	double inc = 1/double(res);
 	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	std::sort(data->begin(), data->end(), DV_sorter);
+	map->axis  = axis;
+	map->depth = getIndex(axis, d);
+	map->nh = hAxis == X_AXIS ? x : y;
+	map->nw = wAxis == Y_AXIS ? y : z;
+	
+	map->h.resize(height);
+	for (int i = 0; i < height; i++)
+		map->h[i] = getIndex(hAxis, (double(bi)) + inc * double(i));
+	map->w.resize(width);
+	for (int j = 0; j < width; j++)
+		map->w[j] = getIndex(wAxis, (double(ai)) + inc * double(j));
 }
 
-void Dose::getDV(QVector <DV> *data, double* volume, double minDose, double maxDose, int n) {
-	if (minDose >= maxDose)
-		maxDose = std::numeric_limits<double>::max(); // Set maxDose to max possible dose
-    double increment = 95.0/double(n)/double(z);
-	double xLen, yLen, zLen;
-	double vol = (*volume) = 0;
-	data->clear();
-    for (int k = 0; k < z; k++) {
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				if (minDose <= val[i][j][k] && val[i][j][k] <= maxDose) {
-					xLen = (cx[i+1]-cx[i]);
-					vol = xLen*yLen*zLen;
-					(*volume) += vol;
-					data->append({val[i][j][k], err[i][j][k], vol});
-				}
-			}
+QImage Dose::getColourMap(Axis axis, double ai, double af, double bi, double bf, double d, int res,
+						  double di, double df, QColor min, QColor mid, QColor max) {
+	sliceMap map;
+	getSliceMap(&map, axis, ai, af, bi, bf, d, res);
+	
+	// Blend from min to mid to max over [di, df] in COLOUR_RAMP_STEPS steps,
+	// doses outside of it being clamped onto its ends
+	QVector <QRgb> ramp(COLOUR_RAMP_STEPS);
+	double c = (df+di)/2.0, dose, weight, invWeight;
+	double red, green, blue;
+	for (int n = 0; n < COLOUR_RAMP_STEPS; n++) {
+		dose = di+(df-di)*double(n)/double(COLOUR_RAMP_STEPS-1);
+		if (dose < c) {
+			weight    = (dose-di)/(c-di);
+			invWeight = 1.0-weight;
+			
+			red   = (mid.red()  * weight) + (min.red()  * invWeight);
+			green = (mid.green()* weight) + (min.green()* invWeight);
+			blue  = (mid.blue() * weight) + (min.blue() * invWeight);
+		}
+		else {
+			weight    = (df-dose)/(df-c);
+			invWeight = 1.0-weight;
+			
+			red   = (mid.red()  * weight) + (max.red()  * invWeight);
+			green = (mid.green()* weight) + (max.green()* invWeight);
+			blue  = (mid.blue() * weight) + (max.blue() * invWeight);
+		}
+		
+		// Rescale to max brightness
+		weight = red>blue?red:blue;
+		weight = weight>green?weight:green;
+		weight = 255.0/weight;
+		
+		ramp[n] = qRgb(red*weight,green*weight,blue*weight);
+	}
+	
+	// Quantize the slice onto the ramp, unless it is already cached, so new
+	// colours only need the gather below
+	bool cached = levelLock.tryLock();
+	QVector <quint16> local;
+	QVector <quint16> &levels = cached ? levelCache.levels : local;
+	if (!cached || levels.isEmpty() || levelCache.axis != axis || levelCache.depth != map.depth ||
+		levelCache.di != di || levelCache.df != df) {
+		double scale = df > di ? double(COLOUR_RAMP_STEPS-1)/(df-di) : 0;
+		
+		// The voxels are only read through const references from the tasks
+		const QVector <QVector <QVector <double> > > &cVal = val;
+		slicePlane(&levels, map, [&](int i, int j, int k) {
+			double q = (cVal[i][j][k]-di)*scale+0.5;
+			return quint16(q < 0 ? 0 : (q > COLOUR_RAMP_STEPS-1 ? COLOUR_RAMP_STEPS-1 : q));
+		});
+		
+		if (cached) {
+			levelCache.axis  = axis;
+			levelCache.depth = map.depth;
+			levelCache.di    = di;
+			levelCache.df    = df;
 		}
 	}
 	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	std::sort(data->begin(), data->end(), DV_sorter);
+	QVector <QRgb> plane(levels.size());
+	if (map.depth >= 0) {
+		const quint16* q = levels.constData();
+		const QRgb* r = ramp.constData();
+		QRgb* p = plane.data();
+		for (int n = 0; n < plane.size(); n++)
+			p[n] = r[q[n]];
+	}
+	
+	if (cached)
+		levelLock.unlock();
+	
+	return paintSlice(map, plane, ramp[0]); // Outside of the dose reads as -1, clamped to di
 }
 
-void Dose::getDV(QVector <DV> *data, EGSPhant* media, QString allowedChars, double* volume, double minDose, double maxDose, int n) {
-	if (minDose >= maxDose)
-		maxDose = std::numeric_limits<double>::max(); // Set maxDose to max possible dose
-    double increment = 95.0/double(n)/double(z);
-	double xVal, yVal, zVal;
-	double xLen, yLen, zLen;
-	double vol = (*volume) = 0;
-	data->clear();
-    for (int k = 0; k < z; k++) {
-		zVal = (cz[k]+cz[k+1])/2.0;
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yVal = (cy[j]+cy[j+1])/2.0;
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				if (minDose <= val[i][j][k] && val[i][j][k] <= maxDose) {
-				xVal = (cx[i]+cx[i+1])/2.0;
-					if (allowedChars.contains(media->getMedia(xVal, yVal, zVal))) {
-						xLen = (cx[i+1]-cx[i]);
-						vol = xLen*yLen*zLen;
-						(*volume) += vol;
-						data->append({val[i][j][k], err[i][j][k], vol});
-					}
-				}
-			}
-		}
+void Dose::getGridMap(gridMap *map, EGSPhant* phant) {
+	// Identical grids map every voxel onto itself
+	map->identical = (x == phant->nx && y == phant->ny && z == phant->nz &&
+					  cx == phant->x && cy == phant->y && cz == phant->z);
+	
+	mapAxis(&map->xi, cx, phant->x, map->identical);
+	mapAxis(&map->yi, cy, phant->y, map->identical);
+	mapAxis(&map->zi, cz, phant->z, map->identical);
+}
+
+void Dose::mapAxis(QVector <int> *index, const QVector <double> &dose, const QVector <double> &phant, bool identical) {
+	int n = dose.size()-1;
+	index->resize(n);
+	
+	if (identical) {
+		for (int i = 0; i < n; i++)
+			(*index)[i] = i;
+		return;
 	}
 	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	std::sort(data->begin(), data->end(), DV_sorter);
+	// Same rules as EGSPhant::getMedia, the voxel whose upper boundary is the first
+	// one at or above the centre, and -1 outside of the phantom
+	double mid;
+	for (int i = 0; i < n; i++) {
+		mid = (dose[i]+dose[i+1])/2.0;
+		if (mid < phant.first() || mid > phant.last())
+			(*index)[i] = -1;
+		else
+			(*index)[i] = std::lower_bound(phant.begin()+1, phant.end(), mid)-(phant.begin()+1);
+	}
 }
 
-void Dose::getDV(QVector <DV> *data, EGSPhant* mask, double* volume, double minDose, double maxDose, int n) {
-	if (minDose >= maxDose)
-		maxDose = std::numeric_limits<double>::max(); // Set maxDose to max possible dose
-    double increment = 95.0/double(n)/double(z);
-	double xVal, yVal, zVal;
-	double xLen, yLen, zLen;
-	double vol = (*volume) = 0;
-	data->clear();
-    for (int k = 0; k < z; k++) {
-		zVal = (cz[k]+cz[k+1])/2.0;
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yVal = (cy[j]+cy[j+1])/2.0;
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				if (minDose <= val[i][j][k] && val[i][j][k] <= maxDose) {
-					xVal = (cx[i]+cx[i+1])/2.0;
-					if (mask->getMedia(xVal, yVal, zVal) == 50) {
-						xLen = (cx[i+1]-cx[i]);
-						vol = xLen*yLen*zLen;
-						(*volume) += vol;
-						data->append({val[i][j][k], err[i][j][k], vol});
-					}
-				}
-			}
-		}
+void Dose::getDV(QVector <DV> *data, DVFilter filter, double* volume, int n, bool sorted) {
+	if (filter.window && filter.minDose >= filter.maxDose)
+		filter.maxDose = std::numeric_limits<double>::max(); // Set maxDose to max possible dose
+	
+	// Build each filter in use once, then hand the combination to its own kernel
+	mediaFilter medF;
+	maskFilter maskF;
+	windowFilter winF = {filter.minDose, filter.maxDose};
+	if (filter.media)
+		medF.setup(this, filter.media, filter.allowedChars);
+	if (filter.mask)
+		maskF.setup(this, filter.mask);
+	
+	switch ((filter.mask?1:0) + (filter.media?2:0) + (filter.window?4:0)) {
+		case 1: // Mask with no media
+			filterDV(data, maskF, volume, n, sorted);
+			break;
+		case 2: // Media with no mask
+			filterDV(data, medF, volume, n, sorted);
+			break;
+		case 3: // Media and mask
+			filterDV(data, andFilter<mediaFilter, maskFilter>(medF, maskF), volume, n, sorted);
+			break;
+		case 4: // Dose ranges
+			filterDV(data, winF, volume, n, sorted);
+			break;
+		case 5: // Mask with no media and dose ranges
+			filterDV(data, andFilter<maskFilter, windowFilter>(maskF, winF), volume, n, sorted);
+			break;
+		case 6: // Media with no mask and dose ranges
+			filterDV(data, andFilter<mediaFilter, windowFilter>(medF, winF), volume, n, sorted);
+			break;
+		case 7: // Media and mask and dose ranges
+			filterDV(data, andFilter<andFilter<mediaFilter, maskFilter>, windowFilter>
+					 (andFilter<mediaFilter, maskFilter>(medF, maskF), winF), volume, n, sorted);
+			break;
+		default: // #nofilter #nomakeup
+			filterDV(data, noFilter(), volume, n, sorted);
+			break;
 	}
+}
+
+void mediaFilter::setup(Dose* dose, EGSPhant* phant, QString allowedChars) {
+	dose->getGridMap(&map, phant);
+	media = phant;
 	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	std::sort(data->begin(), data->end(), DV_sorter);
+	// 256 entry lookup of the media characters to keep
+	for (int c = 0; c < 256; c++)
+		allowed[c] = false;
+	QByteArray chars = allowedChars.toLatin1();
+	for (int c = 0; c < chars.size(); c++)
+		allowed[(unsigned char)chars[c]] = true;
 }
 
-void Dose::getDV(QVector <DV> *data, EGSPhant* media, QString allowedChars, EGSPhant* mask, double* volume, double minDose, double maxDose, int n) {
-	if (minDose >= maxDose)
-		maxDose = std::numeric_limits<double>::max(); // Set maxDose to max possible dose
-    double increment = 95.0/double(n)/double(z);
-	double xVal, yVal, zVal;
-	double xLen, yLen, zLen;
-	double vol = (*volume) = 0;
-	data->clear();
-    for (int k = 0; k < z; k++) {
-		zVal = (cz[k]+cz[k+1])/2.0;
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yVal = (cy[j]+cy[j+1])/2.0;
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				if (minDose <= val[i][j][k] && val[i][j][k] <= maxDose) {
-					xVal = (cx[i]+cx[i+1])/2.0;
-					if (allowedChars.contains(media->getMedia(xVal, yVal, zVal)) &&
-						mask->getMedia(xVal, yVal, zVal) == 50) {
-						xLen = (cx[i+1]-cx[i]);
-						vol = xLen*yLen*zLen;
-						(*volume) += vol;
-						data->append({val[i][j][k], err[i][j][k], vol});
-					}
-				}
-			}
+void maskFilter::setup(Dose* dose, EGSPhant* phant) {
+	gridMap map;
+	dose->getGridMap(&map, phant);
+	nx = dose->x;
+	nxy = dose->x*dose->y;
+	
+	// Flag every dose voxel whose centre is within the mask, indexed i+j*nx+k*nx*ny
+	inside.fill(false, nxy*dose->z);
+	for (int k = 0; k < dose->z; k++) {
+		if (map.zi[k] < 0)
+			continue;
+		for (int j = 0; j < dose->y; j++) {
+			if (map.yi[j] < 0)
+				continue;
+			for (int i = 0; i < dose->x; i++)
+				if (map.xi[i] >= 0 && phant->m[map.xi[i]][map.yi[j]][map.zi[k]] == 50)
+					inside.setBit(i+j*nx+k*nxy);
 		}
 	}
-	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	std::sort(data->begin(), data->end(), DV_sorter);
 }
 
-void Dose::getDVs(QVector <QVector <DV> > *data, QVector <EGSPhant*> *masks, QVector <double> *volume) {
-	if (data->size() != masks->size() && data->size() != volume->size())
+void Dose::getDVs(QVector <QVector <DV> > *data, QVector <EGSPhant*> *masks, QVector <double> *volume, bool sorted) {
+	if (data->size() != masks->size() || data->size() != volume->size())
 		return; // Quit if mask and data array size do not align
 	
-	double increment = 75.0/double(data->size())/double(z);
-	double xVal, yVal, zVal;
-	double xLen, yLen, zLen;
-	double vol;
+	int maskNum = masks->size(), words = (maskNum+63)/64;
 	
-	for (int i = 0; i < volume->size(); i++) {
-		(*volume)[i] = 0;
-		(*data)[i].clear();
+	// Masks made together share a grid, so only map each distinct grid once
+	QVector <gridMap> maskMap(maskNum);
+	for (int n = 0; n < maskNum; n++) {
+		if (n > 0 && (*masks)[n]->x == (*masks)[n-1]->x && (*masks)[n]->y == (*masks)[n-1]->y &&
+			(*masks)[n]->z == (*masks)[n-1]->z)
+			maskMap[n] = maskMap[n-1];
+		else
+			getGridMap(&maskMap[n], (*masks)[n]);
 	}
 	
-    for (int k = 0; k < z; k++) {
-		zVal = (cz[k]+cz[k+1])/2.0;
-		zLen = (cz[k+1]-cz[k]);
-		emit madeProgress(increment); // Update progress bar
-        for (int j = 0; j < y; j++) {
-			yVal = (cy[j]+cy[j+1])/2.0;
-			yLen = (cy[j+1]-cy[j]);
-            for (int i = 0; i < x; i++) {
-				xVal = (cx[i]+cx[i+1])/2.0;
-				xLen = (cx[i+1]-cx[i]);
+	// Each slice of the dose is its own task, it first packs the structures holding each
+	// voxel into a bit array (bit n of voxel i,j for mask n), then visits every voxel once
+	// and hands it to all of its structures
+	QVector <int> slices(z);
+	for (int k = 0; k < z; k++)
+		slices[k] = k;
+	QVector <QVector <QVector <DV> > > sliceData(z, QVector <QVector <DV> > (maskNum));
+	QVector <QVector <double> > sliceVol(z, QVector <double> (maskNum, 0));
+	QVector <QVector <DV> >* sliceOut = sliceData.data();
+	QVector <double>* sliceVolOut = sliceVol.data();
+	
+	// Everything shared between the tasks is only read through const references
+	const QVector <gridMap> &cMap = maskMap;
+	const QVector <EGSPhant*> &cMasks = *masks;
+	const QVector <QVector <QVector <double> > > &cVal = val, &cErr = err;
+	const QVector <double> &xB = cx, &yB = cy, &zB = cz;
+	
+	QtConcurrent::blockingMap(slices, [&](int &k) {
+		QVector <quint64> labels(x*y*words, 0);
+		quint64* label = labels.data();
+		double xLen, yLen, zLen = zB[k+1]-zB[k], vol;
+		quint64 bits;
+		
+		for (int n = 0; n < maskNum; n++) {
+			const gridMap &map = cMap[n];
+			const QVector <QVector <QVector <char> > > &m = cMasks[n]->m;
+			if (map.zi[k] < 0)
+				continue;
+			for (int j = 0; j < y; j++) {
+				if (map.yi[j] < 0)
+					continue;
+				for (int i = 0; i < x; i++)
+					if (map.xi[i] >= 0 && m[map.xi[i]][map.yi[j]][map.zi[k]] == 50)
+						label[(i+j*x)*words+n/64] |= quint64(1) << (n%64);
+			}
+		}
+		
+		QVector <QVector <DV> > &out = sliceOut[k];
+		QVector <double> &outVol = sliceVolOut[k];
+		for (int j = 0; j < y; j++) {
+			yLen = yB[j+1]-yB[j];
+			for (int i = 0; i < x; i++) {
+				xLen = xB[i+1]-xB[i];
 				vol = xLen*yLen*zLen;
-				for (int n = 0; n < masks->size(); n++) {
-					if ((*masks)[n]->getMedia(xVal, yVal, zVal) == 50) {
-						(*volume)[n] += vol;
-						(*data)[n].append({val[i][j][k], err[i][j][k], vol});
-					}
+				for (int w = 0; w < words; w++) {
+					bits = label[(i+j*x)*words+w];
+					for (int n = w*64; bits; n++, bits >>= 1)
+						if (bits & 1) {
+							outVol[n] += vol;
+							out[n].append({cVal[i][j][k], cErr[i][j][k], vol});
+						}
 				}
 			}
 		}
+	});
+	emit madeProgress(75.0); // Update progress bar
+	
+	// Join the slices in order
+	int size;
+	for (int n = 0; n < maskNum; n++) {
+		(*volume)[n] = 0;
+		(*data)[n].clear();
+		size = 0;
+		for (int k = 0; k < z; k++)
+			size += sliceData[k][n].size();
+		(*data)[n].reserve(size);
+		for (int k = 0; k < z; k++) {
+			(*volume)[n] += sliceVol[k][n];
+			(*data)[n] += sliceData[k][n];
+			sliceData[k][n].clear();
+		}
 	}
 	
-	emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
-	for (int i = 0; i < data->size(); i++)
-		std::sort((*data)[i].begin(), (*data)[i].end(), DV_sorter);
+	if (sorted) {
+		emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
+		for (int i = 0; i < data->size(); i++)
+			sortDV(&(*data)[i]);
+	}
 }
 
 QString Dose::getMetricCSV(QVector <DV> *data, double volume, QString name, QString DxStr, QString DccStr, QString VxStr, QString pDStr) {
-	QString names, units, average, uncertainty, voxels, volumes, minimum, maximum;
-	QStringList Dx, Vx, Dcc, temp;
+	QStringList temp, value, uncertainty;
 	QVector <double> xD, xV, ccD;
-	double pD, minD = 1000000000, maxD = 0, minE = 0, maxE = 0;
+	double pD;
 	
 	QString text = "";
 	
 	if (DxStr.length()) {
 		temp = DxStr.replace(' ',',').split(',');
-		for (int i = 0; i < temp.size(); i++) {
+		for (int i = 0; i < temp.size(); i++)
 			xD.append(temp[i].toDouble());
-			Dx.append("");
-		}
 		std::sort(xD.begin(), xD.end());
 	}
 	
 	if (VxStr.length()) {
 		temp = VxStr.replace(' ',',').split(',');
-		for (int i = 0; i < temp.size(); i++) {
+		for (int i = 0; i < temp.size(); i++)
 			xV.append(temp[i].toDouble());
-			Vx.append("");
-		}
 		std::sort(xV.begin(), xV.end());
 	}
 	
 	if (DccStr.length()) {
 		temp = DccStr.replace(' ',',').split(',');
-		for (int i = 0; i < temp.size(); i++) {
+		for (int i = 0; i < temp.size(); i++)
 			ccD.append(temp[i].toDouble());
-			Dcc.append("");
-		}
 		std::sort(ccD.begin(), ccD.end());
 	}
 	
 	pD = pDStr.toDouble();
 	
 	// Generate metric data
-	double volumeTally = 0, doseTally = 0, doseTallyErr = 0, doseTallyErr2 = 0, countTally = 0, absError = 0;
-	int vIndex = 0, dIndex = xD.size()-1, ccIndex = ccD.size()-1;
-	for (int j = 0; j < data->size(); j++) {
-		countTally    += 1.0;
-		volumeTally   += data->at(j).vol;
-		doseTally     += data->at(j).dose;
-		absError       = data->at(j).dose*data->at(j).err;
-		doseTallyErr  += absError;
-		doseTallyErr2 += absError*absError;
-		maxE = maxD<data->at(j).dose?absError:maxE;
-		maxD = maxD<data->at(j).dose?data->at(j).dose:maxD;
-		minE = minD>data->at(j).dose?absError:minE;
-		minD = minD>data->at(j).dose?data->at(j).dose:minD;
-		
-		// Append Vx values as we go
-		if (vIndex < xV.size()) {
-			if (data->at(j).dose > (xV[vIndex]*pD/100.0) && j) {
-				Vx[vIndex] += QString::number(volume-volumeTally+data->at(j).vol)+",,";
-				vIndex++;
-			}
-		}
-		
-		// Append Dx values as we go
-		if (dIndex >= 0) {
-			if ((volume-volumeTally)/volume*100.0 < xD[dIndex] && j) {
-				Dx[dIndex] += QString::number(data->at(j-1).dose)+","+QString::number(data->at(j-1).dose*data->at(j-1).err)+",";
-				dIndex--;
-			}
+	DVH dvh;
+	dvh.build(data, volume);
+	dvh.getMetrics(xD, ccD, xV, pD, &value, &uncertainty);
+	
+	QStringList rows;
+	rows << "Max dose / Gy," << "Min dose / Gy," << "Average dose / Gy," << "Average uncertainty / Gy,"
+		 << "Number of voxels," << "Total volume / cm^3,";
+	for (int i = 0; i < xD.size(); i++)
+		rows << QString("D")+QString::number(xD[i])+" (%) / Gy,";
+	for (int i = 0; i < ccD.size(); i++)
+		rows << QString("D")+QString::number(ccD[i])+" (cc) / Gy,";
+	for (int i = 0; i < xV.size(); i++)
+		rows << QString("V")+QString::number(xV[i])+" / cm^3,";
+	
+	text        += QString("Dataset,")+name+",,\n";
+	text        += QString(",")+"value,uncertainty,\n";
+	for (int i = 0; i < rows.size(); i++)
+		text += rows[i]+value[i]+","+uncertainty[i]+",\n";
+	
+	return text;
+}
+
+DVHist::DVHist(QVector <DV> *d, double v, int bins) {
+	data = d;
+	volume = v;
+	minDose = maxDose = 0;
+	if (data->size()) {
+		minDose = maxDose = data->at(0).dose;
+		for (int i = 1; i < data->size(); i++) {
+			minDose = minDose>data->at(i).dose?data->at(i).dose:minDose;
+			maxDose = maxDose<data->at(i).dose?data->at(i).dose:maxDose;
 		}
+	}
+	width = (maxDose-minDose)/double(bins);
+	
+	// Count the voxels and volume in each bin
+	start.fill(0, bins+1);
+	binVol.fill(0, bins);
+	binSorted.fill(false, bins);
+	int b;
+	for (int i = 0; i < data->size(); i++) {
+		b = binOf(data->at(i).dose);
+		start[b+1]++;
+		binVol[b] += data->at(i).vol;
+	}
+	for (b = 0; b < bins; b++)
+		start[b+1] += start[b];
+	
+	// Then regroup the data by bin (a counting sort on bins)
+	QVector <int> next(start);
+	QVector <DV> grouped(data->size());
+	for (int i = 0; i < data->size(); i++)
+		grouped[next[binOf(data->at(i).dose)]++] = data->at(i);
+	data->swap(grouped);
+}
+
+int DVHist::binOf(double dose) {
+	if (width <= 0)
+		return 0;
+	int b = int((dose-minDose)/width);
+	return b<0?0:(b>=binVol.size()?binVol.size()-1:b);
+}
+
+const DV& DVHist::at(int n) {
+	int b = std::upper_bound(start.begin(), start.end(), n)-start.begin()-1;
+	if (!binSorted[b]) {
+		std::sort(data->begin()+start[b], data->begin()+start[b+1], DV_sorter);
+		binSorted[b] = true;
+	}
+	return data->at(n);
+}
+
+void DVHist::cumulative(QList <QPointF> *line, int points) {
+	line->clear();
+	line->append(QPointF(0, 100.0));
+	if (data->isEmpty())
+		return;
+	
+	// Volume at or above the lower edge of every step-th bin
+	int step = binVol.size()/points;
+	step = step<1?1:step;
+	double below = 0;
+	for (int b = 0; b < binVol.size(); b++) {
+		if (!(b%step) && start[b] < start[b+1])
+			line->append(QPointF(minDose+width*b, 100.0*(volume-below)/volume));
+		below += binVol[b];
+	}
+	
+	// End on the highest dose voxel
+	line->append(QPointF(maxDose, 100.0*at(data->size()-1).vol/volume));
+}
+
+void DVHist::differential(QVector <int> *counts, int count) {
+	counts->fill(0, count);
+	double inc = (maxDose-minDose)/double(count);
+	int b;
+	for (int i = 0; i < data->size(); i++) {
+		if (inc <= 0 || data->at(i).dose <= minDose)
+			b = 0;
+		else
+			b = int(ceil((data->at(i).dose-minDose)/inc))-1;
+		(*counts)[b<0?0:(b>=count?count-1:b)]++;
+	}
+}
+
+DVH::DVH() {
+	count = 0;
+	volume = sumDose = 0;
+}
+
+void DVH::build(QVector <DV> *data, double v, bool sorted) {
+	if (!sorted)
+		sortDV(data);
+	
+	count = data->size();
+	volume = v;
+	sumDose = 0;
+	dose.resize(count);
+	err.resize(count);
+	cumVol.resize(count);
+	cumErr.resize(count);
+	cumErr2.resize(count);
+	
+	double vol = 0, e = 0, e2 = 0, absErr;
+	for (int i = 0; i < count; i++) {
+		absErr   = data->at(i).dose*data->at(i).err;
+		dose[i]  = data->at(i).dose;
+		err[i]   = absErr;
+		sumDose += data->at(i).dose;
 		
-		// Append Dcc values as we go
-		if (ccIndex >= 0) {
-			if ((volume-volumeTally) < ccD[ccIndex] && j) {
-				Dcc[ccIndex] += QString::number(data->at(j-1).dose)+","+QString::number(data->at(j-1).dose*data->at(j-1).err)+",";
-				ccIndex--;
-			}
-		}
+		cumVol[i]  = (vol += data->at(i).vol);
+		cumErr[i]  = (e   += absErr);
+		cumErr2[i] = (e2  += absErr*absErr);
+	}
+}
+
+bool DVH::doseAtVolume(double vol, double* d, double* e) {
+	if (count < 2 || vol <= 0)
+		return false;
+	
+	// First voxel whose running volume leaves less than vol after it
+	int j = std::upper_bound(cumVol.begin(), cumVol.end(), volume-vol)-cumVol.begin();
+	j = j<count?j:count-1;
+	j = j>1?j-1:0;
+	
+	*d = dose[j];
+	*e = err[j];
+	return true;
+}
+
+bool DVH::Dx(double percent, double* d, double* e) {
+	return doseAtVolume(percent/100.0*volume, d, e);
+}
+
+bool DVH::Dcc(double cc, double* d, double* e) {
+	return doseAtVolume(cc, d, e);
+}
+
+bool DVH::Vx(double d, double* vol) {
+	int j = std::upper_bound(dose.begin(), dose.end(), d)-dose.begin();
+	if (j >= count)
+		return false;
+	
+	*vol = volume-(j?cumVol[j-1]:0);
+	return true;
+}
+
+bool DVH::minimum(double* d, double* e) {
+	if (!count)
+		return false;
+	*d = dose[0];
+	*e = err[0];
+	return true;
+}
+
+bool DVH::maximum(double* d, double* e) {
+	if (!count)
+		return false;
+	*d = dose[count-1];
+	*e = err[count-1];
+	return true;
+}
+
+bool DVH::average(double* d, double* e, double* eAverage) {
+	if (!count)
+		return false;
+	*d        = sumDose/double(count);
+	*e        = sqrt(cumErr2[count-1]/double(count));
+	*eAverage = cumErr[count-1]/double(count);
+	return true;
+}
+
+void DVH::getMetrics(const QVector <double> &xD, const QVector <double> &ccD, const QVector <double> &xV, double pD,
+					 QStringList* value, QStringList* uncertainty) {
+	double d, e, a;
+	value->clear();
+	uncertainty->clear();
+	
+	if (maximum(&d, &e)) {*value << QString::number(d); *uncertainty << QString::number(e);}
+	else                 {*value << "n/a"; *uncertainty << "n/a";}
+	
+	if (minimum(&d, &e)) {*value << QString::number(d); *uncertainty << QString::number(e);}
+	else                 {*value << "n/a"; *uncertainty << "n/a";}
+	
+	if (average(&d, &e, &a)) {
+		*value << QString::number(d) << QString::number(a);
+		*uncertainty << QString::number(e) << "";
+	}
+	else {
+		*value << "n/a" << "n/a";
+		*uncertainty << "n/a" << "";
 	}
 	
-	for (int j = vIndex; j < xV.size(); j++) 
-		Vx[j] += "n/a,n/a,";
+	*value << QString::number(count) << QString::number(volume);
+	*uncertainty << "" << "";
 	
-	for (int j = dIndex; j >= 0; j--) 
-		Dx[j] += "n/a,n/a,";
+	for (int i = 0; i < xD.size(); i++)
+		if (Dx(xD[i], &d, &e)) {*value << QString::number(d); *uncertainty << QString::number(e);}
+		else                   {*value << "n/a"; *uncertainty << "n/a";}
 	
-	for (int j = ccIndex; j >= 0; j--) 
-		Dcc[j] += "n/a,n/a,";
+	for (int i = 0; i < ccD.size(); i++)
+		if (Dcc(ccD[i], &d, &e)) {*value << QString::number(d); *uncertainty << QString::number(e);}
+		else                     {*value << "n/a"; *uncertainty << "n/a";}
 	
-	// Calculate global metrics
-	doseTally     /= countTally; // Average dose
-	doseTallyErr  /= countTally; // Average uncertainty
-	doseTallyErr2 = sqrt(doseTallyErr2/countTally); // Propagated average dose uncertainty
+	for (int i = 0; i < xV.size(); i++)
+		if (Vx(xV[i]*pD/100.0, &d)) {*value << QString::number(d); *uncertainty << "";}
+		else                        {*value << "n/a"; *uncertainty << "n/a";}
+}
+
+// Map a dose onto an unsigned key with the same ordering, flipping the sign bit
+// of positive doses and every bit of negative ones
+static inline quint64 doseKey(double dose) {
+	quint64 bits;
+	memcpy(&bits, &dose, sizeof(bits));
+	return (bits & 0x8000000000000000ULL) ? ~bits : (bits | 0x8000000000000000ULL);
+}
+
+// Sort chunks of data in parallel, then merge neighbouring chunks in parallel
+static void mergeSortDV(QVector <DV> *data, int threads) {
+	int n = data->size();
+	if (n < 4096 || threads < 2) {
+		std::sort(data->begin(), data->end(), DV_sorter);
+		return;
+	}
+	
+	DV* d = data->data();
+	int chunkSize = (n+threads-1)/threads;
+	QVector <int> starts;
+	for (int s = 0; s < n; s += chunkSize)
+		starts << s;
+	
+	QtConcurrent::blockingMap(starts, [&](int &s) {
+		std::sort(d+s, d+qMin(s+chunkSize, n), DV_sorter);
+	});
 	
-	names       = name+",,";
-	units       = "value,uncertainty,";
-	minimum     = QString::number(minD)+","+QString::number(minE)+",";
-	maximum     = QString::number(maxD)+","+QString::number(maxE)+",";
-	average     = QString::number(doseTally)+","+QString::number(doseTallyErr2)+",";
-	uncertainty = QString::number(doseTallyErr)+",,";
-	voxels      = QString::number(countTally)+",,";
-	volumes     = QString::number(volume)+",,";
+	for (int width = chunkSize; width < n; width *= 2) {
+		starts.clear();
+		for (int s = 0; s+width < n; s += 2*width)
+			starts << s;
+		
+		QtConcurrent::blockingMap(starts, [&](int &s) {
+			std::inplace_merge(d+s, d+s+width, d+qMin(s+2*width, n), DV_sorter);
+		});
+	}
+}
+
+void sortDV(QVector <DV> *data) {
+	int n = data->size();
+	int threads = QThread::idealThreadCount();
+	threads = threads<1?1:threads;
 	
-	text        += QString("Dataset,")+names+"\n";
-	text        += QString(",")+units+"\n";
-	text        += QString("Max dose / Gy,")+maximum+"\n";
-	text        += QString("Min dose / Gy,")+minimum+"\n";
-	text        += QString("Average dose / Gy,")+average+"\n";
-	text        += QString("Average uncertainty / Gy,")+uncertainty+"\n";
-	text        += QString("Number of voxels,")+voxels+"\n";
-	text        += QString("Total volume / cm^3,")+volumes+"\n";
+	if (n < DV_RADIX_MIN) {
+		mergeSortDV(data, threads);
+		return;
+	}
 	
-	for (int i = 0; i < Dx.size(); i++)
-		text += QString("D")+QString::number(xD[i])+" (%) / Gy,"+Dx[i]+"\n";
+	// Sort (key, index) pairs rather than moving whole DV records on every pass
+	struct DVKey {
+		quint64 key;
+		int index;
+	};
+	QVector <DVKey> keys(n), temp(n);
+	DVKey *src = keys.data(), *dst = temp.data();
+	const DV* d = data->constData();
 	
-	for (int i = 0; i < Dcc.size(); i++)
-		text += QString("D")+QString::number(ccD[i])+" (cc) / Gy,"+Dcc[i]+"\n";
+	// Each thread handles its own contiguous chunk, keeping the scatter stable
+	int chunkSize = (n+threads-1)/threads;
+	QVector <int> chunks;
+	for (int c = 0; c*chunkSize < n; c++)
+		chunks << c;
+	int chunkNum = chunks.size();
 	
-	for (int i = 0; i < Vx.size(); i++)
-		text += QString("V")+QString::number(xV[i])+" / cm^3,"+Vx[i]+"\n";
+	QtConcurrent::blockingMap(chunks, [&](int &c) {
+		int end = qMin((c+1)*chunkSize, n);
+		for (int i = c*chunkSize; i < end; i++) {
+			src[i].key = doseKey(d[i].dose);
+			src[i].index = i;
+		}
+	});
 	
-	return text;
+	// LSD radix sort on 8 bit digits, cnt[c*256+b] holds the count of digit b in chunk c
+	QVector <int> count(chunkNum*256);
+	int* cnt = count.data();
+	int sum, total, t;
+	bool trivial;
+	
+	for (int shift = 0; shift < 64; shift += 8) {
+		memset(cnt, 0, sizeof(int)*chunkNum*256);
+		QtConcurrent::blockingMap(chunks, [&](int &c) {
+			int end = qMin((c+1)*chunkSize, n);
+			int* local = cnt+c*256;
+			for (int i = c*chunkSize; i < end; i++)
+				local[(src[i].key >> shift) & 255]++;
+		});
+		
+		// Skip the pass if every key has the same digit (eg. sign and exponent bits)
+		trivial = false;
+		for (int b = 0; b < 256 && !trivial; b++) {
+			total = 0;
+			for (int c = 0; c < chunkNum; c++)
+				total += cnt[c*256+b];
+			trivial = (total == n);
+		}
+		if (trivial)
+			continue;
+		
+		// Turn counts into offsets, ordered by digit then by chunk
+		sum = 0;
+		for (int b = 0; b < 256; b++)
+			for (int c = 0; c < chunkNum; c++) {
+				t = cnt[c*256+b];
+				cnt[c*256+b] = sum;
+				sum += t;
+			}
+		
+		QtConcurrent::blockingMap(chunks, [&](int &c) {
+			int end = qMin((c+1)*chunkSize, n);
+			int* local = cnt+c*256;
+			for (int i = c*chunkSize; i < end; i++)
+				dst[local[(src[i].key >> shift) & 255]++] = src[i];
+		});
+		
+		std::swap(src, dst);
+	}
+	
+	// Finally move every record once into its sorted place
+	QVector <DV> sorted(n);
+	DV* out = sorted.data();
+	QtConcurrent::blockingMap(chunks, [&](int &c) {
+		int end = qMin((c+1)*chunkSize, n);
+		for (int i = c*chunkSize; i < end; i++)
+			out[i] = d[src[i].index];
+	});
+	data->swap(sorted);
 }
 
 // Comparison function for std containers
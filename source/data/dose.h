@@ -41,6 +41,11 @@
 #define DOSE_H
 
 #include "egsphant.h"
+#include <cstring>
+
+#define DV_RADIX_MIN 65536 // Smallest dose arrays sorted with a radix sort rather than a merge sort
+#define DOSE_STATS_BINS 256 // Number of bins in the coarse dose histogram of doseStats
+#define COLOUR_RAMP_STEPS 4096 // Number of colours in the ramp of getColourMap
 
 // This class holds dose, error, and volume for basic histogram construction
 struct DV {
@@ -50,6 +55,168 @@ struct DV {
 };
 
 bool DV_sorter(const DV& a, const DV& b); // Comparison function for std::sort and std::binary_search
+void sortDV(QVector <DV> *data); // Parallel sort of dose data by dose
+
+// This class bins unsorted dose data by dose so that DVH plots are made without
+// sorting the whole array
+class DVHist {
+public:
+	// Regroups data by bin in place, volume is the total volume of data
+	DVHist(QVector <DV> *data, double volume, int bins = 4096);
+	
+	double minDose, maxDose, volume;
+	
+	// Cumulative DVH as % of volume against dose, using at most points points
+	void cumulative(QList <QPointF> *line, int points);
+	
+	// Voxel counts in count equal bins from minDose to maxDose, each bin excludes its lower edge
+	void differential(QVector <int> *counts, int count);
+	
+private:
+	QVector <DV> *data;
+	QVector <int> start; // Bin b holds (*data)[start[b]] to (*data)[start[b+1]-1]
+	QVector <double> binVol; // Volume of each bin
+	QVector <bool> binSorted; // Whether bin b has been sorted yet
+	double width; // Dose width of a bin
+	
+	int binOf(double dose);
+	const DV& at(int n); // Element n of data as if it were fully sorted
+};
+
+// This class holds sorted dose data with running sums of volume, dose and uncertainty,
+// so that every DVH metric is a binary search or a lookup rather than a walk through
+// the data, build it once and query it for as many metrics as needed
+class DVH {
+public:
+	DVH();
+	
+	// Take the dose data (sorted in place first unless already sorted) and its total volume
+	void build(QVector <DV> *data, double volume, bool sorted = false);
+	
+	int count;
+	double volume;
+	
+	// The dose and absolute uncertainty of the voxel before the first one (in sorted order)
+	// with less than vol of volume after it, false if there is none
+	bool doseAtVolume(double vol, double* dose, double* err);
+	bool Dx(double percent, double* dose, double* err); // vol as a % of the total volume
+	bool Dcc(double cc, double* dose, double* err); // vol in cm^3
+	
+	// The volume with a dose greater than dose, false if there is none
+	bool Vx(double dose, double* vol);
+	
+	// Min, max and average doses, all false if there are no doses
+	bool minimum(double* dose, double* err);
+	bool maximum(double* dose, double* err);
+	bool average(double* dose, double* err, double* errAverage); // err is propagated, errAverage the mean uncertainty
+	
+	// All metrics in the order of the metric outputs (max, min, average, average
+	// uncertainty, voxels, volume, then each Dx, Dcc and Vx), as values and uncertainties
+	void getMetrics(const QVector <double> &xD, const QVector <double> &ccD, const QVector <double> &xV, double pD,
+					QStringList* value, QStringList* uncertainty);
+	
+private:
+	QVector <double> dose, err; // Sorted doses and their absolute uncertainties
+	QVector <double> cumVol, cumErr, cumErr2; // Running sums of volume, err and err^2 up to each voxel
+	double sumDose;
+};
+
+// This class maps dose voxels onto the voxels of a phantom, xi[i], yi[j] and zi[k]
+// are the phantom indices containing the centre of dose voxel (i,j,k), or -1 when
+// the centre is outside of the phantom
+struct gridMap {
+    QVector <int> xi, yi, zi;
+    bool identical; // The dose and phantom share the same boundaries
+};
+
+// This class holds the filters to apply when getting dose data, any mix of a set
+// of media within a phantom, a contour mask and a dose range can be used
+struct DVFilter {
+    EGSPhant* media = 0; // Phantom to check media in, 0 for no media filter
+    QString allowedChars; // Media characters to keep
+    EGSPhant* mask = 0; // Mask to check, 0 for no mask filter
+    bool window = false; // Only keep doses within [minDose, maxDose], or above minDose if maxDose <= minDose
+    double minDose = 0, maxDose = 0;
+};
+
+class Dose;
+
+// Filter classes used by Dose::filterDV, each one tells if a whole slice k or row j
+// can be skipped, and whether voxel (i,j,k) with dose val is kept
+struct noFilter {
+    bool slice(int) const {return true;}
+    bool row(int) const {return true;}
+    bool voxel(int, int, int, double) const {return true;}
+};
+
+struct mediaFilter {
+    gridMap map;
+    EGSPhant* media;
+    bool allowed[256];
+	
+    void setup(Dose* dose, EGSPhant* phant, QString allowedChars);
+    bool slice(int k) const {return map.zi[k] >= 0;}
+    bool row(int j) const {return map.yi[j] >= 0;}
+    bool voxel(int i, int j, int k, double) const {
+        return map.xi[i] >= 0 && allowed[(unsigned char)media->m[map.xi[i]][map.yi[j]][map.zi[k]]];
+    }
+};
+
+struct maskFilter {
+    QBitArray inside; // Bitmap of the dose voxels within the mask
+    int nx, nxy;
+	
+    void setup(Dose* dose, EGSPhant* phant);
+    bool slice(int) const {return true;}
+    bool row(int) const {return true;}
+    bool voxel(int i, int j, int k, double) const {return inside.testBit(i+j*nx+k*nxy);}
+};
+
+struct windowFilter {
+    double minDose, maxDose;
+	
+    bool slice(int) const {return true;}
+    bool row(int) const {return true;}
+    bool voxel(int, int, int, double val) const {return (minDose <= val) & (val <= maxDose);}
+};
+
+// Keep only the voxels passing both filters, new filters compose with existing ones
+// through this rather than needing their own loop
+template <class A, class B>
+struct andFilter {
+    A a;
+    B b;
+	
+    andFilter(const A &fa, const B &fb) : a(fa), b(fb) {}
+    bool slice(int k) const {return a.slice(k) && b.slice(k);}
+    bool row(int j) const {return a.row(j) && b.row(j);}
+    bool voxel(int i, int j, int k, double val) const {return a.voxel(i, j, k, val) & b.voxel(i, j, k, val);}
+};
+
+// Summary statistics of all the voxels of a dose, computed in one pass and
+// dropped whenever the dose values change
+struct doseStats {
+    bool valid = false;
+    int count = 0; // Number of voxels
+    double max = 0, min = 0;
+    double sum = 0, sum2 = 0; // Sum of doses and of squared doses
+    double integral = 0; // Sum of dose times voxel volume (Gy cm^3)
+    double weightedMean = 0; // Mean weighted by inverse variance, over voxels with nonzero uncertainty
+    QVector <int> histogram; // Voxel counts in DOSE_STATS_BINS equal bins spanning [min, max]
+};
+
+// Triangle mesh of an isodose surface in cm, neighbouring triangles share their
+// vertices and all of them face out of the region above dose
+struct isoSurface {
+    double dose = 0;
+    QVector <QVector3D> vertices;
+    QVector <int> triangles; // Vertex indices, 3 per triangle
+    double volume = 0; // Volume enclosed by the mesh (cm^3)
+	
+    // Save as a binary PLY or STL file, non-zero if the file could not be opened
+    int writePLY(QString path) const;
+    int writeSTL(QString path) const;
+};
 
 class Dose : public QObject {
     Q_OBJECT
@@ -74,6 +241,12 @@ public:
     // value to val and error to err, and return val
     double triInterpol(double xp, double yp, double zp, double *val,
                        double *err);
+	
+    // Interpolate the dose and error of every point (xp[i], yp[i], zp[i]) into
+    // value and error, -1 for points outside of the dose, resolving all cells
+    // first and then accumulating all points at once
+    void triInterpol(const QVector <double> &xp, const QVector <double> &yp, const QVector <double> &zp,
+                     QVector <double> *value, QVector <double> *error);
 
     // Read in a .3ddose file, again with the n to be used by the progress bar
     void readIn(QString path, int n);
@@ -90,7 +263,8 @@ public:
     int strip();
 
     // Returns the index of the coordinate matrix at val
-    int getIndex(QString axis, double val);
+    int getIndex(Axis axis, double val);
+    void prepareLookups(); // Build the axis lookups now, so threads sharing this only read them
 
     // These functions return dose at a point in real space or at an index
     double getDose(double px, double py, double pz);
@@ -101,34 +275,114 @@ public:
     // Returns the max dose of this
     double getMax();
 	
+    // Returns the statistics of this, recomputing them if the dose changed
+    const doseStats &getStats();
+	
+    // Returns the dose below which fraction of the voxels lie, to the
+    // resolution of the stats histogram
+    double getPercentile(double fraction);
+	
     // Scale this by factor
     int scale(double factor);
 
-    // Get isodose points
-    void getContour(QVector <QVector <QLineF> > *con, QVector <double> doses,
-                    QString axis, double depth, double ai, double af,
+    // Get isodose lines as polylines in pixels, (*con)[p] holding those of doses[p],
+    // closed polylines end on their first point
+    void getContour(QVector <QVector <QPolygonF> > *con, QVector <double> doses,
+                    Axis axis, double depth, double ai, double af,
                     double bi, double bf, int res);
-    int interp(int x1, int x2, double y1, double y2, double y0);
 
-	// Get colourmap
-	QImage getColourMap(QString axis, double ai, double af, double bi, double bf, double d, int res,
+	// Get the surface enclosing the doses above dose, it is closed along the
+	// edges of the dose grid by treating everything outside of it as no dose
+	void getIsoSurface(isoSurface* mesh, double dose);
+	
+	// Get the voxels sampled by each pixel of a slice, and the colourmap of that slice
+	void getSliceMap(sliceMap* map, Axis axis, double ai, double af, double bi, double bf, double d, int res);
+	QImage getColourMap(Axis axis, double ai, double af, double bi, double bf, double d, int res,
 						double di, double df, QColor min, QColor mid, QColor max);
 	
-	// Get sorted dose data for making DVH plots and tallying volume, with all possible filter parameters being their own function
-	void getDV(QVector <DV> *data, double* volume, int n = 1);
-	void getDV(QVector <DV> *data, EGSPhant* media, QString allowedChars, double* volume, int n = 1);
-	void getDV(QVector <DV> *data, EGSPhant* mask, double* volume, int n = 1);
-	void getDV(QVector <DV> *data, EGSPhant* media, QString allowedChars, EGSPhant* mask, double* volume, int n = 1);
-	void getDV(QVector <DV> *data, double* volume, double minDose, double maxDose, int n = 1);
-	void getDV(QVector <DV> *data, EGSPhant* media, QString allowedChars, double* volume, double minDose, double maxDose, int n = 1);
-	void getDV(QVector <DV> *data, EGSPhant* mask, double* volume, double minDose, double maxDose, int n = 1);
-	void getDV(QVector <DV> *data, EGSPhant* media, QString allowedChars, EGSPhant* mask, double* volume, double minDose, double maxDose, int n = 1);
+	// Map the voxels of this onto those of phant, so phantom filters are direct array reads
+	void getGridMap(gridMap *map, EGSPhant* phant);
+	void mapAxis(QVector <int> *index, const QVector <double> &dose, const QVector <double> &phant, bool identical);
 	
-	// Get sorted dose data for final metric extraction using masks
-	void getDVs(QVector <QVector <DV> > *data, QVector <EGSPhant*> *masks, QVector <double> *volume);
+	// Get sorted dose data for making DVH plots and tallying volume, keeping only the voxels passing filter
+	// (only sorted when sorted is true, DVHist handles unsorted data)
+	void getDV(QVector <DV> *data, DVFilter filter, double* volume, int n = 1, bool sorted = true);
+	
+	// The kernel behind getDV, Filter is one of the filter classes below or an andFilter of them
+	template <class Filter>
+	void filterDV(QVector <DV> *data, const Filter &filter, double* volume, int n, bool sorted);
+	
+	// Get dose data for final metric extraction using masks, all masks in a single pass
+	void getDVs(QVector <QVector <DV> > *data, QVector <EGSPhant*> *masks, QVector <double> *volume, bool sorted = true);
 	
 	// Generate metric outputs
 	QString getMetricCSV (QVector <DV> *data, double volume, QString name, QString DxStr, QString DccStr, QString VxStr, QString pDStr);
+	
+private:
+	axisLookup lookup[3]; // One per axis, used by getIndex
+	doseStats stats; // Cache behind getStats
+	
+	// Ramp steps of the voxels of the last slice passed through getColourMap, so
+	// that changing only the colours does not read the dose again, concurrent
+	// calls that find it locked work without it
+	QMutex levelLock;
+	struct {
+		Axis axis;
+		int depth;
+		double di, df;
+		QVector <quint16> levels;
+	} levelCache;
+	
+	// Buffers reused by getContour, concurrent calls that find them locked use their own
+	QMutex contourLock;
+	struct contourBuffers {
+		QVector <double> plane; // Doses of the slice, row r and column c at r*nb+c
+		QVector <double> pa, pb; // Pixel positions of the rows and columns
+		QVector <QVector <int> > segments; // Edge pairs crossed by the segments of each dose
+		QVector <int> links; // The (up to 2) segments through each cell edge, -1 if none
+		QVector <char> used; // Segments already stitched into a polyline
+	} contourBuffer;
+	
+	// Join the segments of one dose, as edge pairs, into polylines
+	void stitchContour(contourBuffers &buf, const QVector <int> &segments, int nb, double dose, QVector <QPolygonF> *lines);
+	
+	void computeStats();
+	
+	// Voxels i0 and i1 whose centres bracket p along axis and the weight w1 of
+	// i1, false if p is outside of the dose
+	bool cellWeight(Axis axis, double p, int* i0, int* i1, double* w1);
 };
 
+template <class Filter>
+void Dose::filterDV(QVector <DV> *data, const Filter &filter, double* volume, int n, bool sorted) {
+    double increment = 95.0/double(n)/double(z);
+	double xLen, yLen, zLen;
+	double vol = (*volume) = 0;
+	data->clear();
+    for (int k = 0; k < z; k++) {
+		zLen = (cz[k+1]-cz[k]);
+		emit madeProgress(increment); // Update progress bar
+		if (!filter.slice(k))
+			continue;
+        for (int j = 0; j < y; j++) {
+			yLen = (cy[j+1]-cy[j]);
+			if (!filter.row(j))
+				continue;
+            for (int i = 0; i < x; i++) {
+				if (filter.voxel(i, j, k, val[i][j][k])) {
+					xLen = (cx[i+1]-cx[i]);
+					vol = xLen*yLen*zLen;
+					(*volume) += vol;
+					data->append({val[i][j][k], err[i][j][k], vol});
+				}
+			}
+		}
+	}
+	
+	if (sorted) {
+		emit nameProgress("Sorting (bar does not update)"); // Change progress bar name
+		sortDV(data);
+	}
+}
+
 #endif
@@ -42,39 +42,101 @@ EGSPhant::EGSPhant() {
     nx = ny = nz = 0;
 }
 
+Axis toAxis(QString axis) {
+	QChar c = axis.isEmpty()?QChar('x'):axis.at(0).toLower();
+	if (c == 'y')
+		return Y_AXIS;
+	else if (c == 'z')
+		return Z_AXIS;
+	return X_AXIS;
+}
+
+axisLookup::axisLookup() {
+	data = 0;
+	n = 0;
+	first = last = inv = 0;
+	uniform = false;
+}
+
+// Check whether the boundaries are uniform, within floating point error of the
+// average width, the lookups below correct any rounding against b itself
+void axisLookup::update(const QVector <double> &b) {
+	data = b.constData();
+	n = b.size()-1;
+	first = n >= 0 ? b[0] : 0;
+	last = n >= 0 ? b[n] : 0;
+	uniform = n > 0 && last > first;
+	
+	if (uniform) {
+		double width = (last-first)/double(n), tol = width*1e-6;
+		for (int i = 0; i < n && uniform; i++)
+			if (fabs(b[i+1]-b[i]-width) > tol)
+				uniform = false;
+		inv = 1.0/width;
+	}
+}
+
+int axisLookup::lower(const QVector <double> &b, double p) {
+	if (b.constData() != data || b.size()-1 != n || (n >= 0 && (b[0] != first || b[n] != last)))
+		update(b);
+	if (n < 1 || p < first || p >= last)
+		return -1;
+	
+	const double* base = b.constData();
+	if (uniform) {
+		int i = int((p-first)*inv);
+		i = i < 0 ? 0 : (i > n-1 ? n-1 : i);
+		while (i > 0 && p < base[i])
+			i--;
+		while (i < n-1 && p >= base[i+1])
+			i++;
+		return i;
+	}
+	
+	// Branchless binary search for the last boundary at or below p
+	int len = n, half;
+	while (len > 1) {
+		half = len/2;
+		base += (base[half] <= p) ? half : 0;
+		len -= half;
+	}
+	return base-b.constData();
+}
+
+int axisLookup::upper(const QVector <double> &b, double p) {
+	if (b.constData() != data || b.size()-1 != n || (n >= 0 && (b[0] != first || b[n] != last)))
+		update(b);
+	if (n < 1 || p < first || p > last)
+		return -1;
+	
+	const double* base = b.constData();
+	if (uniform) {
+		int i = int((p-first)*inv);
+		i = i < 0 ? 0 : (i > n-1 ? n-1 : i);
+		while (i > 0 && p <= base[i])
+			i--;
+		while (i < n-1 && p > base[i+1])
+			i++;
+		return i;
+	}
+	
+	// Branchless binary search for the last boundary below p
+	int len = n, half;
+	while (len > 1) {
+		half = len/2;
+		base += (base[half] < p) ? half : 0;
+		len -= half;
+	}
+	return base-b.constData();
+}
+
 // Output gz egsphant
 void EGSPhant::savegzEGSPhantFilePlus(QString path) { // Progress percentages assume GUI construction
 	// Ripped fairly whole-cloth from egs_brachy
 	ogzstream ogout(path.toStdString().c_str());
 	std::ostream* out = (std::ostream*)(&ogout);
 	if (out->good()) {
-		// Media count
-		(*out) << media.size() << "\n";
-		
-		// Media names
-		for (int i=0; i < media.size(); i++)
-			(*out) << media[i].toStdString() << "\n";
-
-		// (unused) ESTEP per media
-		for (int i=0; i < media.size(); i++)
-			(*out) << " 0.5";
-		(*out) << "\n";
-		
-		// dimensions
-		(*out) << nx << " " << ny << " " << nz << "\n";
-
-		// Boundaries
-		for (int i=0; i < nx; i++)
-			(*out) << x[i] << " ";
-		(*out) << x.last() << "\n";
-		
-		for (int i=0; i < ny; i++)
-			(*out) << y[i] << " ";
-		(*out) << y.last() << "\n";
-		
-		for (int i=0; i < nz; i++)
-			(*out) << z[i] << " ";
-		(*out) << z.last() << "\n";
+		saveHeader(out);
 		
 		double increment = 10./double(nz); // 10%
 		
@@ -109,33 +171,7 @@ void EGSPhant::savegzEGSPhantFile(QString path) {
 	std::ostream* out = (std::ostream*)(&ogout);
 	
 	if (out->good()) {
-		// Media count
-		(*out) << media.size() << "\n";
-		
-		// Media names
-		for (int i=0; i < media.size(); i++)
-			(*out) << media[i].toStdString() << "\n";
-
-		// (unused) ESTEP per media
-		for (int i=0; i < media.size(); i++)
-			(*out) << " 0.5";
-		(*out) << "\n";
-		
-		// dimensions
-		(*out) << nx << " " << ny << " " << nz << "\n";
-
-		// Boundaries
-		for (int i=0; i < nx; i++)
-			(*out) << x[i] << " ";
-		(*out) << x.last() << "\n";
-		
-		for (int i=0; i < ny; i++)
-			(*out) << y[i] << " ";
-		(*out) << y.last() << "\n";
-		
-		for (int i=0; i < nz; i++)
-			(*out) << z[i] << " ";
-		(*out) << z.last() << "\n";
+		saveHeader(out);
 		
 		double increment = 45./double(nz); // 45%
 		
@@ -153,6 +189,46 @@ void EGSPhant::savegzEGSPhantFile(QString path) {
 	}
 }
 
+// Output the egsphant header, everything before the media
+void EGSPhant::saveHeader(std::ostream* out) {
+	// Media count
+	(*out) << media.size() << "\n";
+	
+	// Media names
+	for (int i=0; i < media.size(); i++)
+		(*out) << media[i].toStdString() << "\n";
+
+	// (unused) ESTEP per media
+	for (int i=0; i < media.size(); i++)
+		(*out) << " 0.5";
+	(*out) << "\n";
+	
+	// dimensions
+	(*out) << nx << " " << ny << " " << nz << "\n";
+
+	// Boundaries
+	for (int i=0; i < nx; i++)
+		(*out) << x[i] << " ";
+	(*out) << x.last() << "\n";
+	
+	for (int i=0; i < ny; i++)
+		(*out) << y[i] << " ";
+	(*out) << y.last() << "\n";
+	
+	for (int i=0; i < nz; i++)
+		(*out) << z[i] << " ";
+	(*out) << z.last() << "\n";
+}
+
+// Output the media of every slice without the trailing newline, so that
+// consecutive slabs of a phantom can be appended to the same stream
+void EGSPhant::saveMedia(std::ostream* out) {
+	for (int k = 0; k < nz; k++)
+		for (int j = 0; j < ny; j++)
+			for (int i = 0; i < nx; i++)
+				(*out) << m[i][j][k];
+}
+
 // Make a mask template from another EGSPhant
 void EGSPhant::makeMask(EGSPhant* mask) {
     nx = mask->nx;
@@ -178,6 +254,143 @@ void EGSPhant::makeMask(EGSPhant* mask) {
     media << "OTHER" << "TARGET";
 }
 
+// Crop down to the voxels [i0,i1]x[j0,j1]x[k0,k1], masks have no densities
+// so only the media are cropped for them
+void EGSPhant::crop(int i0, int i1, int j0, int j1, int k0, int k1) {
+	int cx = i1-i0+1, cy = j1-j0+1, cz = k1-k0+1;
+	bool hasDensity = !d.isEmpty();
+	
+	QVector <QVector <QVector <char> > > cm(cx);
+	QVector <QVector <QVector <double> > > cd(hasDensity ? cx : 0);
+	
+	// Each x column is copied as its own task
+	QVector <int> columns(cx);
+	for (int i = 0; i < cx; i++)
+		columns[i] = i;
+	
+	QtConcurrent::blockingMap(columns, [&](int &i) {
+		cm[i].resize(cy);
+		for (int j = 0; j < cy; j++)
+			cm[i][j] = m[i0+i][j0+j].mid(k0, cz);
+		
+		if (hasDensity) {
+			cd[i].resize(cy);
+			for (int j = 0; j < cy; j++)
+				cd[i][j] = d[i0+i][j0+j].mid(k0, cz);
+		}
+	});
+	
+	m = cm;
+	d = cd;
+	
+	x = x.mid(i0, cx+1);
+	y = y.mid(j0, cy+1);
+	z = z.mid(k0, cz+1);
+	nx = cx;
+	ny = cy;
+	nz = cz;
+}
+
+// Resample onto a uniform grid with voxels as close to dx by dy by dz as fits
+// the current extent, each new density is the volume-weighted average of the
+// old densities it overlaps and each new medium is the one overlapping the
+// most volume (so masks resample by majority vote as well)
+void EGSPhant::resample(double dx, double dy, double dz) {
+	int rx = qMax(1, int(round((x.last()-x[0])/dx)));
+	int ry = qMax(1, int(round((y.last()-y[0])/dy)));
+	int rz = qMax(1, int(round((z.last()-z[0])/dz)));
+	bool hasDensity = !d.isEmpty();
+	
+	QVector <double> bx(rx+1), by(ry+1), bz(rz+1);
+	for (int i = 0; i <= rx; i++)
+		bx[i] = x[0]+i*(x.last()-x[0])/rx;
+	for (int j = 0; j <= ry; j++)
+		by[j] = y[0]+j*(y.last()-y[0])/ry;
+	for (int k = 0; k <= rz; k++)
+		bz[k] = z[0]+k*(z.last()-z[0])/rz;
+	bx.last() = x.last();
+	by.last() = y.last();
+	bz.last() = z.last();
+	
+	// For each new voxel along an axis, list the old voxels it overlaps
+	// and the length of each overlap
+	auto overlaps = [](QVector <double> &o, QVector <double> &n) {
+		QVector <QVector <QPair <int, double> > > list(n.size()-1);
+		int a = 0;
+		for (int b = 0; b < n.size()-1; b++) {
+			while (a < o.size()-2 && o[a+1] <= n[b])
+				a++;
+			for (int c = a; c < o.size()-1 && o[c] < n[b+1]; c++) {
+				double len = qMin(o[c+1], n[b+1])-qMax(o[c], n[b]);
+				if (len > 0)
+					list[b] << QPair <int, double> (c, len);
+			}
+		}
+		return list;
+	};
+	QVector <QVector <QPair <int, double> > > ox = overlaps(x, bx), oy = overlaps(y, by), oz = overlaps(z, bz);
+	
+	QVector <QVector <QVector <char> > > rm(rx);
+	QVector <QVector <QVector <double> > > rd(hasDensity ? rx : 0);
+	
+	// Each new x column is its own task
+	QVector <int> columns(rx);
+	for (int i = 0; i < rx; i++)
+		columns[i] = i;
+	
+	QtConcurrent::blockingMap(columns, [&](int &i) {
+		QVector <double> weight(256, 0); // Overlap volume per media character
+		QVector <unsigned char> seen; // Media characters with weight
+		double w, sum, den;
+		unsigned char c, best;
+		
+		rm[i].fill(QVector <char> (rz, 0), ry);
+		if (hasDensity)
+			rd[i].fill(QVector <double> (rz, 0), ry);
+		
+		for (int j = 0; j < ry; j++)
+			for (int k = 0; k < rz; k++) {
+				sum = den = 0;
+				seen.clear();
+				for (int a = 0; a < ox[i].size(); a++)
+					for (int b = 0; b < oy[j].size(); b++)
+						for (int l = 0; l < oz[k].size(); l++) {
+							w = ox[i][a].second*oy[j][b].second*oz[k][l].second;
+							c = m[ox[i][a].first][oy[j][b].first][oz[k][l].first];
+							if (weight[c] == 0)
+								seen << c;
+							weight[c] += w;
+							sum += w;
+							if (hasDensity)
+								den += w*d[ox[i][a].first][oy[j][b].first][oz[k][l].first];
+						}
+				
+				// Majority vote media, and reset the weights that were used
+				best = seen.isEmpty() ? 0 : seen[0];
+				for (int s = 0; s < seen.size(); s++) {
+					if (weight[seen[s]] > weight[best])
+						best = seen[s];
+				}
+				for (int s = 0; s < seen.size(); s++)
+					weight[seen[s]] = 0;
+				
+				rm[i][j][k] = best;
+				if (hasDensity)
+					rd[i][j][k] = sum > 0 ? den/sum : 0;
+			}
+	});
+	
+	m = rm;
+	d = rd;
+	
+	x = bx;
+	y = by;
+	z = bz;
+	nx = rx;
+	ny = ry;
+	nz = rz;
+}
+
 void EGSPhant::loadEGSPhantFile(QString path) {
     QFile file(path);
 
@@ -670,36 +883,10 @@ void EGSPhant::loadgzEGSPhantFilePlus(QString path) {
 }
 
 char EGSPhant::getMedia(double px, double py, double pz) {
-    int ix, iy, iz;
-    ix = iy = iz = -1;
-
     // Find the index of the boundary that is less than px, py and pz
-    for (int i = 0; i < nx; i++)
-        if (px <= x[i+1]) {
-            ix = i;
-            break;
-        }
-    if (px < x[0]) {
-        ix = -1;
-    }
-
-    for (int i = 0; i < ny; i++)
-        if (py <= y[i+1]) {
-            iy = i;
-            break;
-        }
-    if (py < y[0]) {
-        iy = -1;
-    }
-
-    for (int i = 0; i < nz; i++)
-        if (pz <= z[i+1]) {
-            iz = i;
-            break;
-        }
-    if (pz < z[0]) {
-        iz = -1;
-    }
+    int ix = lookup[X_AXIS].upper(x, px);
+    int iy = lookup[Y_AXIS].upper(y, py);
+    int iz = lookup[Z_AXIS].upper(z, pz);
 
     // This is to insure that no area outside the vectors is accessed
     if (ix < nx && ix >= 0 && iy < ny && iy >= 0 && iz < nz && iz >= 0) {
@@ -710,36 +897,10 @@ char EGSPhant::getMedia(double px, double py, double pz) {
 }
 
 double EGSPhant::getDensity(double px, double py, double pz) {
-    int ix, iy, iz;
-    ix = iy = iz = -1;
-
     // Find the index of the boundary that is less than px, py and pz
-    for (int i = 0; i < nx; i++)
-        if (px <= x[i+1]) {
-            ix = i;
-            break;
-        }
-    if (px < x[0]) {
-        ix = -1;
-    }
-
-    for (int i = 0; i < ny; i++)
-        if (py <= y[i+1]) {
-            iy = i;
-            break;
-        }
-    if (py < y[0]) {
-        iy = -1;
-    }
-
-    for (int i = 0; i < nz; i++)
-        if (pz <= z[i+1]) {
-            iz = i;
-            break;
-        }
-    if (pz < z[0]) {
-        iz = -1;
-    }
+    int ix = lookup[X_AXIS].upper(x, px);
+    int iy = lookup[Y_AXIS].upper(y, py);
+    int iz = lookup[Z_AXIS].upper(z, pz);
 
     // This is to insure that no area outside the vectors is accessed
     if (ix < nx && ix >= 0 && iy < ny && iy >= 0 && iz < nz && iz >= 0) {
@@ -765,129 +926,117 @@ void EGSPhant::setDensity(int px, int py, int pz, double density) {
     }
 }
 
-int EGSPhant::getIndex(QString axis, double p) {
-    int index = -1;
-
-    if (!axis.compare("x axis")) {
-        for (int i = 0; i < nx; i++)
-            if (p < x[i+1]) {
-                index = i;
-                break;
-            }
-        if (p < x[0]) {
-            index = -1;
-        }
-    }
-    else if (!axis.compare("y axis")) {
-        for (int i = 0; i < ny; i++)
-            if (p < y[i+1]) {
-                index = i;
-                break;
-            }
-        if (p < y[0]) {
-            index = -1;
-        }
-    }
-    else if (!axis.compare("z axis")) {
-        for (int i = 0; i < nz; i++)
-            if (p < z[i+1]) {
-                index = i;
-                break;
-            }
-        if (p < z[0]) {
-            index = -1;
-        }
-    }
+int EGSPhant::getIndex(Axis axis, double p) {
+    if (axis == X_AXIS)
+        return lookup[X_AXIS].lower(x, p);
+    else if (axis == Y_AXIS)
+        return lookup[Y_AXIS].lower(y, p);
+    return lookup[Z_AXIS].lower(z, p); // -1 if we are out of bounds
+}
 
-    return index; // -1 if we are out of bounds
+void EGSPhant::prepareLookups() {
+	lookup[X_AXIS].lower(x, 0);
+	lookup[Y_AXIS].lower(y, 0);
+	lookup[Z_AXIS].lower(z, 0);
 }
 
-QImage EGSPhant::getEGSPhantPicMed(QString axis, double ai, double af,
-                                   double bi, double bf, double d, int res) {
-    // Create a temporary image
-    int width  = (af-ai)*res; // Reversed on the image
-    int height = (bf-bi)*res; // Reversed on the image
-    QImage image(height, width, QImage::Format_ARGB32_Premultiplied);
-    double hInc, wInc, cInc;
-    double h, w;
-	int c;
-	char med;
-	QString indeces("123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
+// Tables of the voxels sampled by each pixel of an image sliced through axis at
+// d, columns running along the first other axis and rows along the second,
+// found with the same convention as getMedia and getDensity
+void EGSPhant::getSliceMap(sliceMap* map, Axis axis, double ai, double af,
+                           double bi, double bf, double d, int res) {
+	Axis hAxis = axis == X_AXIS ? Y_AXIS : X_AXIS, wAxis = axis == Z_AXIS ? Y_AXIS : Z_AXIS;
+	int width  = (af-ai)*res; // Reversed on the image
+	int height = (bf-bi)*res; // Reversed on the image
+	double inc = 1/double(res);
+	
+	map->axis  = axis;
+	map->depth = lookup[axis].upper(bounds(axis), d);
+	map->nh = bounds(hAxis).size()-1;
+	map->nw = bounds(wAxis).size()-1;
+	
+	map->h.resize(height);
+	for (int i = 0; i < height; i++)
+		map->h[i] = lookup[hAxis].upper(bounds(hAxis), (double(bi)) + inc * double(i));
+	map->w.resize(width);
+	for (int j = 0; j < width; j++)
+		map->w[j] = lookup[wAxis].upper(bounds(wAxis), (double(ai)) + inc * double(j));
+}
 
-    // Calculate the size (in cm) of pixels, and then the range for grayscaling
-    wInc = 1/double(res);
-    hInc = 1/double(res);
-    cInc = 255.0/double(media.size()+1);
-
-    for (int i = 0; i < height; i++)
-        for (int j = 0; j < width; j++) {
-            // determine the location of the current pixel in the phantom
-            h = (double(bi)) + hInc * double(i);
-            w = (double(ai)) + wInc * double(j);
-
-            // get the media, which differs based on axis through which image is
-            // sliced
-            if (!axis.compare("x axis")) {
-                med = getMedia(d, h, w);
-            }
-            else if (!axis.compare("y axis")) {
-                med = getMedia(h, d, w);
-            }
-            else if (!axis.compare("z axis")) {
-                med = getMedia(h, w, d);
-            }
+QImage paintSlice(const sliceMap &map, const QVector <QRgb> &plane, QRgb outside) {
+	int height = map.h.size(), width = map.w.size();
+	QImage image(height, width, QImage::Format_ARGB32_Premultiplied);
+	
+	// Fetch the pixels once here, so the tiles never touch the QImage itself
+	uchar* bits = image.bits();
+	int stride = image.bytesPerLine();
+	const int* h = map.h.constData();
+	const QRgb* p = plane.constData();
+	
+	QVector <int> tiles((width+SLICE_TILE_ROWS-1)/SLICE_TILE_ROWS);
+	for (int t = 0; t < tiles.size(); t++)
+		tiles[t] = t;
+	
+	QtConcurrent::blockingMap(tiles, [&](int &t) {
+		int end = (t+1)*SLICE_TILE_ROWS < width ? (t+1)*SLICE_TILE_ROWS : width;
+		for (int j = t*SLICE_TILE_ROWS; j < end; j++) {
+			QRgb* line = (QRgb*)(bits+j*stride);
+			if (map.depth < 0 || map.w[j] < 0) {
+				for (int i = 0; i < height; i++)
+					line[i] = outside;
+				continue;
+			}
 			
-			c = (indeces.indexOf(med)+1)*cInc;
-
-            // finally, paint the pixel
-            image.setPixel(i, j, qRgb(c, c, c));
-        }
+			const QRgb* row = p+map.w[j]*map.nh;
+			for (int i = 0; i < height; i++)
+				line[i] = h[i] < 0 ? outside : row[h[i]];
+		}
+	});
+	
+	return image;
+}
 
-    return image; // return the image created
+QImage EGSPhant::getEGSPhantPicMed(Axis axis, double ai, double af,
+                                   double bi, double bf, double d, int res) {
+	sliceMap map;
+	getSliceMap(&map, axis, ai, af, bi, bf, d, res);
+	
+	// Grayscale of every media character, media outside of the phantom being 0
+	QString indeces("123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
+	double cInc = 255.0/double(media.size()+1);
+	QRgb grey[256];
+	int c;
+	for (int n = 0; n < 256; n++) {
+		c = (indeces.indexOf(QChar(char(n)))+1)*cInc;
+		grey[n] = qRgb(c, c, c);
+	}
+	
+	// The voxels are only read through const references from the tasks
+	const QVector <QVector <QVector <char> > > &cm = m;
+	QVector <QRgb> plane;
+	slicePlane(&plane, map, [&](int i, int j, int k) {return grey[(unsigned char)cm[i][j][k]];});
+	
+	return paintSlice(map, plane, grey[0]); // return the image created
 }
 
-QImage EGSPhant::getEGSPhantPicDen(QString axis, double ai, double af,
+QImage EGSPhant::getEGSPhantPicDen(Axis axis, double ai, double af,
                                    double bi, double bf, double d, int res,
 								   double di, double df) {
-    // Create a temporary image
-    int width  = (af-ai)*res; // Reversed on the image
-    int height = (bf-bi)*res; // Reversed on the image
-    QImage image(height, width, QImage::Format_ARGB32_Premultiplied);
-    double hInc, wInc, cInc;
-    double h, w, den = 0;
-	int	c;
-
-    // Calculate the size (in cm) of pixels, and then the range for grayscaling
-    wInc = 1/double(res);
-    hInc = 1/double(res);
-    cInc = 255.0/(df-di);
-
-    for (int i = 0; i < height; i++)
-        for (int j = 0; j < width; j++) {
-            // determine the location of the current pixel in the phantom
-            h = (double(bi)) + hInc * double(i);
-            w = (double(ai)) + wInc * double(j);
-
-            // get the density, which differs based on axis through which image
-            // os sliced
-            if (!axis.compare("x axis")) {
-                den = getDensity(d, h, w);
-            }
-            else if (!axis.compare("y axis")) {
-                den = getDensity(h, d, w);
-            }
-            else if (!axis.compare("z axis")) {
-                den = getDensity(h, w, d);
-            }
-			
-			// if c is out of bounds, set it to zero
-			// else if c is below the minimum density, set it to minimum density
-			// else if c is above the maximum density, set it to maximum density
-			c = ((den==-1)?0:(den<di?di:(den>df?df:den)))*cInc;
-
-            // finally, paint the pixel
-            image.setPixel(i, j, qRgb(c, c, c));
-        }
-
-    return image; // return the image created
-}
\ No newline at end of file
+	sliceMap map;
+	getSliceMap(&map, axis, ai, af, bi, bf, d, res);
+	
+	// Calculate the range for grayscaling, densities below di are set to di
+	// and those above df are set to df, while outside of the phantom is 0
+	double cInc = 255.0/(df-di);
+	
+	// The voxels are only read through const references from the tasks
+	const QVector <QVector <QVector <double> > > &cd = this->d;
+	QVector <QRgb> plane;
+	slicePlane(&plane, map, [&](int i, int j, int k) {
+		double den = cd[i][j][k];
+		int c = (den<di?di:(den>df?df:den))*cInc;
+		return qRgb(c, c, c);
+	});
+	
+	return paintSlice(map, plane, qRgb(0, 0, 0)); // return the image created
+}
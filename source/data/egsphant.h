@@ -40,10 +40,74 @@
 #define EGSPHANT_H
 
 #include <QtWidgets>
+#include <QtConcurrent>
 #include <iostream>
 #include <math.h>
 #include "libraries/gzstream.h"
 
+#define SLICE_TILE_ROWS 32 // Image rows painted by each task of paintSlice
+
+// Axes of the phantom and dose grids
+enum Axis {X_AXIS = 0, Y_AXIS = 1, Z_AXIS = 2};
+Axis toAxis(QString axis); // Accepts "x axis", "X" and the like
+
+// Finds the voxel containing a position along one axis, uniform boundaries
+// are detected the first time they are seen and looked up arithmetically,
+// others by binary search, the boundaries are always passed in and the cache
+// is rebuilt whenever they change, so query once before sharing across threads
+class axisLookup {
+public:
+	axisLookup();
+	
+	int lower(const QVector <double> &b, double p); // b[i] <= p < b[i+1], -1 outside
+	int upper(const QVector <double> &b, double p); // b[i] < p <= b[i+1] (b[0] is 0), -1 outside
+	
+private:
+	void update(const QVector <double> &b);
+	
+	const double* data; // Cached boundaries, checked with their first and last value
+	int n; // Number of voxels
+	double first, last;
+	bool uniform;
+	double inv; // Inverse voxel width of uniform boundaries
+};
+
+// Voxel indices of every pixel column (h) and row (w) of a slice image, and of
+// the slice itself, -1 wherever the image leaves the grid
+struct sliceMap {
+	Axis axis; // Axis the slice is perpendicular to
+	int depth;
+	int nh, nw; // Number of voxels along the column and row axes
+	QVector <int> h, w;
+};
+
+// Colour every voxel of the slice once, colour(i, j, k) giving the colour (or
+// any other value) of voxel (i, j, k), stored row by row so image rows read
+// it contiguously, each row being its own task so colour is called concurrently
+template <class T, class Colour>
+void slicePlane(QVector <T> *plane, const sliceMap &map, const Colour &colour) {
+	plane->resize(map.nh*map.nw);
+	if (map.depth < 0)
+		return;
+	
+	QVector <int> rows(map.nw);
+	for (int wv = 0; wv < map.nw; wv++)
+		rows[wv] = wv;
+	
+	T* p = plane->data();
+	QtConcurrent::blockingMap(rows, [&](int &wv) {
+		T* line = p+wv*map.nh;
+		for (int hv = 0; hv < map.nh; hv++)
+			line[hv] = map.axis == X_AXIS ? colour(map.depth, hv, wv) :
+			          (map.axis == Y_AXIS ? colour(hv, map.depth, wv) : colour(hv, wv, map.depth));
+	});
+}
+
+// Paint an image of the slice from the voxel colours of slicePlane, writing
+// tiles of SLICE_TILE_ROWS rows concurrently through their scan lines, pixels
+// outside of the grid get outside
+QImage paintSlice(const sliceMap &map, const QVector <QRgb> &plane, QRgb outside);
+
 class EGSPhant : public QObject {
     Q_OBJECT
 
@@ -53,6 +117,8 @@ signals:
 public:
     EGSPhant();
 	void makeMask(EGSPhant* mask); // Useful for later analysis
+	void crop(int i0, int i1, int j0, int j1, int k0, int k1); // Keep voxels [i0,i1]x[j0,j1]x[k0,k1]
+	void resample(double dx, double dy, double dz); // Move to a uniform grid with these voxel sizes
 
     int nx, ny, nz; // these hold the number of voxels
     QVector <double> x, y, z; // these hold the boundaries of the above voxels
@@ -70,21 +136,29 @@ public:
 	
     void savegzEGSPhantFile(QString path);
 	void savegzEGSPhantFilePlus(QString path);
+	void saveHeader(std::ostream* out);
+	void saveMedia(std::ostream* out);
 	
 	void setDensity(int px, int py, int pz, double density);
 
     char getMedia(double px, double py, double pz);
     double getDensity(double px, double py, double pz);
     double getDensity(int px, int py, int pz);
-    int getIndex(QString axis, double p);
-    QImage getEGSPhantPicDen(QString axis, double ai, double af,
+    int getIndex(Axis axis, double p);
+	const QVector <double> &bounds(Axis axis) {return axis == X_AXIS ? x : (axis == Y_AXIS ? y : z);}
+	void getSliceMap(sliceMap* map, Axis axis, double ai, double af, double bi, double bf, double d, int res);
+	void prepareLookups(); // Build the axis lookups now, so threads sharing this only read them
+    QImage getEGSPhantPicDen(Axis axis, double ai, double af,
                              double bi, double bf, double d, int res,
 							 double di, double df);
-    QImage getEGSPhantPicMed(QString axis, double ai, double af,
+    QImage getEGSPhantPicMed(Axis axis, double ai, double af,
                              double bi, double bf, double d, int res);
 
     // Image Processing
     void loadMaps();
+	
+private:
+	axisLookup lookup[3]; // One per axis
 };
 
 #endif
@@ -540,6 +540,7 @@ void Interface::phantomDeleteFile() {
 	// Delete all associated files
 	QFile(data->localDirPhants[i]+matchingNames[0]->text()).remove();
 	QFile(data->localDirPhants[i]+fileName+".log").remove();
+	QFile(data->localDirPhants[i]+fileName+".ct.gz").remove();
 	
 	QDirIterator files (data->gui_location+"/database/mask/", {QString(fileName)+".*.egsphant.gz"},
 						QDir::NoFilter, QDirIterator::Subdirectories);
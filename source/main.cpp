@@ -40,12 +40,18 @@
 #include "GUI/ebInterface.h"
 #include "GUI/phantInterface.h"
 #include "GUI/sourceInterface.h"
+#include "batch.h"
 
 #include <QtGui>
 #include <iostream>
 #include <math.h>
 
 int main(int argc, char **argv) {
+    // Render slices headlessly when asked to, before any window is made
+    for (int i = 1; i < argc; i++)
+        if (QString(argv[i]) == "--batch")
+            return batchMain(argc, argv);
+	
     QApplication app(argc, argv);
 
     Interface w;
@@ -4,6 +4,7 @@
 
 QT += widgets
 QT += charts
+QT += concurrent
 LIBS += -lz
 TEMPLATE = app
 TARGET = ../eb_gui
@@ -21,7 +22,8 @@ DEFINES += QT_DEPRECATED_WARNINGS
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 # Input
-HEADERS += data.h \
+HEADERS += batch.h \
+           data.h \
            interface.h \
            data/DICOM.h \
            data/dose.h \
@@ -33,7 +35,8 @@ HEADERS += data.h \
            GUI/phantInterface.h \
            GUI/sourceInterface.h \
            libraries/gzstream.h
-SOURCES += data.cpp \
+SOURCES += batch.cpp \
+           data.cpp \
            interface.cpp \
            main.cpp \
            data/database.cpp \